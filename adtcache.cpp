@@ -0,0 +1,322 @@
+#include "adtcache.h"
+#include "maptile.h"
+#include "wowmapview.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+ADTCache gADTCache;
+
+struct ADTCacheHeader {
+	char magic[4];
+	uint32 version;
+	uint32 archivekey;
+	uint32 size;
+	uint32 nTextures, nModels, nWMOs;
+	uint32 ofsNames, sizeNames;
+	uint32 nModelPlacements, ofsModelPlacements;
+	uint32 nWMOPlacements, ofsWMOPlacements;
+	uint32 ofsChunks;
+};
+
+struct ADTCacheChunk {
+	uint32 flags, holes, areaID, nTextures;
+	uint32 texidx[4], animated[4];
+	float xbase, ybase, zbase, r;
+	float vmin[3], vmax[3];
+	uint32 haswater;
+	float waterlevel;
+	// offsets of the data blocks, 0 if not present
+	uint32 ofsVertices, ofsNormals, ofsAlpha[3], ofsShadow, ofsLiquid;
+};
+
+
+MappedFile::MappedFile(const char *filename): data(0), size(0)
+{
+#ifdef _WIN32
+	mapping = 0;
+	file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		file = 0;
+		return;
+	}
+	size = GetFileSize(file, 0);
+	if (size == 0 || size == INVALID_FILE_SIZE) {
+		size = 0;
+		return;
+	}
+	mapping = CreateFileMapping(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!mapping) return;
+	data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+	size = (size_t)st.st_size;
+	void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) data = (char*)p;
+#endif
+	if (!data) size = 0;
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+#else
+	if (data) munmap(data, size);
+	if (fd >= 0) close(fd);
+#endif
+}
+
+
+ADTCache::ADTCache(): archivekey(2166136261u), enabled(false), dir("cache")
+{
+}
+
+void ADTCache::addArchive(const char *filename)
+{
+	// fold name, size and modification time of the archive into the key (FNV-1a)
+	struct stat st;
+	unsigned int v[2] = {0, 0};
+	if (stat(filename, &st) == 0) {
+		v[0] = (unsigned int)st.st_size;
+		v[1] = (unsigned int)st.st_mtime;
+	}
+	for (const char *p = filename; *p; p++) {
+		archivekey = (archivekey ^ (unsigned char)*p) * 16777619u;
+	}
+	unsigned char *b = (unsigned char*)v;
+	for (size_t i=0; i<sizeof(v); i++) {
+		archivekey = (archivekey ^ b[i]) * 16777619u;
+	}
+}
+
+string ADTCache::cacheName(const char *filename)
+{
+	// World\Maps\Azeroth\Azeroth_32_48.adt -> cache/Azeroth_32_48.wtc
+	string name(filename);
+	size_t p = name.find_last_of("\\/");
+	if (p != string::npos) name = name.substr(p+1);
+	p = name.find_last_of('.');
+	if (p != string::npos) name = name.substr(0, p);
+	return dir + "/" + name + ".wtc";
+}
+
+// throws away what a half read cache file put into the tile, decode() starts from empty lists
+static bool rejectCache(MapTile *mt, MappedFile *mf, const string &name)
+{
+	gLog("-> Tile cache %s is damaged\n", name.c_str());
+	mt->textures.clear();
+	mt->models.clear();
+	mt->wmos.clear();
+	mt->modelps.clear();
+	mt->wmops.clear();
+	delete mf;
+	return false;
+}
+
+bool ADTCache::load(MapTile *mt, const char *filename)
+{
+	if (!enabled) return false;
+
+	string name = cacheName(filename);
+	MappedFile *mf = new MappedFile(name.c_str());
+	char *base = mf->data;
+	size_t size = mf->size;
+
+	ADTCacheHeader *h = (ADTCacheHeader*)base;
+	if (!base || size < sizeof(ADTCacheHeader) || memcmp(h->magic, "WMVC", 4)
+		|| h->version != ADTCACHE_VERSION || h->archivekey != archivekey || h->size != size
+		|| !mf->holds(h->ofsNames, h->sizeNames, 1)
+		|| !mf->holds(h->ofsModelPlacements, h->nModelPlacements, sizeof(ModelPlacement))
+		|| !mf->holds(h->ofsWMOPlacements, h->nWMOPlacements, sizeof(WMOPlacement))
+		|| !mf->holds(h->ofsChunks, 256, sizeof(ADTCacheChunk))) {
+		delete mf;
+		return false;
+	}
+
+	// resolved texture, model and wmo names
+	char *p = base + h->ofsNames, *pend = p + h->sizeNames;
+	for (uint32 i=0; i < h->nTextures + h->nModels + h->nWMOs; i++) {
+		if (p >= pend || !memchr(p, 0, pend-p)) return rejectCache(mt, mf, name);
+		if (i < h->nTextures) mt->textures.push_back(p);
+		else if (i < h->nTextures + h->nModels) mt->models.push_back(p);
+		else mt->wmos.push_back(p);
+		p += strlen(p)+1;
+	}
+
+	// the placements index the name lists when the tile is uploaded
+	ModelPlacement *mp = (ModelPlacement*)(base + h->ofsModelPlacements);
+	WMOPlacement *wp = (WMOPlacement*)(base + h->ofsWMOPlacements);
+	bool placed = true;
+	for (uint32 i=0; i<h->nModelPlacements; i++) placed = placed && mp[i].nameid < h->nModels;
+	for (uint32 i=0; i<h->nWMOPlacements; i++) placed = placed && wp[i].nameid < h->nWMOs;
+	if (!placed) return rejectCache(mt, mf, name);
+	mt->modelps.assign(mp, mp + h->nModelPlacements);
+	mt->wmops.assign(wp, wp + h->nWMOPlacements);
+
+	ADTCacheChunk *cc = (ADTCacheChunk*)(base + h->ofsChunks);
+	for (int j=0; j<16; j++) {
+		for (int i=0; i<16; i++, cc++) {
+			MapChunk &c = mt->chunks[j][i];
+			c.mt = mt;
+			c.data = 0;
+			c.flags = cc->flags;
+			c.holes = cc->holes;
+			c.hasholes = (c.holes != 0);
+			c.areaID = cc->areaID;
+			c.nTextures = cc->nTextures > 4 ? 4 : cc->nTextures;
+			for (int k=0; k<4; k++) {
+				c.texidx[k] = cc->texidx[k];
+				c.animated[k] = cc->animated[k];
+			}
+			c.xbase = cc->xbase;
+			c.ybase = cc->ybase;
+			c.zbase = cc->zbase;
+			c.r = cc->r;
+			c.vmin = Vec3D(cc->vmin[0], cc->vmin[1], cc->vmin[2]);
+			c.vmax = Vec3D(cc->vmax[0], cc->vmax[1], cc->vmax[2]);
+			c.haswater = cc->haswater != 0;
+			c.waterlevel = cc->waterlevel;
+
+			bool valid = cc->ofsVertices && mf->holds(cc->ofsVertices, mapbufsize, sizeof(Vec3D))
+				&& cc->ofsNormals && mf->holds(cc->ofsNormals, mapbufsize, sizeof(Vec3D))
+				&& mf->holds(cc->ofsShadow, 64*64, 1)
+				&& (!c.haswater || (cc->ofsLiquid && mf->holds(cc->ofsLiquid, lqdatasize, 1)));
+			for (int k=0; k<c.nTextures-1; k++) {
+				valid = valid && mf->holds(cc->ofsAlpha[k], 64*64, 1);
+			}
+			for (int k=0; k<c.nTextures; k++) {
+				valid = valid && c.texidx[k] >= 0 && c.texidx[k] < (int)mt->textures.size();
+			}
+			if (!valid) return rejectCache(mt, mf, name);
+
+			c.tv = (Vec3D*)(base + cc->ofsVertices);
+			c.tn = (Vec3D*)(base + cc->ofsNormals);
+			for (int k=0; k<3; k++) c.amaps[k] = cc->ofsAlpha[k] ? (unsigned char*)(base + cc->ofsAlpha[k]) : 0;
+			c.smap = cc->ofsShadow ? (unsigned char*)(base + cc->ofsShadow) : 0;
+			c.lqdata = cc->ofsLiquid ? base + cc->ofsLiquid : 0;
+		}
+	}
+
+	// the mapping stays alive until the tile has been uploaded
+	mt->cachefile = mf;
+	gLog("-> Using tile cache %s\n", name.c_str());
+	return true;
+}
+
+// append a 4-byte aligned block to the output buffer, returns its offset
+static uint32 appendBlock(vector<char> &buf, const void *p, size_t len)
+{
+	while (buf.size() & 3) buf.push_back(0);
+	uint32 ofs = (uint32)buf.size();
+	buf.insert(buf.end(), (const char*)p, (const char*)p + len);
+	return ofs;
+}
+
+void ADTCache::save(MapTile *mt, const char *filename)
+{
+	if (!enabled) return;
+
+	vector<char> buf;
+	ADTCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	buf.resize(sizeof(h));
+
+	memcpy(h.magic, "WMVC", 4);
+	h.version = ADTCACHE_VERSION;
+	h.archivekey = archivekey;
+
+	vector<char> names;
+	for (vector<string>::iterator it = mt->textures.begin(); it != mt->textures.end(); ++it) names.insert(names.end(), it->c_str(), it->c_str() + it->size() + 1);
+	for (vector<string>::iterator it = mt->models.begin(); it != mt->models.end(); ++it) names.insert(names.end(), it->c_str(), it->c_str() + it->size() + 1);
+	for (vector<string>::iterator it = mt->wmos.begin(); it != mt->wmos.end(); ++it) names.insert(names.end(), it->c_str(), it->c_str() + it->size() + 1);
+	h.nTextures = (uint32)mt->textures.size();
+	h.nModels = (uint32)mt->models.size();
+	h.nWMOs = (uint32)mt->wmos.size();
+	h.sizeNames = (uint32)names.size();
+	h.ofsNames = names.empty() ? 0 : appendBlock(buf, &names[0], names.size());
+
+	h.nModelPlacements = (uint32)mt->modelps.size();
+	h.ofsModelPlacements = mt->modelps.empty() ? 0 : appendBlock(buf, &mt->modelps[0], mt->modelps.size() * sizeof(ModelPlacement));
+	h.nWMOPlacements = (uint32)mt->wmops.size();
+	h.ofsWMOPlacements = mt->wmops.empty() ? 0 : appendBlock(buf, &mt->wmops[0], mt->wmops.size() * sizeof(WMOPlacement));
+
+	ADTCacheChunk cc[256];
+	memset(cc, 0, sizeof(cc));
+	h.ofsChunks = appendBlock(buf, cc, sizeof(cc));
+
+	for (int j=0; j<16; j++) {
+		for (int i=0; i<16; i++) {
+			MapChunk &c = mt->chunks[j][i];
+			ADTCacheChunk &d = cc[j*16+i];
+			d.flags = c.flags;
+			d.holes = c.holes;
+			d.areaID = c.areaID;
+			d.nTextures = c.nTextures;
+			for (int k=0; k<c.nTextures; k++) {
+				d.texidx[k] = c.texidx[k];
+				d.animated[k] = c.animated[k];
+			}
+			d.xbase = c.xbase;
+			d.ybase = c.ybase;
+			d.zbase = c.zbase;
+			d.r = c.r;
+			d.vmin[0] = c.vmin.x; d.vmin[1] = c.vmin.y; d.vmin[2] = c.vmin.z;
+			d.vmax[0] = c.vmax.x; d.vmax[1] = c.vmax.y; d.vmax[2] = c.vmax.z;
+			d.haswater = c.haswater ? 1 : 0;
+			d.waterlevel = c.waterlevel;
+
+			d.ofsVertices = appendBlock(buf, c.tv, mapbufsize*sizeof(Vec3D));
+			d.ofsNormals = appendBlock(buf, c.tn, mapbufsize*sizeof(Vec3D));
+			for (int k=0; k<c.nTextures-1; k++) {
+				if (c.amaps[k]) d.ofsAlpha[k] = appendBlock(buf, c.amaps[k], 64*64);
+			}
+			if (c.smap) d.ofsShadow = appendBlock(buf, c.smap, 64*64);
+			if (c.haswater) d.ofsLiquid = appendBlock(buf, c.lqdata, lqdatasize);
+		}
+	}
+
+	memcpy(&buf[h.ofsChunks], cc, sizeof(cc));
+	h.size = (uint32)buf.size();
+	memcpy(&buf[0], &h, sizeof(h));
+
+	// write to a temporary file first so an interrupted write never leaves a valid looking cache
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0755);
+#endif
+	string name = cacheName(filename);
+	string tmpname = name + ".tmp";
+	FILE *f = fopen(tmpname.c_str(), "wb");
+	if (!f) {
+		gLog("-> Could not write tile cache %s\n", tmpname.c_str());
+		return;
+	}
+	bool written = fwrite(&buf[0], buf.size(), 1, f) == 1;
+	written = (fclose(f) == 0) && written;
+	remove(name.c_str());
+	if (!written || rename(tmpname.c_str(), name.c_str()) != 0) {
+		gLog("-> Could not write tile cache %s\n", name.c_str());
+		remove(tmpname.c_str());
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef ADTCACHE_H
+#define ADTCACHE_H
+
+#include <string>
+
+class MapTile;
+
+/*
+	On-disk cache of decoded ADT tiles.
+
+	A cache file holds everything MapTile::decode() would produce: texture, model and
+	wmo names, raw placement records and per chunk vertices, normals, expanded alpha
+	and shadow maps and liquid data. On a later visit the file is mapped into memory
+	and the chunks upload straight from the mapping.
+
+	Files are versioned and stamped with a key built from the size and modification
+	time of every opened archive, so a patched client invalidates the cache.
+*/
+
+const int ADTCACHE_VERSION = 1;
+
+// read-only memory mapped file
+class MappedFile {
+#ifdef _WIN32
+	void *file, *mapping;
+#else
+	int fd;
+#endif
+public:
+	char *data;
+	size_t size;
+
+	MappedFile(const char *filename);
+	~MappedFile();
+
+	// whether count records of recsize bytes from ofs on are inside the file, without overflowing
+	bool holds(size_t ofs, size_t count, size_t recsize) const
+	{
+		return ofs <= size && count <= (size - ofs) / recsize;
+	}
+};
+
+class ADTCache {
+	unsigned int archivekey;
+
+	std::string cacheName(const char *filename);
+
+public:
+	bool enabled;
+	std::string dir;
+
+	ADTCache();
+
+	void addArchive(const char *filename);
+	// stamps other files derived from the archives too
+	unsigned int key() const { return archivekey; }
+
+	bool load(MapTile *mt, const char *filename);
+	void save(MapTile *mt, const char *filename);
+};
+
+extern ADTCache gADTCache;
+
+#endif
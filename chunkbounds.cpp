@@ -0,0 +1,72 @@
+#include "chunkbounds.h"
+#include "maptile.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+#define CHUNKBOUNDS_SSE
+#include <xmmintrin.h>
+#endif
+
+void ChunkBounds::set(int i, MapChunk *c)
+{
+	minx[i] = c->vmin.x;
+	miny[i] = c->vmin.y;
+	minz[i] = c->vmin.z;
+	maxx[i] = c->vmax.x;
+	maxy[i] = c->vmax.y;
+	maxz[i] = c->vmax.z;
+	chunks[i] = c;
+}
+
+int ChunkBounds::cull(const Frustum &frustum, MapChunk **out) const
+{
+#ifdef CHUNKBOUNDS_SSE
+	// per plane: which of min/max is the furthest corner along the normal, the same for all boxes
+	const float *px[6], *py[6], *pz[6];
+	__m128 a[6], b[6], c[6], d[6];
+	for (int p=0; p<6; p++) {
+		const Plane &pl = frustum.planes[p];
+		px[p] = pl.a > 0 ? maxx : minx;
+		py[p] = pl.b > 0 ? maxy : miny;
+		pz[p] = pl.c > 0 ? maxz : minz;
+		a[p] = _mm_set1_ps(pl.a);
+		b[p] = _mm_set1_ps(pl.b);
+		c[p] = _mm_set1_ps(pl.c);
+		d[p] = _mm_set1_ps(pl.d);
+	}
+
+	const __m128 zero = _mm_setzero_ps();
+	int n = 0;
+	for (int i=0; i<chunkboundsize; i+=4) {
+		__m128 in = _mm_cmpeq_ps(zero, zero);
+		for (int p=0; p<6; p++) {
+			__m128 dist = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a[p], _mm_loadu_ps(px[p] + i)), _mm_mul_ps(b[p], _mm_loadu_ps(py[p] + i))),
+				_mm_add_ps(_mm_mul_ps(c[p], _mm_loadu_ps(pz[p] + i)), d[p]));
+			in = _mm_and_ps(in, _mm_cmpgt_ps(dist, zero));
+		}
+		int mask = _mm_movemask_ps(in);
+		for (int k=0; k<4; k++) {
+			if (mask & (1 << k)) out[n++] = chunks[i+k];
+		}
+	}
+	return n;
+#else
+	return cullScalar(frustum, out);
+#endif
+}
+
+int ChunkBounds::cullScalar(const Frustum &frustum, MapChunk **out) const
+{
+	int n = 0;
+	for (int i=0; i<chunkboundsize; i++) {
+		bool in = true;
+		for (int p=0; p<6 && in; p++) {
+			const Plane &pl = frustum.planes[p];
+			float dist = pl.a * (pl.a > 0 ? maxx[i] : minx[i]) + pl.b * (pl.b > 0 ? maxy[i] : miny[i])
+				+ pl.c * (pl.c > 0 ? maxz[i] : minz[i]) + pl.d;
+			in = dist > 0;
+		}
+		if (in) out[n++] = chunks[i];
+	}
+	return n;
+}
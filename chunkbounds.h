@@ -0,0 +1,31 @@
+#ifndef CHUNKBOUNDS_H
+#define CHUNKBOUNDS_H
+
+#include "frustum.h"
+
+class MapChunk;
+
+/*
+	Bounding boxes of a tile's 256 chunks, stored as one array per coordinate so
+	they can be tested against the frustum four at a time with SSE (plain C++
+	where that isn't available). A box is outside if its corner furthest along
+	a plane's normal is behind that plane, which gives the same answer as
+	Frustum::intersects without looking at all 8 corners.
+*/
+
+const int chunkboundsize = 256;
+
+struct ChunkBounds {
+	float minx[chunkboundsize], miny[chunkboundsize], minz[chunkboundsize];
+	float maxx[chunkboundsize], maxy[chunkboundsize], maxz[chunkboundsize];
+	MapChunk *chunks[chunkboundsize];
+
+	void set(int i, MapChunk *c);
+
+	// writes the chunks in view to out, returns how many there are
+	int cull(const Frustum &frustum, MapChunk **out) const;
+	// the same without SSE, for comparison
+	int cullScalar(const Frustum &frustum, MapChunk **out) const;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "doodadgrid.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// instance radius as far as any of the culling tests are concerned
+static float cullRadius(const ModelInstance &mi)
+{
+	float r = mi.model->rad * mi.sc;
+	return r > mi.model->rad ? r : mi.model->rad;
+}
+
+void DoodadGrid::build(vector<ModelInstance> &instances)
+{
+	cells.clear();
+	if (instances.empty()) return;
+
+	float x0 = instances[0].pos.x, x1 = x0, z0 = instances[0].pos.z, z1 = z0;
+	for (size_t i=1; i<instances.size(); i++) {
+		const Vec3D &p = instances[i].pos;
+		if (p.x < x0) x0 = p.x;
+		if (p.x > x1) x1 = p.x;
+		if (p.z < z0) z0 = p.z;
+		if (p.z > z1) z1 = p.z;
+	}
+	float sx = DOODADGRID_SIZE / (x1 - x0 + 0.001f), sz = DOODADGRID_SIZE / (z1 - z0 + 0.001f);
+
+	vector< pair<int, size_t> > keys(instances.size());
+	for (size_t i=0; i<instances.size(); i++) {
+		int cx = (int)((instances[i].pos.x - x0) * sx), cz = (int)((instances[i].pos.z - z0) * sz);
+		if (cx >= DOODADGRID_SIZE) cx = DOODADGRID_SIZE-1;
+		if (cz >= DOODADGRID_SIZE) cz = DOODADGRID_SIZE-1;
+		keys[i] = make_pair(cz * DOODADGRID_SIZE + cx, i);
+	}
+	sort(keys.begin(), keys.end());
+
+	vector<ModelInstance> sorted;
+	sorted.reserve(instances.size());
+	for (size_t i=0; i<keys.size(); i++) {
+		const ModelInstance &mi = instances[keys[i].second];
+		Vec3D r(cullRadius(mi), cullRadius(mi), cullRadius(mi));
+		if (i == 0 || keys[i].first != keys[i-1].first) {
+			DoodadCell c;
+			c.vmin = mi.pos - r;
+			c.vmax = mi.pos + r;
+			c.first = (int)i;
+			c.count = 0;
+			cells.push_back(c);
+		}
+		DoodadCell &c = cells.back();
+		// both the sphere and the box, whichever the instances are culled by
+		Vec3D lo = mi.pos - r, hi = mi.pos + r;
+		for (int b=0; b<2; b++) {
+			if (lo.x < c.vmin.x) c.vmin.x = lo.x;
+			if (lo.y < c.vmin.y) c.vmin.y = lo.y;
+			if (lo.z < c.vmin.z) c.vmin.z = lo.z;
+			if (hi.x > c.vmax.x) c.vmax.x = hi.x;
+			if (hi.y > c.vmax.y) c.vmax.y = hi.y;
+			if (hi.z > c.vmax.z) c.vmax.z = hi.z;
+			lo = mi.vmin;
+			hi = mi.vmax;
+		}
+		c.count++;
+		sorted.push_back(mi);
+	}
+	instances.swap(sorted);
+}
+
+int DoodadGrid::cull(const Frustum &frustum, const Vec3D &camera, float drawdist, const DoodadCell **out) const
+{
+	// a cell further than the draw distance can't have an instance within it, those measure
+	// to their centers less the radius the box was grown by
+	float drawdist2 = drawdist * drawdist;
+	int n = 0;
+	for (vector<DoodadCell>::const_iterator it = cells.begin(); it != cells.end(); ++it) {
+		Vec3D d(0,0,0);
+		if (camera.x < it->vmin.x) d.x = it->vmin.x - camera.x; else if (camera.x > it->vmax.x) d.x = camera.x - it->vmax.x;
+		if (camera.y < it->vmin.y) d.y = it->vmin.y - camera.y; else if (camera.y > it->vmax.y) d.y = camera.y - it->vmax.y;
+		if (camera.z < it->vmin.z) d.z = it->vmin.z - camera.z; else if (camera.z > it->vmax.z) d.z = camera.z - it->vmax.z;
+		if (d.lengthSquared() > drawdist2) continue;
+		if (!frustum.intersects(it->vmin, it->vmax)) continue;
+		out[n++] = &*it;
+	}
+	return n;
+}
@@ -0,0 +1,35 @@
+#ifndef DOODADGRID_H
+#define DOODADGRID_H
+
+#include "frustum.h"
+#include "model.h"
+#include <vector>
+
+/*
+	A tile's model instances sorted into a uniform grid of cells over the area
+	they cover, so a whole cell can be thrown out with one box test before the
+	instances in it are looked at one by one. The cell boxes are loose: they
+	hold every instance whose center is in the cell, all the way out to its
+	radius and its box, so nothing is lost at the borders.
+*/
+
+const int DOODADGRID_SIZE = 8;		// cells along each side
+
+struct DoodadCell {
+	Vec3D vmin, vmax;
+	int first, count;		// range in the instance vector
+};
+
+class DoodadGrid {
+	std::vector<DoodadCell> cells;		// only the ones with something in them
+
+public:
+	// reorders the instances so that each cell's are together
+	void build(std::vector<ModelInstance> &instances);
+
+	// writes the cells in view and within drawdist to out, returns how many there are
+	int cull(const Frustum &frustum, const Vec3D &camera, float drawdist, const DoodadCell **out) const;
+	int size() const { return (int)cells.size(); }
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "glstate.h"
+#include "wowmapview.h"
+
+GLState glstate;
+
+// the capabilities that are tracked, the ones in the second list are per texture unit
+static const GLenum trackedcaps[6] = {GL_BLEND, GL_ALPHA_TEST, GL_CULL_FACE, GL_LIGHTING, GL_FOG, GL_DEPTH_TEST};
+static const GLenum trackedunitcaps[3] = {GL_TEXTURE_2D, GL_TEXTURE_GEN_S, GL_TEXTURE_GEN_T};
+
+// only the first few mismatches of the session get logged
+const int GLSTATE_MAXLOGGED = 20;
+
+GLState::GLState(): compiling(false), logged(0), filter(true), check(false)
+{
+	calls = sent = mismatches = 0;
+	invalidate();
+}
+
+void GLState::frame()
+{
+	calls = sent = mismatches = 0;
+	invalidate();
+}
+
+void GLState::invalidate()
+{
+	for (int i=0; i<6; i++) caps[i] = -1;
+	for (int u=0; u<GLSTATE_UNITS; u++) {
+		for (int i=0; i<3; i++) unitcaps[u][i] = -1;
+		textureknown[u] = false;
+	}
+	unit = -1;
+	blendknown = false;
+	depthmask = -1;
+}
+
+void GLState::forget(GLenum cap)
+{
+	signed char *s = capState(cap);
+	if (s) *s = -1;
+}
+
+signed char *GLState::capState(GLenum cap)
+{
+	for (int i=0; i<6; i++) {
+		if (trackedcaps[i] == cap) return &caps[i];
+	}
+	if (unit < 0) return 0;
+	for (int i=0; i<3; i++) {
+		if (trackedunitcaps[i] == cap) return &unitcaps[unit][i];
+	}
+	return 0;
+}
+
+void GLState::mismatch(const char *what)
+{
+	if (logged < GLSTATE_MAXLOGGED) {
+		gLog("GL state cache out of sync: %s\n", what);
+		logged++;
+	}
+	mismatches++;
+}
+
+void GLState::beginList(GLuint list)
+{
+	glNewList(list, GL_COMPILE);
+	compiling = true;
+}
+
+void GLState::endList()
+{
+	glEndList();
+	compiling = false;
+}
+
+void GLState::enable(GLenum cap)
+{
+	calls++;
+	signed char *s = compiling ? 0 : capState(cap);
+	if (s && *s != -1 && check && (glIsEnabled(cap) ? 1 : 0) != *s) {
+		mismatch("capability");
+		*s = -1;
+	}
+	if (s && filter && *s == 1) return;
+	glEnable(cap);
+	sent++;
+	if (s) *s = 1;
+}
+
+void GLState::disable(GLenum cap)
+{
+	calls++;
+	signed char *s = compiling ? 0 : capState(cap);
+	if (s && *s != -1 && check && (glIsEnabled(cap) ? 1 : 0) != *s) {
+		mismatch("capability");
+		*s = -1;
+	}
+	if (s && filter && *s == 0) return;
+	glDisable(cap);
+	sent++;
+	if (s) *s = 0;
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst)
+{
+	calls++;
+	if (!compiling && blendknown) {
+		if (check) {
+			GLint s, d;
+			glGetIntegerv(GL_BLEND_SRC, &s);
+			glGetIntegerv(GL_BLEND_DST, &d);
+			if ((GLenum)s != blendsrc || (GLenum)d != blenddst) {
+				mismatch("blend function");
+				blendknown = false;
+			}
+		}
+		if (blendknown && filter && src == blendsrc && dst == blenddst) return;
+	}
+	glBlendFunc(src, dst);
+	sent++;
+	if (!compiling) {
+		blendsrc = src;
+		blenddst = dst;
+		blendknown = true;
+	}
+}
+
+void GLState::depthMask(GLboolean mask)
+{
+	calls++;
+	int m = mask ? 1 : 0;
+	if (!compiling && depthmask != -1) {
+		if (check) {
+			GLboolean real;
+			glGetBooleanv(GL_DEPTH_WRITEMASK, &real);
+			if ((real ? 1 : 0) != depthmask) {
+				mismatch("depth mask");
+				depthmask = -1;
+			}
+		}
+		if (filter && depthmask == m) return;
+	}
+	glDepthMask(mask);
+	sent++;
+	if (!compiling) depthmask = m;
+}
+
+void GLState::activeTexture(GLenum texunit)
+{
+	calls++;
+	int u = (int)(texunit - GL_TEXTURE0_ARB);
+	if (!compiling && unit != -1) {
+		if (check) {
+			GLint real;
+			glGetIntegerv(GL_ACTIVE_TEXTURE_ARB, &real);
+			if ((int)(real - GL_TEXTURE0_ARB) != unit) {
+				mismatch("active texture unit");
+				unit = -1;
+			}
+		}
+		if (filter && unit == u) return;
+	}
+	glActiveTextureARB(texunit);
+	sent++;
+	if (!compiling) unit = (u >= 0 && u < GLSTATE_UNITS) ? u : -1;
+}
+
+void GLState::bindTexture(GLuint tex)
+{
+	calls++;
+	bool known = !compiling && unit != -1 && textureknown[unit];
+	if (known && check) {
+		GLint real;
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &real);
+		if ((GLuint)real != textures[unit]) {
+			mismatch("bound texture");
+			known = false;
+		}
+	}
+	if (known && filter && textures[unit] == tex) return;
+	glBindTexture(GL_TEXTURE_2D, tex);
+	sent++;
+	if (!compiling && unit != -1) {
+		textures[unit] = tex;
+		textureknown[unit] = true;
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "video.h"
+
+/*
+	Shadow copy of the GL state the draw loops keep switching: capabilities,
+	the blend function, depth writes, the active texture unit and the texture
+	bound on each unit. Calls that would set what is already set are dropped.
+
+	The shadow only knows what went through it, so anything else that changes
+	the same state (code calling GL directly, display lists, particles) has to
+	be followed by invalidate() or forget() before the cache is used again;
+	each section that goes through it starts with invalidate(). While a list is
+	being compiled everything is passed on and the shadow is left alone.
+
+	With check on, every call the shadow thinks it knows about is compared to
+	glGet first, and mismatches are logged.
+*/
+
+const int GLSTATE_UNITS = 8;
+
+class GLState {
+	// 1 on, 0 off, -1 unknown
+	signed char caps[6];
+	signed char unitcaps[GLSTATE_UNITS][3];
+	int unit;		// active texture unit, -1 unknown
+	GLuint textures[GLSTATE_UNITS];
+	bool textureknown[GLSTATE_UNITS];
+	GLenum blendsrc, blenddst;
+	bool blendknown;
+	int depthmask;
+	bool compiling;
+	int logged;
+
+	signed char *capState(GLenum cap);
+	void mismatch(const char *what);
+
+public:
+	bool filter, check;
+
+	// this frame: calls made, calls passed on to GL, check mismatches
+	int calls, sent, mismatches;
+
+	GLState();
+
+	// resets the counters, and the shadow with them
+	void frame();
+	void invalidate();
+	void forget(GLenum cap);
+
+	void beginList(GLuint list);
+	void endList();
+
+	void enable(GLenum cap);
+	void disable(GLenum cap);
+	void blendFunc(GLenum src, GLenum dst);
+	void depthMask(GLboolean mask);
+	void activeTexture(GLenum texunit);
+	// GL_TEXTURE_2D on the active unit
+	void bindTexture(GLuint tex);
+};
+
+extern GLState glstate;
+
+#endif
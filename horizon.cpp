@@ -0,0 +1,266 @@
+#include "horizon.h"
+#include "world.h"
+
+using namespace std;
+
+// samples along one side of the map: 16 cells per tile plus the closing edge
+const int hgridsize = 64*16 + 1;
+
+// first grid vertex and step of the top, bottom, left and right edges
+const int hedges[4][2] = { {0,1}, {16*17,1}, {0,17}, {16,17} };
+
+// triangles of a node, leaving out cells that touch a missing tile
+static void nodeIndices(const bool *cv, vector<unsigned short> &idx)
+{
+	for (int y=0; y<16; y++) {
+		for (int x=0; x<16; x++) {
+			unsigned short a = y*17+x, b = a+1, c = a+18, d = a+17;
+			if (!cv[a] || !cv[b] || !cv[c] || !cv[d]) continue;
+			idx.push_back(a);	idx.push_back(d);	idx.push_back(b);
+			idx.push_back(b);	idx.push_back(d);	idx.push_back(c);
+		}
+	}
+	// skirts: 17 vertices per edge after the grid
+	for (int e=0; e<4; e++) {
+		for (int k=0; k<16; k++) {
+			unsigned short g0 = hedges[e][0] + k*hedges[e][1], g1 = g0 + hedges[e][1];
+			unsigned short s0 = 17*17 + e*17 + k, s1 = s0+1;
+			if (!cv[g0] || !cv[g1]) continue;
+			idx.push_back(g0);	idx.push_back(s0);	idx.push_back(g1);
+			idx.push_back(g1);	idx.push_back(s0);	idx.push_back(s1);
+		}
+	}
+}
+
+Horizon::Horizon(short *wdlheights, int lowresindex[64][64]): root(-1), vbo(0), ibo(0), viewdist(HORIZON_MAXDIST)
+{
+	nodesdrawn = trisdrawn = 0;
+
+	// stitch the outer 17x17 heights of all tiles into one grid, neighbours share their edges
+	vector<short> heights(hgridsize * hgridsize, 0);
+	bool *valid = new bool[hgridsize * hgridsize];
+	for (int k=0; k<hgridsize*hgridsize; k++) valid[k] = false;
+
+	for (int j=0; j<64; j++) {
+		for (int i=0; i<64; i++) {
+			int idx = lowresindex[j][i];
+			tiles[j][i] = idx >= 0;
+			if (idx < 0) continue;
+			short *tilebuf = wdlheights + idx * lowresbufsize;
+			for (int y=0; y<17; y++) {
+				for (int x=0; x<17; x++) {
+					int g = (j*16+y) * hgridsize + i*16+x;
+					heights[g] = tilebuf[y*17+x];
+					valid[g] = true;
+				}
+			}
+		}
+	}
+
+	vector<HorizonVertex> verts;
+	vector<unsigned short> indices;
+
+	// the index list of a node with no holes, shared by all of them
+	bool all[17*17];
+	for (int k=0; k<17*17; k++) all[k] = true;
+	nodeIndices(all, indices);
+
+	root = build(HORIZON_LEVELS-1, 0, 0, &heights[0], valid, verts, indices);
+	delete[] valid;
+
+	if (root < 0) return;
+
+	glGenBuffersARB(1, &vbo);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, verts.size()*sizeof(HorizonVertex), &verts[0], GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+	glGenBuffersARB(1, &ibo);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, ibo);
+	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, indices.size()*sizeof(unsigned short), &indices[0], GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+
+	gLog("Horizon: %d nodes, %.1f MB\n", (int)nodes.size(),
+		(verts.size()*sizeof(HorizonVertex) + indices.size()*sizeof(unsigned short)) / (1024.0f*1024.0f));
+}
+
+Horizon::~Horizon()
+{
+	if (vbo) glDeleteBuffersARB(1, &vbo);
+	if (ibo) glDeleteBuffersARB(1, &ibo);
+}
+
+int Horizon::build(int level, int x, int z, short *heights, bool *valid,
+	vector<HorizonVertex> &verts, vector<unsigned short> &indices)
+{
+	const int s = 1 << level;
+
+	bool any = false;
+	for (int j=z; j<z+s && !any; j++) {
+		for (int i=x; i<x+s; i++) {
+			if (tiles[j][i]) {
+				any = true;
+				break;
+			}
+		}
+	}
+	if (!any) return -1;
+
+	HorizonNode n;
+	n.level = level;
+	n.x = x;
+	n.z = z;
+	n.base = (int)verts.size();
+	n.vmin = Vec3D( 9999999.0f, 9999999.0f, 9999999.0f);
+	n.vmax = Vec3D(-9999999.0f,-9999999.0f,-9999999.0f);
+
+	// 17x17 grid, every s-th sample of the map grid
+	Vec3D light(-0.5f, 0.7f, -0.5f);
+	light.normalize();
+	bool cv[17*17];
+	for (int y=0; y<17; y++) {
+		for (int xx=0; xx<17; xx++) {
+			int gx = x*16 + xx*s, gz = z*16 + y*s;
+			int g = gz * hgridsize + gx;
+			HorizonVertex v;
+			v.x = gx * CHUNKSIZE;
+			v.y = heights[g];
+			v.z = gz * CHUNKSIZE;
+
+			// minimap colors, shaded by the slope so the relief shows without lighting
+			heightColor(heights[g], v.c[0], v.c[1], v.c[2]);
+			v.c[3] = 255;
+			int gx0 = gx > 0 ? gx-1 : gx, gx1 = gx < hgridsize-1 ? gx+1 : gx;
+			int gz0 = gz > 0 ? gz-1 : gz, gz1 = gz < hgridsize-1 ? gz+1 : gz;
+			Vec3D nrm(
+				(float)(heights[gz*hgridsize+gx0] - heights[gz*hgridsize+gx1]) / ((gx1-gx0)*CHUNKSIZE),
+				1.0f,
+				(float)(heights[gz0*hgridsize+gx] - heights[gz1*hgridsize+gx]) / ((gz1-gz0)*CHUNKSIZE));
+			nrm.normalize();
+			float shade = 0.5f + 0.5f * (nrm * light);
+			if (shade < 0.3f) shade = 0.3f;
+			if (shade > 1.0f) shade = 1.0f;
+			for (int c=0; c<3; c++) v.c[c] = (unsigned char)(v.c[c] * shade);
+
+			cv[y*17+xx] = valid[g];
+			if (valid[g]) {
+				if (v.y < n.vmin.y) n.vmin.y = v.y;
+				if (v.y > n.vmax.y) n.vmax.y = v.y;
+			}
+			verts.push_back(v);
+		}
+	}
+	n.vmin.x = x * TILESIZE;
+	n.vmin.z = z * TILESIZE;
+	n.vmax.x = (x+s) * TILESIZE;
+	n.vmax.z = (z+s) * TILESIZE;
+
+	// skirts hanging down from the four edges cover the cracks against neighbours of another level
+	const float skirt = s * CHUNKSIZE;
+	for (int e=0; e<4; e++) {
+		for (int k=0; k<17; k++) {
+			HorizonVertex v = verts[n.base + hedges[e][0] + k*hedges[e][1]];
+			v.y -= skirt;
+			verts.push_back(v);
+		}
+	}
+	n.vmin.y -= skirt;
+
+	vector<unsigned short> idx;
+	nodeIndices(cv, idx);
+	n.nIndices = (int)idx.size();
+	if (n.nIndices == horizonindices) {
+		n.ofsIndices = 0;
+	} else {
+		n.ofsIndices = (int)indices.size();
+		indices.insert(indices.end(), idx.begin(), idx.end());
+	}
+
+	for (int c=0; c<4; c++) n.children[c] = -1;
+	if (level > 0) {
+		const int h = s/2;
+		n.children[0] = build(level-1, x,   z,   heights, valid, verts, indices);
+		n.children[1] = build(level-1, x+h, z,   heights, valid, verts, indices);
+		n.children[2] = build(level-1, x,   z+h, heights, valid, verts, indices);
+		n.children[3] = build(level-1, x+h, z+h, heights, valid, verts, indices);
+	}
+
+	nodes.push_back(n);
+	return (int)nodes.size() - 1;
+}
+
+void Horizon::draw(const Vec3D &camera)
+{
+	nodesdrawn = trisdrawn = 0;
+	if (root < 0) return;
+
+	this->camera = camera;
+
+	// a projection of its own that reaches across the map, the near one stays for the rest of the frame
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluPerspective(45.0f, (GLfloat)video.xres/(GLfloat)video.yres, HORIZON_NEAR, viewdist);
+	glMatrixMode(GL_MODELVIEW);
+	frustum.retrieve();
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glClientActiveTextureARB(GL_TEXTURE1_ARB);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glClientActiveTextureARB(GL_TEXTURE0_ARB);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, ibo);
+
+	drawNode(root);
+
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+	glDisableClientState(GL_COLOR_ARRAY);
+
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+}
+
+void Horizon::drawNode(int i)
+{
+	const HorizonNode &n = nodes[i];
+	if (!frustum.intersects(n.vmin, n.vmax)) return;
+
+	// distance from the camera to the node's box
+	Vec3D d(0,0,0);
+	if (camera.x < n.vmin.x) d.x = n.vmin.x - camera.x; else if (camera.x > n.vmax.x) d.x = camera.x - n.vmax.x;
+	if (camera.y < n.vmin.y) d.y = n.vmin.y - camera.y; else if (camera.y > n.vmax.y) d.y = camera.y - n.vmax.y;
+	if (camera.z < n.vmin.z) d.z = n.vmin.z - camera.z; else if (camera.z > n.vmax.z) d.z = camera.z - n.vmax.z;
+	float dist = d.length();
+	if (dist > viewdist) return;
+
+	const int s = 1 << n.level;
+	if (n.level > 0) {
+		// always split down to single tiles around the high detail window, it gets cut out there
+		const int r = gWorld->tileradius;
+		bool nearwindow = n.x <= gWorld->cx + r && n.x + s > gWorld->cx - r
+			&& n.z <= gWorld->cz + r && n.z + s > gWorld->cz - r;
+		if (nearwindow || dist < s * TILESIZE * HORIZON_LODFACTOR) {
+			for (int c=0; c<4; c++) {
+				if (n.children[c] >= 0) drawNode(n.children[c]);
+			}
+			return;
+		}
+	} else if (gWorld->inWindow(n.x - gWorld->cx, n.z - gWorld->cz)) {
+		return;
+	}
+
+	if (n.nIndices == 0) return;
+
+	glVertexPointer(3, GL_FLOAT, sizeof(HorizonVertex), GL_BUFFER_OFFSET(n.base * sizeof(HorizonVertex)));
+	glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(HorizonVertex), GL_BUFFER_OFFSET(n.base * sizeof(HorizonVertex) + 3*sizeof(float)));
+	glDrawElements(GL_TRIANGLES, n.nIndices, GL_UNSIGNED_SHORT, GL_BUFFER_OFFSET(n.ofsIndices * sizeof(unsigned short)));
+
+	nodesdrawn++;
+	trisdrawn += n.nIndices / 3;
+}
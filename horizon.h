@@ -0,0 +1,65 @@
+#ifndef HORIZON_H
+#define HORIZON_H
+
+#include "video.h"
+#include "vec3d.h"
+#include "frustum.h"
+#include "maptile.h"
+#include <vector>
+
+/*
+	Continent-wide far terrain from the WDL heights.
+
+	The 64x64 tile map is covered by a quadtree of nodes; a node on level k spans
+	2^k x 2^k tiles with a 17x17 height grid (plus skirts to hide cracks between
+	levels), so every node costs the same no matter how much ground it covers.
+	Nodes are refined while the camera is closer than HORIZON_LODFACTOR times
+	their size, which keeps the triangle count roughly constant with distance.
+*/
+
+const int HORIZON_LEVELS = 7;			// 1, 2, 4 .. 64 tiles per node
+const float HORIZON_LODFACTOR = 2.0f;
+const float HORIZON_NEAR = 10.0f;
+// far enough to see across the whole map from anywhere on it
+const float HORIZON_MAXDIST = 64 * TILESIZE * 1.5f;
+const int horizonbufsize = 17*17 + 4*17;	// grid + skirt vertices
+const int horizonindices = 16*16*6 + 4*16*6;
+
+struct HorizonVertex {
+	float x,y,z;
+	unsigned char c[4];
+};
+
+struct HorizonNode {
+	int level, x, z;			// tile coordinates of the top left corner
+	Vec3D vmin, vmax;
+	int children[4];			// -1 on leaves
+	int base;					// first vertex in the vertex buffer
+	int ofsIndices, nIndices;	// in the index buffer
+};
+
+class Horizon {
+	std::vector<HorizonNode> nodes;
+	int root;
+	bool tiles[64][64];
+	GLuint vbo, ibo;
+	Frustum frustum;
+	Vec3D camera;
+
+	int build(int level, int x, int z, short *heights, bool *valid,
+		std::vector<HorizonVertex> &verts, std::vector<unsigned short> &indices);
+	void drawNode(int n);
+
+public:
+	float viewdist;
+
+	// stats for the last frame
+	int nodesdrawn, trisdrawn;
+
+	Horizon(short *wdlheights, int lowresindex[64][64]);
+	~Horizon();
+
+	void draw(const Vec3D &camera);
+};
+
+#endif
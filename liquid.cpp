@@ -7,7 +7,7 @@ struct LiquidVertex {
 };
 
 
-void Liquid::initFromTerrain(MPQFile &f, int flags)
+void Liquid::initFromTerrain(char *data, int flags)
 {
 	texRepeats = 4.0f;
 	/*
@@ -36,7 +36,7 @@ void Liquid::initFromTerrain(MPQFile &f, int flags)
 		*/
 		type = 2;
 	}
-	initGeometry(f);
+	initGeometry(data);
 	trans = false;
 }
 
@@ -45,7 +45,7 @@ void Liquid::initFromWMO(MPQFile &f, WMOMaterial &mat, bool indoor)
 	texRepeats = 4.0f;
 	ydir = -1.0f;
 
-	initGeometry(f);
+	initGeometry(f.getPointer());
 
 	trans = false;
 
@@ -96,12 +96,12 @@ void Liquid::initFromWMO(MPQFile &f, WMOMaterial &mat, bool indoor)
 }
 
 
-void Liquid::initGeometry(MPQFile &f)
+void Liquid::initGeometry(char *data)
 {
-	// assume: f is at the appropriate starting position
+	// assume: data points to the liquid vertices followed by the tile flags
 
-	LiquidVertex *map = (LiquidVertex*) f.getPointer();
-	unsigned char *flags = (unsigned char*) (f.getPointer() + (xtiles+1)*(ytiles+1)*sizeof(LiquidVertex));
+	LiquidVertex *map = (LiquidVertex*) data;
+	unsigned char *flags = (unsigned char*) (data + (xtiles+1)*(ytiles+1)*sizeof(LiquidVertex));
 
 	// generate vertices
 	Vec3D *verts = new Vec3D[(xtiles+1)*(ytiles+1)];
@@ -21,7 +21,7 @@ class Liquid {
 	float ydir;
 	float texRepeats;
 
-	void initGeometry(MPQFile &f);
+	void initGeometry(char *data);
 	void initTextures(char *basename, int first, int last);
 
 	int type;
@@ -41,10 +41,11 @@ public:
 	~Liquid();
 
 	//void init(MPQFile &f);
-	void initFromTerrain(MPQFile &f, int flags);
+	void initFromTerrain(char *data, int flags);
 	void initFromWMO(MPQFile &f, WMOMaterial &mat, bool indoor);
 
 	void draw();
+	bool transparent() const { return trans; }
 
 
 };
@@ -1,6 +1,7 @@
 #include "maptile.h"
 #include "world.h"
 #include "vec3d.h"
+#include "adtcache.h"
 #include <cassert>
 #include <algorithm>
 using namespace std;
@@ -11,14 +12,38 @@ MapTile::MapTile(int x0, int z0, char* filename): x(x0), z(z0), topnode(0,0,16)
 	xbase = x0 * TILESIZE;
 	zbase = z0 * TILESIZE;
 
+	nWMO = 0;
+	nMDX = 0;
+	cachefile = 0;
+	cpubytes = sizeof(MapTile);
+	gpubytes = 0;
+	lastused = 0;
+	uploaded = false;
+	prefetched = false;
+	uploadstage = 0;
+	uploadpos = 0;
+	vertices = 0;
+	splatatlas = shadowatlas = 0;
+	alphaatlas[0] = alphaatlas[1] = alphaatlas[2] = 0;
+
 	gLog("Loading tile %d,%d\n",x0,z0);
 
-	MPQFile f(filename);
-	ok = !f.isEof();
+	// try the decoded tile cache first, fall back to parsing the ADT
+	ok = gADTCache.load(this, filename);
 	if (!ok) {
-		gLog("-> Error loading %s\n",filename);
-		return;
+		ok = decode(filename);
+		if (!ok) {
+			gLog("-> Error loading %s\n",filename);
+			return;
+		}
+		gADTCache.save(this, filename);
 	}
+}
+
+bool MapTile::decode(char* filename)
+{
+	MPQFile f(filename);
+	if (f.isEof()) return false;
 
 	char fourcc[5];
 	size_t size;
@@ -47,12 +72,10 @@ MapTile::MapTile(int x0, int z0, char* filename): x(x0), z(z0), topnode(0,0,16)
 			char *buf = new char[size];
 			f.read(buf, size);
 			char *p=buf;
-			int t=0;
 			while (p<buf+size) {
 				string texpath(p);
 				p+=strlen(p)+1;
 				fixname(texpath);
-				video.textures.add(texpath);
 				textures.push_back(texpath);
 			}
 			delete[] buf;
@@ -64,13 +87,10 @@ MapTile::MapTile(int x0, int z0, char* filename): x(x0), z(z0), topnode(0,0,16)
 				char *buf = new char[size];
 				f.read(buf, size);
 				char *p=buf;
-				int t=0;
 				while (p<buf+size) {
 					string path(p);
 					p+=strlen(p)+1;
 					fixname(path);
-
-					gWorld->modelmanager.add(path);
 					models.push_back(path);
 				}
 				delete[] buf;
@@ -87,8 +107,6 @@ MapTile::MapTile(int x0, int z0, char* filename): x(x0), z(z0), topnode(0,0,16)
 					string path(p);
 					p+=strlen(p)+1;
 					fixname(path);
-					
-					gWorld->wmomanager.add(path);
 					wmos.push_back(path);
 				}
 				delete[] buf;
@@ -96,25 +114,15 @@ MapTile::MapTile(int x0, int z0, char* filename): x(x0), z(z0), topnode(0,0,16)
 		}
 		else if (!strcmp(fourcc,"MDDF")) {
 			// model instance data
-			nMDX = (int)size / 36;
-			for (int i=0; i<nMDX; i++) {
-				int id;
-				f.read(&id, 4);
-				Model *model = (Model*)gWorld->modelmanager.items[gWorld->modelmanager.get(models[id])];
-				ModelInstance inst(model, f);
-				modelis.push_back(inst);
-			}
+			int n = (int)size / sizeof(ModelPlacement);
+			modelps.resize(n);
+			if (n) f.read(&modelps[0], n * sizeof(ModelPlacement));
 		}
 		else if (!strcmp(fourcc,"MODF")) {
 			// wmo instance data
-			nWMO = (int)size / 64;
-			for (int i=0; i<nWMO; i++) {
-				int id;
-				f.read(&id, 4);
-				WMO *wmo = (WMO*)gWorld->wmomanager.items[gWorld->wmomanager.get(wmos[id])];
-				WMOInstance inst(wmo, f);
-				wmois.push_back(inst);
-			}
+			int n = (int)size / sizeof(WMOPlacement);
+			wmops.resize(n);
+			if (n) f.read(&wmops[0], n * sizeof(WMOPlacement));
 		}
 
 		// MCNK data will be processed separately ^_^
@@ -130,16 +138,144 @@ MapTile::MapTile(int x0, int z0, char* filename): x(x0), z(z0), topnode(0,0,16)
 		}
 	}
 
-	// init quadtree
-	topnode.setup(this);
-
 	f.close();
+	return true;
+}
+
+void MapTile::upload()
+{
+	size_t bytes = 0;
+	while (!uploadStep(bytes));
+}
+
+bool MapTile::uploadStep(size_t &bytes)
+{
+	// does one unit of upload work (a texture, model, wmo or chunk) so the
+	// world can spread a tile over several frames; returns true once done
+	if (!ok || uploaded) return true;
+
+	switch (uploadstage) {
+	case 0:
+		// textures
+		if (uploadpos < (int)textures.size()) {
+			string &name = textures[uploadpos++];
+			bool isnew = !video.textures.has(name);
+			GLuint id = video.textures.add(name);
+			if (isnew) {
+				Texture *tex = (Texture*)video.textures.items[id];
+				bytes += tex->w * tex->h * 4;
+			}
+			return false;
+		}
+		break;
+	case 1:
+		// models
+		if (uploadpos < (int)models.size()) {
+			gWorld->modelmanager.add(models[uploadpos++]);
+			return false;
+		}
+		break;
+	case 2:
+		// map objects
+		if (uploadpos < (int)wmos.size()) {
+			gWorld->wmomanager.add(wmos[uploadpos++]);
+			return false;
+		}
+		break;
+	case 3:
+		// instances
+		for (vector<ModelPlacement>::iterator it = modelps.begin(); it != modelps.end(); ++it) {
+			Model *model = (Model*)gWorld->modelmanager.items[gWorld->modelmanager.get(models[it->nameid])];
+			modelis.push_back(ModelInstance(model, *it));
+		}
+		doodads.build(modelis);
+		nMDX = (int)modelis.size();
+
+		for (vector<WMOPlacement>::iterator it = wmops.begin(); it != wmops.end(); ++it) {
+			WMO *wmo = (WMO*)gWorld->wmomanager.items[gWorld->wmomanager.get(wmos[it->nameid])];
+			wmois.push_back(WMOInstance(wmo, *it));
+		}
+		nWMO = (int)wmois.size();
+		break;
+	case 4:
+		// map chunks
+		if (uploadpos == 0) {
+			// one vertex buffer for the whole tile, filled in chunk by chunk; heights are in the
+			// map's steps from 0, so the neighbours' edge vertices end up at the same heights
+			vorigin = Vec3D(9999999.0f, 0, 9999999.0f);
+			for (int j=0; j<16; j++) {
+				for (int i=0; i<16; i++) {
+					MapChunk &c = chunks[j][i];
+					if (c.xbase < vorigin.x) vorigin.x = c.xbase;
+					if (c.zbase < vorigin.z) vorigin.z = c.zbase;
+				}
+			}
+			vscale = gWorld->terrainstep;
+
+			size_t size = 256 * mapbufsize * sizeof(MapVertex);
+			glGenBuffersARB(1, &vertices);
+			glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices);
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, size, 0, GL_STATIC_DRAW_ARB);
+			gpubytes += size;
+			bytes += size;
+
+			size = createAtlases();
+			gpubytes += size;
+			bytes += size;
+		}
+		if (uploadpos < 256) {
+			MapChunk &c = chunks[uploadpos/16][uploadpos%16];
+			size_t size = c.upload(uploadpos);
+			uploadpos++;
+			gpubytes += size;
+			bytes += size;
+			if (c.haswater) cpubytes += sizeof(Liquid);
+			return false;
+		}
+		break;
+	default:
+		// init quadtree, it still gives the tile's bounds; the chunks are culled out of the flat boxes
+		topnode.setup(this);
+		for (int k=0; k<256; k++) bounds.set(k, &chunks[k/16][k%16]);
+
+		// shared textures/models/wmos are owned by the managers and not counted here
+		cpubytes += (4 + 16 + 64) * sizeof(MapNode); // quadtree nodes
+		cpubytes += modelis.capacity() * sizeof(ModelInstance) + wmois.capacity() * sizeof(WMOInstance);
+		cpubytes += modelps.capacity() * sizeof(ModelPlacement) + wmops.capacity() * sizeof(WMOPlacement);
+
+		// the chunks don't need the mapped data any more
+		if (cachefile) {
+			delete cachefile;
+			cachefile = 0;
+		}
+		uploaded = true;
+		return true;
+	}
+
+	uploadstage++;
+	uploadpos = 0;
+	return false;
 }
 
 MapTile::~MapTile()
 {
 	if (!ok) return;
 
+	// halfway uploaded tiles already hold references and GL objects, finish them off so they can be freed normally;
+	// that includes ones that got through part of the textures only
+	if (!uploaded && (uploadstage > 0 || uploadpos > 0)) upload();
+
+	if (!uploaded) {
+		// decoded but never shown, only the CPU side data is around
+		for (int j=0; j<16; j++) {
+			for (int i=0; i<16; i++) {
+				delete chunks[j][i].data;
+			}
+		}
+		if (cachefile) delete cachefile;
+		return;
+	}
+
 	gLog("Unloading tile %d,%d\n", x, z);
 
 	topnode.cleanup();
@@ -149,6 +285,12 @@ MapTile::~MapTile()
 			chunks[j][i].destroy();
 		}
 	}
+	glDeleteBuffersARB(1, &vertices);
+	if (splatatlas) glDeleteTextures(1, &splatatlas);
+	for (int i=0; i<3; i++) {
+		if (alphaatlas[i]) glDeleteTextures(1, &alphaatlas[i]);
+	}
+	if (shadowatlas) glDeleteTextures(1, &shadowatlas);
 
 	for (vector<string>::iterator it = textures.begin(); it != textures.end(); ++it) {
         video.textures.delbyname(*it);
@@ -163,29 +305,273 @@ MapTile::~MapTile()
 	}
 }
 
+void MapTile::cull()
+{
+	// once a frame, before any terrain is drawn: sorts the chunks in view into the lists
+	// the terrain, layer/shadow and water passes work from
+	drawchunks.clear();
+	lodchunks.clear();
+	waterchunks.clear();
+	if (!ok) return;
+
+	MapChunk *inview[chunkboundsize];
+	int n = bounds.cull(gWorld->frustum, inview);
+	for (int i=0; i<n; i++) inview[i]->draw();
+}
+
+static bool chunkHidden(MapChunk *c)
+{
+	return !gWorld->skyline->chunkVisible(c->vmin, c->vmax) || !gWorld->occlusion->chunkVisible(c->vmin, c->vmax);
+}
+
+static bool waterHidden(MapChunk *c)
+{
+	Vec3D vmax = c->vmax;
+	if (c->waterlevel > vmax.y) vmax.y = c->waterlevel;
+	return !gWorld->skyline->visible(c->vmin, vmax) || !gWorld->occlusion->visible(c->vmin, vmax);
+}
+
+void MapTile::occlusionCull()
+{
+	// after cull(), once the occluders are in
+	drawchunks.erase(remove_if(drawchunks.begin(), drawchunks.end(), chunkHidden), drawchunks.end());
+	lodchunks.erase(remove_if(lodchunks.begin(), lodchunks.end(), chunkHidden), lodchunks.end());
+	waterchunks.erase(remove_if(waterchunks.begin(), waterchunks.end(), waterHidden), waterchunks.end());
+}
+
 void MapTile::draw()
 {
 	if (!ok) return;
+	if (drawchunks.empty() && lodchunks.empty()) return;
 
-	
+	// then everything is drawn out of the one vertex buffer
+	setupVertices();
+	if (gWorld->uselowlod) drawLowDetail();
+	if (gWorld->terrainshader) {
+		drawShaded();
+	} else {
+		drawBase();
+		for (vector<MapChunk*>::iterator it = drawchunks.begin(); it != drawchunks.end(); ++it) {
+			(*it)->drawLayers();
+		}
+	}
+	glPopMatrix();
+}
+
+static GLuint createAtlas(GLint format, unsigned char *zeros)
+{
+	GLuint tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, format == GL_RGBA ? GL_RGBA8 : GL_ALPHA, 1024, 1024, 0, format, GL_UNSIGNED_BYTE, zeros);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return tex;
+}
+
+size_t MapTile::createAtlases()
+{
+	// 16x16 cells of 64x64, cleared so chunks without a map read zero; the shader wants one
+	// RGBA atlas, the texture passes one alpha atlas per layer in use and one for the shadows
+	int layers = 0;
+	bool shadows = false;
 	for (int j=0; j<16; j++) {
 		for (int i=0; i<16; i++) {
-			chunks[j][i].visible = false;
-			//chunks[j][i].draw();
+			if (chunks[j][i].nTextures-1 > layers) layers = chunks[j][i].nTextures-1;
+			if (chunks[j][i].smap) shadows = true;
 		}
 	}
-	
-	topnode.draw();
 
+	size_t size = 0;
+	if (gWorld->terrainshader) {
+		vector<unsigned char> zeros(1024*1024*4, 0);
+		splatatlas = createAtlas(GL_RGBA, &zeros[0]);
+		size += 1024*1024*4;
+	} else {
+		vector<unsigned char> zeros(1024*1024, 0);
+		for (int i=0; i<layers; i++) {
+			alphaatlas[i] = createAtlas(GL_ALPHA, &zeros[0]);
+			size += 1024*1024;
+		}
+		if (shadows) {
+			shadowatlas = createAtlas(GL_ALPHA, &zeros[0]);
+			size += 1024*1024;
+		}
+	}
+	return size;
 }
 
-void MapTile::drawWater()
+void MapTile::setupVertices()
 {
-	if (!ok) return;
+	// the quantized positions are relative to the tile corner, the modelview scales them back
+	// (needs GL_NORMALIZE for the normals), pop the matrix when done
+	glPushMatrix();
+	glTranslatef(vorigin.x, vorigin.y, vorigin.z);
+	glScalef(TERRAIN_QUANT, vscale, TERRAIN_QUANT);
 
-	for (int j=0; j<16; j++) {
-		for (int i=0; i<16; i++) {
-			if (chunks[j][i].visible) chunks[j][i].drawWater();
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices);
+	glVertexPointer(3, GL_SHORT, sizeof(MapVertex), 0);
+	glNormalPointer(GL_BYTE, sizeof(MapVertex), GL_BUFFER_OFFSET(4*sizeof(short)));
+}
+
+// texture coordinate offset of an animated layer
+static void animOffset(int anim, float &dx, float &dy)
+{
+	// note: this is ad hoc and probably completely wrong
+	int spd = (anim & 0x08) | ((anim & 0x10) >> 2) | ((anim & 0x20) >> 4) | ((anim & 0x40) >> 6);
+	int dir = anim & 0x07;
+	const float texanimxtab[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+	const float texanimytab[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+	float fdx = -texanimxtab[dir], fdy = texanimytab[dir];
+
+	int animspd = (int)(200.0f * detail_size);
+	float f = ( ((int)(gWorld->animtime*(spd/15.0f))) % animspd) / (float)animspd;
+	dx = f*fdx;
+	dy = f*fdy;
+}
+
+// draws several chunk strips out of the bound tile and index buffers, in one call if the driver can
+static void drawStrips(GLenum mode, vector<GLsizei> &counts, vector<const GLvoid*> &strips)
+{
+	if (counts.empty()) return;
+	if (glMultiDrawElementsEXT) {
+		glMultiDrawElementsEXT(mode, &counts[0], GL_UNSIGNED_SHORT, &strips[0], (GLsizei)counts.size());
+		gWorld->terraincalls++;
+	} else {
+		for (size_t i=0; i<counts.size(); i++) {
+			glDrawElements(mode, counts[i], GL_UNSIGNED_SHORT, strips[i]);
+		}
+		gWorld->terraincalls += (int)counts.size();
+	}
+	gWorld->terrainpasses += (int)counts.size();
+	counts.clear();
+	strips.clear();
+}
+
+// chunks waiting to be drawn, the full strips and the triangle lists of the coarse levels apart
+struct StripBatch {
+	vector<GLsizei> counts[2];
+	vector<const GLvoid*> strips[2];
+
+	void add(const MapChunk *c)
+	{
+		int k = c->stripmode == GL_TRIANGLES ? 1 : 0;
+		counts[k].push_back(c->striplen);
+		strips[k].push_back(GL_BUFFER_OFFSET(c->stripofs * sizeof(unsigned short)));
+	}
+
+	void draw()
+	{
+		drawStrips(GL_TRIANGLE_STRIP, counts[0], strips[0]);
+		drawStrips(GL_TRIANGLES, counts[1], strips[1]);
+	}
+};
+
+void MapTile::drawLowDetail()
+{
+	if (lodchunks.empty()) return;
+
+	// chunks past the cull distance, fog colored and all at once
+	glstate.activeTexture(GL_TEXTURE1_ARB);
+	glstate.disable(GL_TEXTURE_2D);
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+	glstate.disable(GL_TEXTURE_2D);
+	glstate.disable(GL_LIGHTING);
+
+	glColor3fv(gWorld->skies->colorSet[FOG_COLOR]);
+
+	StripBatch batch;
+	for (vector<MapChunk*>::iterator it = lodchunks.begin(); it != lodchunks.end(); ++it) {
+		batch.add(*it);
+	}
+	glDisableClientState(GL_NORMAL_ARRAY);
+	batch.draw();
+	glEnableClientState(GL_NORMAL_ARRAY);
+
+	glColor4f(1,1,1,1);
+
+	glstate.enable(GL_LIGHTING);
+	glstate.activeTexture(GL_TEXTURE1_ARB);
+	glstate.enable(GL_TEXTURE_2D);
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+	glstate.enable(GL_TEXTURE_2D);
+}
+
+void MapTile::drawShaded()
+{
+	// every layer, the alpha maps and the shadow in a single pass per chunk
+	gWorld->terrainshader->use();
+	glstate.activeTexture(GL_TEXTURE4_ARB);
+	glstate.bindTexture(splatatlas);
+	for (vector<MapChunk*>::iterator it = drawchunks.begin(); it != drawchunks.end(); ++it) {
+		MapChunk *c = *it;
+		float anim[8];
+		for (int i=0; i<4; i++) {
+			anim[i*2] = anim[i*2+1] = 0;
+			if (i < c->nTextures) {
+				glstate.activeTexture(GL_TEXTURE0_ARB + i);
+				glstate.bindTexture(c->textures[i]);
+				if (c->animated[i]) animOffset(c->animated[i], anim[i*2], anim[i*2+1]);
+			}
+		}
+		glUniform1iARB(gWorld->terrainlayers, c->nTextures);
+		glUniform2fvARB(gWorld->terrainanim, 4, anim);
+
+		glDrawElements(c->stripmode, c->striplen, GL_UNSIGNED_SHORT, GL_BUFFER_OFFSET(c->stripofs * sizeof(unsigned short)));
+		gWorld->terraincalls++;
+		gWorld->terrainpasses++;
+	}
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+	Shader::unuse();
+}
+
+static bool baseTextureLess(const MapChunk *a, const MapChunk *b)
+{
+	return a->textures[0] < b->textures[0];
+}
+
+void MapTile::drawBase()
+{
+	// first pass of every chunk: chunks sharing a base texture go in one batch, the layers
+	// and shadows go on top afterwards (same result as chunk by chunk, they don't overlap)
+	stable_sort(drawchunks.begin(), drawchunks.end(), baseTextureLess);
+
+	glstate.activeTexture(GL_TEXTURE1_ARB);
+	glstate.disable(GL_TEXTURE_2D);
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+	glstate.enable(GL_TEXTURE_2D);
+
+	StripBatch batch;
+	GLuint bound = 0;
+	for (vector<MapChunk*>::iterator it = drawchunks.begin(); it != drawchunks.end(); ++it) {
+		MapChunk *c = *it;
+		if (c->textures[0] != bound) {
+			batch.draw();
+			bound = c->textures[0];
+			glstate.bindTexture(bound);
+		}
+		if (c->animated[0]) {
+			// moving textures need their own texture matrix
+			c->drawPass(c->animated[0]);
+			glstate.activeTexture(GL_TEXTURE0_ARB);
+		} else {
+			batch.add(c);
+		}
+	}
+	batch.draw();
+}
+
+void MapTile::drawWater()
+{
+	for (vector<MapChunk*>::iterator it = waterchunks.begin(); it != waterchunks.end(); ++it) {
+		MapChunk *c = *it;
+		// see-through water is drawn back to front with the other transparent things
+		if (gWorld->renderqueue->enabled && c->lq->transparent()) {
+			gWorld->renderqueue->addWater(c, (c->vcenter - gWorld->camera).length());
+		} else {
+			c->drawWater();
 		}
 	}
 }
@@ -224,8 +610,15 @@ void MapTile::drawModels()
 {
 	if (!ok) return;
 
-	for (int i=0; i<nMDX; i++) {
-		modelis[i].draw();
+	const DoodadCell *inview[DOODADGRID_SIZE*DOODADGRID_SIZE];
+	int n = doodads.cull(gWorld->frustum, gWorld->camera, gWorld->modeldrawdistance, inview);
+	for (int i=0; i<n; i++) {
+		const DoodadCell *c = inview[i];
+		// whole cells behind the terrain go too
+		if (!gWorld->skyline->visible(c->vmin, c->vmax) || !gWorld->occlusion->visible(c->vmin, c->vmax)) continue;
+		for (int k=c->first; k<c->first+c->count; k++) {
+			modelis[k].draw();
+		}
 	}
 }
 
@@ -281,7 +674,15 @@ struct MapChunkHeader {
 
 void MapChunk::init(MapTile* mt, MPQFile &f)
 {
-	Vec3D tn[mapbufsize], tv[mapbufsize];
+	data = new MapChunkData;
+	tv = data->tv;
+	tn = data->tn;
+	for (int i=0; i<3; i++) amaps[i] = 0;
+	smap = 0;
+	lqdata = 0;
+
+	nTextures = 0;
+	haswater = false;
 
     f.seekRelative(4);
 	char fcc[5];
@@ -301,8 +702,8 @@ void MapChunk::init(MapTile* mt, MPQFile &f)
     xbase = header.xpos;
     ybase = header.ypos;
 
-	int holes = header.holes;
-	int chunkflags = header.flags;
+	holes = header.holes;
+	flags = header.flags;
 
 	hasholes = (holes != 0);
 
@@ -408,21 +809,13 @@ void MapChunk::init(MapTile* mt, MPQFile &f)
 				}
 				*/
 
-				/*
-				if (mt->textures[tex]=="Tileset\\BurningStepps\\BurningSteppsLavatest02.blp") {
-					gLog("Lava tex:\t%d\t%d\t%d\n", unk[0], unk[1], unk[2]);
-				} else {
-					gLog("---- tex:\t%d\t%d\t%d\n", unk[0], unk[1], unk[2]);
-				}
-				*/
-
-				textures[i] = video.textures.get(mt->textures[tex]);
+				texidx[i] = tex;
 			}
 		}
 		else if (!strcmp(fcc,"MCSH")) {
 			// shadow map 64 x 64
-			unsigned char sbuf[64*64], *p, c[8];
-			p = sbuf;
+			unsigned char *p, c[8];
+			p = smap = data->smap;
 			for (int j=0; j<64; j++) {
 				f.read(c,8);
 				for (int i=0; i<8; i++) {
@@ -431,24 +824,14 @@ void MapChunk::init(MapTile* mt, MPQFile &f)
 					}
 				}
 			}
-			glGenTextures(1, &shadow);
-			glBindTexture(GL_TEXTURE_2D, shadow);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, 64, 64, 0, GL_ALPHA, GL_UNSIGNED_BYTE, sbuf);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
 		}
 		else if (!strcmp(fcc,"MCAL")) {
 			// alpha maps  64 x 64
 			if (nTextures>0) {
-				glGenTextures(nTextures-1, alphamaps);
 				for (int i=0; i<nTextures-1; i++) {
-					glBindTexture(GL_TEXTURE_2D, alphamaps[i]);
-					unsigned char amap[64*64], *p;
+					unsigned char *p;
 					char *abuf = f.getPointer();
-					p = amap;
+					p = amaps[i] = data->amaps[i];
 					for (int j=0; j<64; j++) {
 						for (int i=0; i<32; i++) {
 							unsigned char c = *abuf++;
@@ -457,11 +840,6 @@ void MapChunk::init(MapTile* mt, MPQFile &f)
 						}
 
 					}
-					glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, 64, 64, 0, GL_ALPHA, GL_UNSIGNED_BYTE, amap);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 					f.seekRelative(0x800);
 				}
 			} else {
@@ -488,9 +866,9 @@ void MapChunk::init(MapTile* mt, MPQFile &f)
 
 				f.seekRelative(4);
 
-				lq = new Liquid(8, 8, Vec3D(xbase, waterlevel, zbase));
-				//lq->init(f);
-				lq->initFromTerrain(f, chunkflags);
+				// keep the raw liquid vertices and flags, the liquid itself is created on upload
+				memcpy(data->lq, f.getPointer(), lqdatasize);
+				lqdata = data->lq;
 
 				/*
 				// let's output some debug info! ( '-')b
@@ -509,35 +887,171 @@ void MapChunk::init(MapTile* mt, MPQFile &f)
 		f.seek((int)nextpos);
 	}
 
-	// create vertex buffers
-	glGenBuffersARB(1,&vertices);
-	glGenBuffersARB(1,&normals);
+	this->mt = mt;
+}
 
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices);
-	glBufferDataARB(GL_ARRAY_BUFFER_ARB, mapbufsize*3*sizeof(float), tv, GL_STATIC_DRAW_ARB);
+// height error of each level against the full grid, the coarser levels include the finer ones
+static void lodErrors(Vec3D *tv, float *err)
+{
+	err[0] = 0;
+	err[1] = 0;
+	for (int z=0; z<8; z++) {
+		for (int x=0; x<8; x++) {
+			float avg = (tv[indexMapBuf(x,z*2)].y + tv[indexMapBuf(x+1,z*2)].y
+				+ tv[indexMapBuf(x,z*2+2)].y + tv[indexMapBuf(x+1,z*2+2)].y) * 0.25f;
+			float e = fabs(tv[indexMapBuf(x,z*2+1)].y - avg);
+			if (e > err[1]) err[1] = e;
+		}
+	}
+	for (int lod=2; lod<TERRAIN_LODS; lod++) {
+		const int step = 1 << (lod-1);
+		err[lod] = err[lod-1];
+		for (int z=0; z<=8; z++) {
+			for (int x=0; x<=8; x++) {
+				int cx = x/step*step, cz = z/step*step;
+				if (cx == 8) cx -= step;
+				if (cz == 8) cz -= step;
+				float fx = (x-cx) / (float)step, fz = (z-cz) / (float)step;
+				float h0 = tv[indexMapBuf(cx,cz*2)].y*(1-fx) + tv[indexMapBuf(cx+step,cz*2)].y*fx;
+				float h1 = tv[indexMapBuf(cx,(cz+step)*2)].y*(1-fx) + tv[indexMapBuf(cx+step,(cz+step)*2)].y*fx;
+				float e = fabs(tv[indexMapBuf(x,z*2)].y - (h0*(1-fz) + h1*fz));
+				if (e > err[lod]) err[lod] = e;
+			}
+		}
+	}
+}
 
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals);
-	glBufferDataARB(GL_ARRAY_BUFFER_ARB, mapbufsize*3*sizeof(float), tn, GL_STATIC_DRAW_ARB);
+// height of the occluder grid with a vertex every step outer vertices (2 or 4), split into
+// triangles like gridIndices does, at px, pz in outer vertices from the chunk's corner
+static float gridHeight(const float *occheights, int step, float px, float pz)
+{
+	int cx = (int)(px / step), cz = (int)(pz / step);
+	if (cx < 0) cx = 0;
+	if (cz < 0) cz = 0;
+	if (cx > 8/step - 1) cx = 8/step - 1;
+	if (cz > 8/step - 1) cz = 8/step - 1;
+	float fx = (px - cx*step) / step, fz = (pz - cz*step) / step;
+	const int col = step/2, row = 5*col;
+	const float *h = &occheights[cz*row + cx*col];
+	float ha = h[0], hb = h[col], hc = h[row], hd = h[row+col];
+	return (fx + fz <= 1) ? ha + (hb-ha)*fx + (hc-ha)*fz : hd + (hc-hd)*(1-fx) + (hb-hd)*(1-fz);
+}
 
-	if (hasholes) initStrip(holes);
-	/*
-	else {
-		strip = gWorld->mapstrip;
-		striplen = 16*18 + 7*2 + 8*2; //stripsize;
+// how far that grid has to sink to be under the ground everywhere, and how far the ground rises
+// above it at most. The grid's edges and diagonals only run along edges of the full grid's
+// triangles, so checking the full grid's vertices, outer and inner, is enough.
+static float occluderSink(Vec3D *tv, const float *occheights, int step, float &rise)
+{
+	float sink = 0;
+	rise = 0;
+	for (int y=0; y<17; y++) {
+		// outer rows have 9 vertices on whole units, inner ones 8 in between
+		const bool inner = (y & 1) != 0;
+		for (int x=0; x<(inner ? 8 : 9); x++) {
+			float e = gridHeight(occheights, step, inner ? x + 0.5f : (float)x, y * 0.5f) - tv[indexMapBuf(x, y)].y;
+			if (e > sink) sink = e;
+			if (-e > rise) rise = -e;
+		}
 	}
-	*/
+	return sink;
+}
 
-	this->mt = mt;
+bool MapChunk::underground(const Vec3D &p)
+{
+	// the ground is at most occrise above the 5x5 grid, anything lower might be under it
+	float h = gridHeight(occheights, 2, (p.x - xbase) / UNITSIZE, (p.z - zbase) / UNITSIZE);
+	return p.y < h + occrise;
+}
+
+size_t MapChunk::upload(int slot)
+{
+	size_t bytes = 0;
+	this->slot = slot;
+
+	for (int i=0; i<nTextures; i++) {
+		textures[i] = video.textures.get(mt->textures[texidx[i]]);
+	}
+
+	// alpha and shadow maps go into this chunk's cell of the tile's atlases; missing ones
+	// (no MCAL, or none in the tile cache) stay as the atlases were made, all zeros
+	const int ax = (slot%16) * 64, az = (slot/16) * 64;
+	if (mt->splatatlas) {
+		// the shader reads the alpha maps from rgb and the shadow from alpha
+		unsigned char *buf = new unsigned char[64*64*4];
+		for (int i=0; i<64*64; i++) {
+			for (int k=0; k<3; k++) buf[i*4+k] = (k < nTextures-1 && amaps[k]) ? amaps[k][i] : 0;
+			buf[i*4+3] = smap ? smap[i] : 0;
+		}
+		glBindTexture(GL_TEXTURE_2D, mt->splatatlas);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, ax, az, 64, 64, GL_RGBA, GL_UNSIGNED_BYTE, buf);
+		delete[] buf;
+	} else {
+		for (int i=0; i<nTextures-1; i++) {
+			if (!amaps[i]) continue;
+			glBindTexture(GL_TEXTURE_2D, mt->alphaatlas[i]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, ax, az, 64, 64, GL_ALPHA, GL_UNSIGNED_BYTE, amaps[i]);
+		}
+		if (smap) {
+			glBindTexture(GL_TEXTURE_2D, mt->shadowatlas);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, ax, az, 64, 64, GL_ALPHA, GL_UNSIGNED_BYTE, smap);
+		}
+	}
+
+	if (haswater) {
+		lq = new Liquid(8, 8, Vec3D(xbase, waterlevel, zbase));
+		lq->initFromTerrain(lqdata, flags);
+		bytes += lqdatasize; // rough size of the liquid display list
+	}
+
+	// quantize into the tile's vertex buffer; with a stretched height scale the normals are
+	// stretched along so they come out right after the modelview
+	MapVertex mv[mapbufsize];
+	const float ny = mt->vscale / TERRAIN_QUANT;
+	for (int i=0; i<mapbufsize; i++) {
+		mv[i].pos[0] = (short)((tv[i].x - mt->vorigin.x) / TERRAIN_QUANT + 0.5f);
+		float h = floorf((tv[i].y - mt->vorigin.y) / mt->vscale + 0.5f);
+		mv[i].pos[1] = (short)(h < -32768.0f ? -32768.0f : (h > 32767.0f ? 32767.0f : h));
+		mv[i].pos[2] = (short)((tv[i].z - mt->vorigin.z) / TERRAIN_QUANT + 0.5f);
+		mv[i].pos[3] = 1;
+		Vec3D n(tn[i].x, tn[i].y * ny, tn[i].z);
+		n.normalize();
+		mv[i].nrm[0] = (signed char)(n.x * 127.0f);
+		mv[i].nrm[1] = (signed char)(n.y * 127.0f);
+		mv[i].nrm[2] = (signed char)(n.z * 127.0f);
+		mv[i].nrm[3] = 0;
+	}
+
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, mt->vertices);
+	glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, slot * sizeof(mv), sizeof(mv), mv);
+
+	if (hasholes) stripofs = gWorld->holeStrip(holes, slot, striplen);
+	lodErrors(tv, loderror);
+	for (int j=0; j<5; j++) {
+		for (int i=0; i<5; i++) {
+			occheights[j*5+i] = tv[indexMapBuf(i*2, j*4)].y;
+		}
+	}
+	float rise;
+	occsink[0] = occluderSink(tv, occheights, 2, occrise);
+	occsink[1] = occluderSink(tv, occheights, 4, rise);
 
 	vcenter = (vmin + vmax) * 0.5f;
 
+	// decoded data is on the card now
+	delete data;
+	data = 0;
+	tv = tn = 0;
+	for (int i=0; i<3; i++) amaps[i] = 0;
+	smap = 0;
+	lqdata = 0;
+
+	return bytes;
 }
 
 
-void MapChunk::initStrip(int holes)
+int makeHoleStrip(int holes, unsigned short base, unsigned short *out)
 {
-	strip = new short[256]; // TODO: figure out exact length of strip needed
-	short *s = strip;
+	unsigned short *s = out;
 	bool first = true;
 	for (int y=0; y<4; y++) {
 		for (int x=0; x<4; x++) {
@@ -548,33 +1062,78 @@ void MapChunk::initStrip(int holes)
 				int j = y*4;
 				for (int k=0; k<2; k++) {
 					if (!first) {
-						*s++ = indexMapBuf(i,j+k*2);
+						*s++ = base + indexMapBuf(i,j+k*2);
 					} else first = false;
 					for (int l=0; l<3; l++) {
-						*s++ = indexMapBuf(i+l,j+k*2);
-						*s++ = indexMapBuf(i+l,j+k*2+2);
+						*s++ = base + indexMapBuf(i+l,j+k*2);
+						*s++ = base + indexMapBuf(i+l,j+k*2+2);
 					}
-					*s++ = indexMapBuf(i+2,j+k*2+2);
+					*s++ = base + indexMapBuf(i+2,j+k*2+2);
 				}
 			}
 		}
 	}
-	striplen = (int)(s - strip);
+	return (int)(s - out);
 }
 
+// one triangle of the outer grid, turned to face up like the strips
+static unsigned short *lodTriangle(unsigned short *s, unsigned short base, const int *a, const int *b, const int *c)
+{
+	if ((b[1]-a[1])*(c[0]-a[0]) - (b[0]-a[0])*(c[1]-a[1]) < 0) {
+		const int *t = b;
+		b = c;
+		c = t;
+	}
+	*s++ = base + indexMapBuf(a[0], a[1]*2);
+	*s++ = base + indexMapBuf(b[0], b[1]*2);
+	*s++ = base + indexMapBuf(c[0], c[1]*2);
+	return s;
+}
 
-void MapChunk::destroy()
+int makeLODTris(int lod, int stitch, unsigned short base, unsigned short *out)
 {
-	// unload alpha maps
-	glDeleteTextures(nTextures-1, alphamaps);
-	// shadow maps, too
-	glDeleteTextures(1, &shadow);
+	unsigned short *s = out;
+	const int step = 1 << (lod-1), h = step/2;
+	for (int z=0; z<8; z+=step) {
+		for (int x=0; x<8; x+=step) {
+			// cell sides on a stitched chunk edge get the midpoint of the finer neighbour
+			bool mid[4] = {
+				z == 0 && (stitch & 1) != 0,
+				x+step == 8 && (stitch & 8) != 0,
+				z+step == 8 && (stitch & 2) != 0,
+				x == 0 && (stitch & 4) != 0
+			};
+			if (!mid[0] && !mid[1] && !mid[2] && !mid[3]) {
+				int p00[2] = {x, z}, p10[2] = {x+step, z}, p01[2] = {x, z+step}, p11[2] = {x+step, z+step};
+				s = lodTriangle(s, base, p00, p01, p10);
+				s = lodTriangle(s, base, p10, p01, p11);
+				continue;
+			}
+			// otherwise a fan from the cell center around the corners and midpoints
+			int ring[8][2], n = 0;
+			const int corners[4][2] = { {x, z}, {x+step, z}, {x+step, z+step}, {x, z+step} };
+			const int dirs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
+			for (int k=0; k<4; k++) {
+				ring[n][0] = corners[k][0];
+				ring[n][1] = corners[k][1];
+				n++;
+				if (mid[k]) {
+					ring[n][0] = corners[k][0] + dirs[k][0]*h;
+					ring[n][1] = corners[k][1] + dirs[k][1]*h;
+					n++;
+				}
+			}
+			int center[2] = {x+h, z+h};
+			for (int k=0; k<n; k++) s = lodTriangle(s, base, center, ring[k], ring[(k+1)%n]);
+		}
+	}
+	return (int)(s - out);
+}
 
-	// delete VBOs
-	glDeleteBuffersARB(1, &vertices);
-	glDeleteBuffersARB(1, &normals);
 
-	if (hasholes) delete[] strip;
+void MapChunk::destroy()
+{
+	delete data;
 
 	if (haswater) delete lq;
 }
@@ -582,90 +1141,169 @@ void MapChunk::destroy()
 void MapChunk::drawPass(int anim)
 {
 	if (anim) {
-		glActiveTextureARB(GL_TEXTURE0_ARB);
+		glstate.activeTexture(GL_TEXTURE0_ARB);
 		glMatrixMode(GL_TEXTURE);
 		glPushMatrix();
 
-		// note: this is ad hoc and probably completely wrong
-		int spd = (anim & 0x08) | ((anim & 0x10) >> 2) | ((anim & 0x20) >> 4) | ((anim & 0x40) >> 6);
-		int dir = anim & 0x07;
-		const float texanimxtab[8] = {0, 1, 1, 1, 0, -1, -1, -1};
-		const float texanimytab[8] = {1, 1, 0, -1, -1, -1, 0, 1};
-		float fdx = -texanimxtab[dir], fdy = texanimytab[dir];
-
-		int animspd = (int)(200.0f * detail_size);
-		float f = ( ((int)(gWorld->animtime*(spd/15.0f))) % animspd) / (float)animspd;
-		glTranslatef(f*fdx,f*fdy,0);
+		float dx, dy;
+		animOffset(anim, dx, dy);
+		glTranslatef(dx,dy,0);
 	}
 
-	glDrawElements(GL_TRIANGLE_STRIP, striplen, GL_UNSIGNED_SHORT, strip);
+	glDrawElements(stripmode, striplen, GL_UNSIGNED_SHORT, GL_BUFFER_OFFSET(stripofs * sizeof(unsigned short)));
+	gWorld->terraincalls++;
+	gWorld->terrainpasses++;
 
 	if (anim) {
         glPopMatrix();
 		glMatrixMode(GL_MODELVIEW);
-		glActiveTextureARB(GL_TEXTURE1_ARB);
+		glstate.activeTexture(GL_TEXTURE1_ARB);
 	}
 }
 
 
 void MapChunk::draw()
 {
-	if (!gWorld->frustum.intersects(vmin,vmax)) return;
+	// queue up for MapTile::draw, which draws the chunks in batches (called by MapTile::cull)
 	float mydist = (gWorld->camera - vcenter).length() - r;
 	//if (mydist > gWorld->mapdrawdistance2) return;
 	if (mydist > gWorld->culldistance) {
-		if (gWorld->uselowlod) this->drawNoDetail();
+		if (gWorld->uselowlod) {
+			pickStrip();
+			mt->lodchunks.push_back(this);
+		}
 		return;
 	}
-	visible = true;
+	if (haswater) mt->waterchunks.push_back(this);
 
 	if (nTextures==0) return;
 
-	if (!hasholes) {
-		bool highres = gWorld->drawhighres;
-		if (highres) {
-			highres = mydist < gWorld->highresdistance2;
+	pickStrip();
+	mt->drawchunks.push_back(this);
+}
+
+void MapChunk::pickStrip()
+{
+	// the level was chosen by World::selectTerrainLOD, holes always keep their own strip
+	int tris;
+	if (hasholes) {
+		stripmode = GL_TRIANGLE_STRIP;
+		tris = striplen - 2;
+	} else if (lod == 0) {
+		stripofs = gWorld->strip2ofs + slot * stripsize2;
+		striplen = stripsize2;
+		stripmode = GL_TRIANGLE_STRIP;
+		tris = 16*16;
+	} else if (lod == 1) {
+		stripofs = slot * stripsize;
+		striplen = stripsize;
+		stripmode = GL_TRIANGLE_STRIP;
+		tris = 8*8*2;
+	} else {
+		// edges next to a finer neighbour take its vertices too, so the two meet without cracks
+		int stitch = 0;
+		for (int side=0; side<4; side++) {
+			MapChunk *n = gWorld->terrainNeighbour(this, side);
+			if (n && lodEdge(n->lod) < lodEdge(lod)) stitch |= 1 << side;
 		}
-		if (highres) {
-			strip = gWorld->mapstrip2;
-			striplen = stripsize2;
-		} else {
-			strip = gWorld->mapstrip;
-			striplen = stripsize;
+		stripofs = gWorld->lodStrip(lod, stitch, slot, striplen);
+		stripmode = GL_TRIANGLES;
+		tris = striplen / 3;
+	}
+	gWorld->terraintris += tris;
+	gWorld->terrainfulltris += hasholes ? tris : (gWorld->drawhighres ? 16*16 : 8*8*2);
+}
+
+// triangles of an n x n vertex grid
+static void gridIndices(int n, unsigned short *out)
+{
+	for (int j=0; j<n-1; j++) {
+		for (int i=0; i<n-1; i++) {
+			unsigned short a = j*n+i, b = a+1, c = a+n, d = a+n+1;
+			*out++ = a;	*out++ = c;	*out++ = b;
+			*out++ = b;	*out++ = c;	*out++ = d;
 		}
 	}
+}
 
-	// setup vertex buffers
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices);
-	glVertexPointer(3, GL_FLOAT, 0, 0);
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals);
-	glNormalPointer(GL_FLOAT, 0, 0);
-	// ASSUME: texture coordinates set up already
+void MapChunk::addOccluder(OcclusionBuffer *ob, bool fine)
+{
+	// cave entrances and the like, better not
+	if (hasholes) return;
+
+	static unsigned short grid5[4*4*6], grid3[2*2*6];
+	static bool indices = false;
+	if (!indices) {
+		gridIndices(5, grid5);
+		gridIndices(3, grid3);
+		indices = true;
+	}
 
-	// first pass: base texture
-	glActiveTextureARB(GL_TEXTURE0_ARB);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, textures[0]);
+	// the coarser the grid, the deeper it has to sink to stay under the ground
+	Vec3D v[5*5];
+	if (fine) {
+		for (int j=0; j<5; j++) {
+			for (int i=0; i<5; i++) {
+				v[j*5+i] = Vec3D(xbase + i*2*UNITSIZE, occheights[j*5+i] - occsink[0], zbase + j*2*UNITSIZE);
+			}
+		}
+		ob->addTriangles(v, 5*5, grid5, 4*4*6, 0);
+	} else {
+		for (int j=0; j<3; j++) {
+			for (int i=0; i<3; i++) {
+				v[j*3+i] = Vec3D(xbase + i*4*UNITSIZE, occheights[j*2*5+i*2] - occsink[1], zbase + j*4*UNITSIZE);
+			}
+		}
+		ob->addTriangles(v, 3*3, grid3, 2*2*6, 0);
+	}
+}
 
-	glActiveTextureARB(GL_TEXTURE1_ARB);
-	glDisable(GL_TEXTURE_2D);
+void MapChunk::addGround(Skyline *sl, bool fine)
+{
+	if (hasholes) return;
+
+	// the sunk occluder grid is under the ground, so is the lowest of its heights anywhere between
+	if (fine) {
+		for (int j=0; j<2; j++) {
+			for (int i=0; i<2; i++) {
+				float h = occheights[j*2*5 + i*2];
+				for (int y=0; y<3; y++) {
+					for (int x=0; x<3; x++) {
+						if (occheights[(j*2+y)*5 + i*2+x] < h) h = occheights[(j*2+y)*5 + i*2+x];
+					}
+				}
+				sl->addGround(xbase + i*4*UNITSIZE, zbase + j*4*UNITSIZE,
+					xbase + (i+1)*4*UNITSIZE, zbase + (j+1)*4*UNITSIZE, h - occsink[0]);
+			}
+		}
+	} else {
+		float h = occheights[0];
+		for (int k=1; k<5*5; k++) {
+			if (occheights[k] < h) h = occheights[k];
+		}
+		sl->addGround(xbase, zbase, xbase + CHUNKSIZE, zbase + CHUNKSIZE, h - occsink[0]);
+	}
+}
 
-	drawPass(animated[0]);
+void MapChunk::drawLayers()
+{
+	// everything after the base texture, which MapTile::drawBase has done already
+	// ASSUME: vertex buffer and texture coordinates set up already
 
 	if (nTextures>1) {
 		//glDepthFunc(GL_EQUAL); // GL_LEQUAL is fine too...?
-		glDepthMask(GL_FALSE);
+		glstate.depthMask(GL_FALSE);
 	}
 
 	// additional passes: if required
 	for (int i=0; i<nTextures-1; i++) {
-		glActiveTextureARB(GL_TEXTURE0_ARB);
-		glEnable(GL_TEXTURE_2D);
-		glBindTexture(GL_TEXTURE_2D, textures[i+1]);
+		glstate.activeTexture(GL_TEXTURE0_ARB);
+		glstate.enable(GL_TEXTURE_2D);
+		glstate.bindTexture(textures[i+1]);
 		// this time, use blending:
-		glActiveTextureARB(GL_TEXTURE1_ARB);
-		glEnable(GL_TEXTURE_2D);
-		glBindTexture(GL_TEXTURE_2D, alphamaps[i]);
+		glstate.activeTexture(GL_TEXTURE1_ARB);
+		glstate.enable(GL_TEXTURE_2D);
+		glstate.bindTexture(mt->alphaatlas[i]);
 
 		drawPass(animated[i+1]);
 
@@ -673,25 +1311,25 @@ void MapChunk::draw()
 
 	if (nTextures>1) {
 		//glDepthFunc(GL_LEQUAL);
-		glDepthMask(GL_TRUE);
+		glstate.depthMask(GL_TRUE);
 	}
 	
 	// shadow map
-	glActiveTextureARB(GL_TEXTURE0_ARB);
-	glDisable(GL_TEXTURE_2D);
-	glDisable(GL_LIGHTING);
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+	glstate.disable(GL_TEXTURE_2D);
+	glstate.disable(GL_LIGHTING);
 
 	Vec3D shc = gWorld->skies->colorSet[SHADOW_COLOR] * 0.3f;
 	//glColor4f(0,0,0,1);
 	glColor4f(shc.x,shc.y,shc.z,1);
 
-	glActiveTextureARB(GL_TEXTURE1_ARB);
-	glBindTexture(GL_TEXTURE_2D, shadow);
-	glEnable(GL_TEXTURE_2D);
+	glstate.activeTexture(GL_TEXTURE1_ARB);
+	glstate.bindTexture(mt->shadowatlas);
+	glstate.enable(GL_TEXTURE_2D);
 
 	drawPass(0);
 
-	glEnable(GL_LIGHTING);
+	glstate.enable(GL_LIGHTING);
 	glColor4f(1,1,1,1);
 
 	/*
@@ -727,37 +1365,6 @@ void MapChunk::draw()
 	*/
 }
 
-void MapChunk::drawNoDetail()
-{
-	glActiveTextureARB(GL_TEXTURE1_ARB);
-	glDisable(GL_TEXTURE_2D);
-	glActiveTextureARB(GL_TEXTURE0_ARB);
-	glDisable(GL_TEXTURE_2D);
-	glDisable(GL_LIGHTING);
-
-	glColor3fv(gWorld->skies->colorSet[FOG_COLOR]);
-	//glColor3f(1,0,0);
-	//glDisable(GL_FOG);
-
-	// low detail version
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices);
-	glVertexPointer(3, GL_FLOAT, 0, 0);
-	glDisableClientState(GL_NORMAL_ARRAY);
-	glDrawElements(GL_TRIANGLE_STRIP, stripsize, GL_UNSIGNED_SHORT, gWorld->mapstrip);
-	glEnableClientState(GL_NORMAL_ARRAY);
-
-	glColor4f(1,1,1,1);
-	//glEnable(GL_FOG);
-
-	glEnable(GL_LIGHTING);
-	glActiveTextureARB(GL_TEXTURE1_ARB);
-	glEnable(GL_TEXTURE_2D);
-	glActiveTextureARB(GL_TEXTURE0_ARB);
-	glEnable(GL_TEXTURE_2D);
-}
-
-
-
 void MapChunk::drawWater()
 {
 	// TODO: figure out how water really works
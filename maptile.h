@@ -11,15 +11,44 @@
 #include "wmo.h"
 #include "model.h"
 #include "liquid.h"
+#include "chunkbounds.h"
+#include "doodadgrid.h"
+#include "occlusion.h"
+#include "skyline.h"
 #include <vector>
 #include <string>
 
 class MapTile;
 class MapChunk;
+class MappedFile;
 
 class World;
 
 const int mapbufsize = 9*9 + 8*8;
+// terrain liquid: 9*9 heights + 8*8 tile flags
+const int lqdatasize = 9*9*8 + 8*8;
+
+// terrain vertices on the card: positions quantized to TERRAIN_QUANT steps from the tile's
+// corner (heights to the map wide World::terrainstep) and scaled back by the modelview, byte
+// normals, 12 bytes instead of 24
+const float TERRAIN_QUANT = UNITSIZE / 128.0f;
+struct MapVertex {
+	short pos[4];
+	signed char nrm[4];
+};
+
+// terrain detail levels: 0 is the high res strip, 1 the outer 9x9 grid, then every 2nd and
+// every 4th outer vertex. Levels 0 and 1 share their edges, so along the edges they count as one
+const int TERRAIN_LODS = 4;
+inline int lodEdge(int lod) { return lod > 1 ? lod : 1; }
+
+// decoded chunk data, only kept around until the chunk has been uploaded
+struct MapChunkData {
+	Vec3D tv[mapbufsize], tn[mapbufsize];
+	unsigned char amaps[3][64*64];
+	unsigned char smap[64*64];
+	char lq[lqdatasize];
+};
 
 class MapNode {
 public:
@@ -47,33 +76,57 @@ public:
 	float r;
 
 	unsigned int areaID;
+	int flags, holes;
 
 	bool haswater;
-	bool visible;
 	bool hasholes;
 	float waterlevel;
 
 	TextureID textures[4];
-	TextureID alphamaps[3];
-	TextureID shadow;
 
+	int texidx[4];
 	int animated[4];
 
-	GLuint vertices, normals;
-
-	short *strip;
-	int striplen;
+	// decoded vertices, normals, alpha/shadow maps and liquid data
+	// these point either into data or into a mapped tile cache file
+	Vec3D *tv, *tn;
+	unsigned char *amaps[3], *smap;
+	char *lqdata;
+	MapChunkData *data;
+
+	// place of the chunk's vertices in the tile's vertex buffer, j*16+i
+	int slot;
+
+	// strip (or triangle list) in the world's terrain index buffer
+	int stripofs, striplen;
+	GLenum stripmode;
+
+	// detail level for this frame and the frame it was picked in, see World::selectTerrainLOD;
+	// loderror is the largest height error of each level against the full grid
+	int lod, lodframe;
+	float loderror[TERRAIN_LODS];
+	// 5x5 grid of outer heights for occlusion culling, and how far the 5x5 and 3x3 grids
+	// have to sink to stay under the ground; the ground rises at most occrise above the 5x5 one
+	float occheights[5*5];
+	float occsink[2];
+	float occrise;
 
 	Liquid *lq;
 
-	MapChunk():MapNode(0,0,0) {}
+	MapChunk():MapNode(0,0,0), nTextures(0), data(0), slot(0), stripofs(0), striplen(0),
+		stripmode(GL_TRIANGLE_STRIP), lod(0), lodframe(0), lq(0) {}
 
 	void init(MapTile* mt, MPQFile &f);
+	size_t upload(int slot);
 	void destroy();
-	void initStrip(int holes);
 
 	void draw();
-	void drawNoDetail();
+	void pickStrip();
+	void addOccluder(OcclusionBuffer *ob, bool fine);
+	void addGround(Skyline *sl, bool fine);
+	// whether p, somewhere over the chunk, might be under the ground
+	bool underground(const Vec3D &p);
+	void drawLayers();
 	void drawPass(int anim);
 	void drawWater();
 
@@ -90,8 +143,24 @@ public:
 	int nWMO;
 	int nMDX;
 
+	// placement records, turned into instances on upload
+	std::vector<ModelPlacement> modelps;
+	std::vector<WMOPlacement> wmops;
+
+	// tile cache file the chunk data is mapped from, if any
+	MappedFile *cachefile;
+
 	int x, z;
 	bool ok;
+	// tiles are decoded on construction (possibly on the loader thread) and uploaded later
+	bool uploaded;
+	// loaded ahead of time by the prefetcher and not yet entered
+	bool prefetched;
+	int uploadstage, uploadpos;
+
+	// memory held by this tile, used by the world's tile cache
+	size_t cpubytes, gpubytes;
+	unsigned int lastused;
 
 	//World *world;
 
@@ -100,11 +169,40 @@ public:
 	MapChunk chunks[16][16];
 
 	MapNode topnode;
+	ChunkBounds bounds;
+	// the model instances, culled a cell at a time
+	DoodadGrid doodads;
+
+	// vertices of all chunks in one buffer, quantized relative to vorigin (the tile corner at
+	// height 0) with heights in steps of vscale, World::terrainstep
+	GLuint vertices;
+	Vec3D vorigin;
+	float vscale;
+
+	// alpha and shadow maps of all chunks, 16x16 cells of 64x64 in chunk slot order; the terrain
+	// shader uses the RGBA splat atlas (alpha maps in rgb, shadow in alpha), the texture passes the others
+	TextureID splatatlas;
+	TextureID alphaatlas[3], shadowatlas;
+	size_t createAtlases();
+
+	// chunks found in view this frame by cull(): near ones get all passes, far ones are
+	// drawn fog colored, and the ones with liquid in reach get their water drawn
+	std::vector<MapChunk*> drawchunks, lodchunks, waterchunks;
 
 	MapTile(int x0, int z0, char* filename);
 	~MapTile();
 
+	bool decode(char* filename);
+	void upload();
+	bool uploadStep(size_t &bytes);
+
+	void cull();
+	void occlusionCull();
 	void draw();
+	void setupVertices();
+	void drawLowDetail();
+	void drawBase();
+	void drawShaded();
 	void drawWater();
 	void drawObjects();
 	void drawSky();
@@ -116,6 +214,11 @@ public:
 };
 
 int indexMapBuf(int x, int y);
+// strip for a chunk with holes whose vertices start at base, returns the length (at most 256)
+int makeHoleStrip(int holes, unsigned short base, unsigned short *out);
+// triangle list of a chunk on detail level 2 or up; the edges flagged in stitch (1 -z, 2 +z, 4 -x, 8 +x)
+// take every vertex of the next finer level. Returns the length (at most 216)
+int makeLODTris(int lod, int stitch, unsigned short base, unsigned short *out);
 
 
 // 8x8x2 version with triangle strips, size = 8*18 + 7*2
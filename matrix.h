@@ -119,6 +119,31 @@ public:
 		return t;
 	}
 
+	void rotation(const Vec3D& axis, float degrees)
+	{
+		/*
+			like glRotatef, axis normalized
+			###0
+			###0
+			###0
+			0001
+		*/
+		float a = degrees * 3.14159265358f / 180.0f;
+		float c = cosf(a), s = sinf(a), t = 1.0f - c;
+		float x = axis.x, y = axis.y, z = axis.z;
+		unit();
+		m[0][0] = x*x*t + c;	m[0][1] = x*y*t - z*s;	m[0][2] = x*z*t + y*s;
+		m[1][0] = y*x*t + z*s;	m[1][1] = y*y*t + c;	m[1][2] = y*z*t - x*s;
+		m[2][0] = x*z*t - y*s;	m[2][1] = y*z*t + x*s;	m[2][2] = z*z*t + c;
+	}
+
+	static const Matrix newRotation(const Vec3D& axis, float degrees)
+	{
+		Matrix t;
+		t.rotation(axis, degrees);
+		return t;
+	}
+
 	Vec3D operator* (const Vec3D& v) const
 	{
 		Vec3D o;
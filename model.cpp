@@ -15,6 +15,8 @@ Model::Model(std::string name, bool forceAnim) : ManagedItem(name), forceAnim(fo
 
 	MPQFile f(tempname);
 	ok = !f.isEof();
+	rad = 0;
+	vmin = vmax = Vec3D(0,0,0);
 
 	if (!ok) {
 		gLog("Error loading model [%s]\n", tempname);
@@ -100,6 +102,7 @@ Model::~Model()
 
 		} else {
 			glDeleteLists(dlist, 1);
+			if (!passes.empty()) glDeleteLists(plists, (GLsizei)passes.size());
 		}
 	}
 }
@@ -202,8 +205,9 @@ void Model::initCommon(MPQFile &f)
 		normals = new Vec3D[header.nVertices];
 	}
 
-	//Vec3D vmin = Vec3D( 9999999.0f, 9999999.0f, 9999999.0f);
-	//Vec3D vmax = Vec3D(-9999999.0f,-9999999.0f,-9999999.0f);
+	vmin = Vec3D( 9999999.0f, 9999999.0f, 9999999.0f);
+	vmax = Vec3D(-9999999.0f,-9999999.0f,-9999999.0f);
+	rad = 0;
 	// vertices, normals
 	for (size_t i=0; i<header.nVertices; i++) {
 		origVertices[i].pos = fixCoordSystem(origVertices[i].pos);
@@ -218,17 +222,31 @@ void Model::initCommon(MPQFile &f)
 		if (len > rad){ 
 			rad = len;
 		}
-		/*
 		if (origVertices[i].pos.x < vmin.x) vmin.x = origVertices[i].pos.x;
 		if (origVertices[i].pos.y < vmin.y) vmin.y = origVertices[i].pos.y;
 		if (origVertices[i].pos.z < vmin.z) vmin.z = origVertices[i].pos.z;
 		if (origVertices[i].pos.x > vmax.x) vmax.x = origVertices[i].pos.x;
 		if (origVertices[i].pos.y > vmax.y) vmax.y = origVertices[i].pos.y;
 		if (origVertices[i].pos.z > vmax.z) vmax.z = origVertices[i].pos.z;
-		*/
 	}
 	rad = sqrtf(rad);
-	//rad = std::max(vmin.length(),vmax.length());
+
+	// the header's bounding and collision boxes, which also take in what the bind pose doesn't
+	for (int b=0; b<2; b++) {
+		const float *box = header.floats + b*7;
+		Vec3D c0 = fixCoordSystem(Vec3D(box[0], box[1], box[2]));
+		Vec3D c1 = fixCoordSystem(Vec3D(box[3], box[4], box[5]));
+		if (c0.x == c1.x && c0.y == c1.y && c0.z == c1.z) continue;
+		Vec3D lo(c0.x < c1.x ? c0.x : c1.x, c0.y < c1.y ? c0.y : c1.y, c0.z < c1.z ? c0.z : c1.z);
+		Vec3D hi(c0.x > c1.x ? c0.x : c1.x, c0.y > c1.y ? c0.y : c1.y, c0.z > c1.z ? c0.z : c1.z);
+		if (lo.x < vmin.x) vmin.x = lo.x;
+		if (lo.y < vmin.y) vmin.y = lo.y;
+		if (lo.z < vmin.z) vmin.z = lo.z;
+		if (hi.x > vmax.x) vmax.x = hi.x;
+		if (hi.y > vmax.y) vmax.y = hi.y;
+		if (hi.z > vmax.z) vmax.z = hi.z;
+	}
+	if (vmin.x > vmax.x) vmin = vmax = Vec3D(0,0,0);
 
 	// textures
 	ModelTextureDef *texdef = (ModelTextureDef*)(f.getBuffer() + header.ofsTextures);
@@ -345,6 +363,7 @@ void Model::initCommon(MPQFile &f)
 		ModelRenderPass pass;
 		pass.usetex2 = false;
 		pass.texture2 = 0;
+		pass.queued = false;
 		size_t geoset = tex[j].op;
 		pass.indexStart = ops[geoset].istart;
 		pass.indexCount = ops[geoset].icount;
@@ -400,12 +419,22 @@ void Model::initStatic(MPQFile &f)
 
 	initCommon(f);
 
+	// the passes' colors can't change, so the ones that come out opaque always go to the render queue
+	plists = glGenLists((GLsizei)passes.size());
+	for (size_t i=0; i<passes.size(); i++) {
+		ModelRenderPass &p = passes[i];
+		p.queued = p.solid(this);
+		glstate.beginList(plists + (GLuint)i);
+		if (p.setColor(this)) drawPass(p);
+		glstate.endList();
+	}
+
 	dlist = glGenLists(1);
-	glNewList(dlist, GL_COMPILE);
+	glstate.beginList(dlist);
 
     drawModel();
 
-	glEndList();
+	glstate.endList();
 
 	// clean up vertices, indices etc
 	delete[] vertices;
@@ -583,67 +612,73 @@ void Model::animate(int anim)
 
 
 bool ModelRenderPass::init(Model *m)
+{
+	setup(m);
+	return setColor(m);
+}
+
+void ModelRenderPass::setup(Model *m)
 {
 	// blend mode
 	switch (blendmode) {
 	case BM_OPAQUE:	// 0
-		glDisable(GL_BLEND);
-		glDisable(GL_ALPHA_TEST);
+		glstate.disable(GL_BLEND);
+		glstate.disable(GL_ALPHA_TEST);
 		break;
 	case BM_TRANSPARENT: // 1
-		glDisable(GL_BLEND);
-		glEnable(GL_ALPHA_TEST);
+		glstate.disable(GL_BLEND);
+		glstate.enable(GL_ALPHA_TEST);
 		break;
 	case BM_ALPHA_BLEND: // 2
-		glDisable(GL_ALPHA_TEST);
- 		glEnable(GL_BLEND);
+		glstate.disable(GL_ALPHA_TEST);
+ 		glstate.enable(GL_BLEND);
 		// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // default blend func
 		break;
 	case BM_ADDITIVE: // 3
-		glDisable(GL_ALPHA_TEST);
- 		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_COLOR, GL_ONE);
+		glstate.disable(GL_ALPHA_TEST);
+ 		glstate.enable(GL_BLEND);
+		glstate.blendFunc(GL_SRC_COLOR, GL_ONE);
 		break;
 	case BM_ADDITIVE_ALPHA: // 4
-		glDisable(GL_ALPHA_TEST);
- 		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		glstate.disable(GL_ALPHA_TEST);
+ 		glstate.enable(GL_BLEND);
+		glstate.blendFunc(GL_SRC_ALPHA, GL_ONE);
 		break;
 	default:
 		// ???
-		glDisable(GL_ALPHA_TEST);
- 		glEnable(GL_BLEND);
-		glBlendFunc(GL_DST_COLOR, GL_SRC_COLOR);
+		glstate.disable(GL_ALPHA_TEST);
+ 		glstate.enable(GL_BLEND);
+		glstate.blendFunc(GL_DST_COLOR, GL_SRC_COLOR);
 	}
 
 	if (nozwrite) {
-		glDepthMask(GL_FALSE);
+		glstate.depthMask(GL_FALSE);
 	}
 
 	if (cull) {
-        glEnable(GL_CULL_FACE);
+        glstate.enable(GL_CULL_FACE);
 	} else {
-        glDisable(GL_CULL_FACE);
+        glstate.disable(GL_CULL_FACE);
 	}
 
-	glBindTexture(GL_TEXTURE_2D, texture);
+	glstate.bindTexture(texture);
 
 	if (usetex2) {
-		glActiveTextureARB(GL_TEXTURE1);
-		glEnable(GL_TEXTURE_2D);
-		glBindTexture(GL_TEXTURE_2D, texture2);
+		glstate.activeTexture(GL_TEXTURE1);
+		glstate.enable(GL_TEXTURE_2D);
+		glstate.bindTexture(texture2);
 	}
 
 	if (unlit) {
-		glDisable(GL_LIGHTING);
+		glstate.disable(GL_LIGHTING);
 		// unfogged = unlit?
-		glDisable(GL_FOG);
+		glstate.disable(GL_FOG);
 	}
 
 	if (useenvmap) {
 		// env mapping
-		glEnable(GL_TEXTURE_GEN_S);
-		glEnable(GL_TEXTURE_GEN_T);
+		glstate.enable(GL_TEXTURE_GEN_S);
+		glstate.enable(GL_TEXTURE_GEN_T);
 
 		const GLint maptype = GL_SPHERE_MAP;
 		//const GLint maptype = GL_REFLECTION_MAP_ARB;
@@ -658,9 +693,12 @@ bool ModelRenderPass::init(Model *m)
 
 		m->texanims[texanim].setup();
 	}
+}
 
-	Vec4D ocol(1,1,1,m->trans);
-	Vec4D ecol(0,0,0,0);
+bool ModelRenderPass::getColor(Model *m, Vec4D &ocol, Vec4D &ecol)
+{
+	ocol = Vec4D(1,1,1,m->trans);
+	ecol = Vec4D(0,0,0,0);
 
 	// emissive colors
 	if (color!=-1) {
@@ -673,19 +711,34 @@ bool ModelRenderPass::init(Model *m)
 		}
 		ecol = Vec4D(c, 1.0f);
 	}
-	glMaterialfv(GL_FRONT, GL_EMISSION, ecol);
 
 	// opacity
 	if (opacity!=-1) {
 		ocol.w *= m->transparency[opacity].trans.getValue(m->anim,m->animtime);
 	}
 
-	// color
+	return (ocol.w > 0) || (ecol.lengthSquared() > 0);
+}
+
+bool ModelRenderPass::setColor(Model *m)
+{
+	Vec4D ocol, ecol;
+	bool visible = getColor(m, ocol, ecol);
+
+	glMaterialfv(GL_FRONT, GL_EMISSION, ecol);
 	glColor4fv(ocol);
 
-	if (blendmode<=1 && ocol.w!=1.0f) glEnable(GL_BLEND);
+	if (blendmode<=1 && ocol.w!=1.0f) glstate.enable(GL_BLEND);
 
-	return (ocol.w > 0) || (ecol.lengthSquared() > 0);
+	return visible;
+}
+
+bool ModelRenderPass::solid(Model *m)
+{
+	// opaque all over and nothing the queue doesn't know how to set up
+	if (blendmode > BM_TRANSPARENT || nozwrite || usetex2 || texanim != -1) return false;
+	Vec4D ocol, ecol;
+	return getColor(m, ocol, ecol) && ocol.w == 1.0f;
 }
 
 void ModelRenderPass::deinit()
@@ -699,81 +752,90 @@ void ModelRenderPass::deinit()
 		//glDepthMask(GL_TRUE);
 		break;
 	default:
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // default blend func
+		glstate.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // default blend func
 	}
 	if (nozwrite) {
-		glDepthMask(GL_TRUE);
+		glstate.depthMask(GL_TRUE);
 	}
 	if (texanim!=-1) {
 		glPopMatrix();
 		glMatrixMode(GL_MODELVIEW);
 	}
 	if (unlit) {
-		glEnable(GL_LIGHTING);
-		if (gWorld && gWorld->drawfog) glEnable(GL_FOG);
+		glstate.enable(GL_LIGHTING);
+		if (gWorld && gWorld->drawfog) glstate.enable(GL_FOG);
 	}
 	if (useenvmap) {
-		glDisable(GL_TEXTURE_GEN_S);
-		glDisable(GL_TEXTURE_GEN_T);
+		glstate.disable(GL_TEXTURE_GEN_S);
+		glstate.disable(GL_TEXTURE_GEN_T);
 	}
 	if (usetex2) {
-		glDisable(GL_TEXTURE_2D);
-		glActiveTextureARB(GL_TEXTURE0);
+		glstate.disable(GL_TEXTURE_2D);
+		glstate.activeTexture(GL_TEXTURE0);
 	}
 	//glColor4f(1,1,1,1); //???
 }
 
-void Model::drawModel()
+void Model::bindBuffers()
 {
 	// assume these client states are enabled: GL_VERTEX_ARRAY, GL_NORMAL_ARRAY, GL_TEXTURE_COORD_ARRAY
+	if (animGeometry) {
 
-	if (animated) {
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbuf);
 
-		if (animGeometry) {
+		glVertexPointer(3, GL_FLOAT, 0, 0);
+		glNormalPointer(GL_FLOAT, 0, GL_BUFFER_OFFSET(vbufsize));
 
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbuf);
+	} else {
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbuf);
+		glVertexPointer(3, GL_FLOAT, 0, 0);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, nbuf);
+		glNormalPointer(GL_FLOAT, 0, 0);
+	}
 
-			glVertexPointer(3, GL_FLOAT, 0, 0);
-			glNormalPointer(GL_FLOAT, 0, GL_BUFFER_OFFSET(vbufsize));
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, tbuf);
+	glTexCoordPointer(2, GL_FLOAT, 0, 0);
+	
+	//glTexCoordPointer(2, GL_FLOAT, sizeof(ModelVertex), &origVertices[0].texcoords);
+}
 
-		} else {
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbuf);
-			glVertexPointer(3, GL_FLOAT, 0, 0);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, nbuf);
-			glNormalPointer(GL_FLOAT, 0, 0);
+void Model::drawPass(const ModelRenderPass &p)
+{
+	if (animated) {
+		//glDrawElements(GL_TRIANGLES, p.indexCount, GL_UNSIGNED_SHORT, indices + p.indexStart);
+		// a GDC OpenGL Performace Tuning paper recommended glDrawRangeElements over glDrawElements
+		// I can't notice a difference but I guess it can't hurt
+		glDrawRangeElements(GL_TRIANGLES, p.vertexStart, p.vertexEnd, p.indexCount, GL_UNSIGNED_SHORT, indices + p.indexStart);
+	} else {
+		glBegin(GL_TRIANGLES);
+		for (size_t k = 0, b=p.indexStart; k<p.indexCount; k++,b++) {
+			uint16 a = indices[b];
+			glNormal3fv(normals[a]);
+			glTexCoord2fv(origVertices[a].texcoords);
+			glVertex3fv(vertices[a]);
 		}
-
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, tbuf);
-		glTexCoordPointer(2, GL_FLOAT, 0, 0);
-		
-		//glTexCoordPointer(2, GL_FLOAT, sizeof(ModelVertex), &origVertices[0].texcoords);
+		glEnd();
 	}
+}
 
-	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+void Model::drawModel()
+{
+	if (animated) bindBuffers();
+
+	glstate.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glAlphaFunc (GL_GREATER, 0.3f);
 
 	for (size_t i=0; i<passes.size(); i++) {
 		ModelRenderPass &p = passes[i];
 
-		if (p.init(this)) {
+		if (animated) {
 			// we don't want to render completely transparent parts
-		
-			// render
-			if (animated) {
-				//glDrawElements(GL_TRIANGLES, p.indexCount, GL_UNSIGNED_SHORT, indices + p.indexStart);
-				// a GDC OpenGL Performace Tuning paper recommended glDrawRangeElements over glDrawElements
-				// I can't notice a difference but I guess it can't hurt
-				glDrawRangeElements(GL_TRIANGLES, p.vertexStart, p.vertexEnd, p.indexCount, GL_UNSIGNED_SHORT, indices + p.indexStart);
-			} else {
-				glBegin(GL_TRIANGLES);
-				for (size_t k = 0, b=p.indexStart; k<p.indexCount; k++,b++) {
-					uint16 a = indices[b];
-					glNormal3fv(normals[a]);
-					glTexCoord2fv(origVertices[a].texcoords);
-					glVertex3fv(vertices[a]);
-				}
-				glEnd();
-			}
+			if (p.init(this)) drawPass(p);
+		} else {
+			// the list has the color, and nothing if the pass is invisible
+			p.setup(this);
+			glCallList(plists + (GLuint)i);
+			glstate.forget(GL_BLEND);
 		}
 
 		p.deinit();
@@ -782,12 +844,12 @@ void Model::drawModel()
 	// done with all render ops
 
 	glAlphaFunc (GL_GREATER, 0.0f);
-	glDisable (GL_ALPHA_TEST);
+	glstate.disable(GL_ALPHA_TEST);
 
 	GLfloat czero[4] = {0,0,0,1};
 	glMaterialfv(GL_FRONT, GL_EMISSION, czero);
 	glColor4f(1,1,1,1);
-	glDepthMask(GL_TRUE);
+	glstate.depthMask(GL_TRUE);
 }
 
 void TextureAnim::calc(int anim, int time)
@@ -1001,8 +1063,13 @@ void Model::draw()
 {
 	if (!ok) return;
 
+	// whoever drew before didn't go through the state cache
+	glstate.invalidate();
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+
 	if (!animated) {
 		glCallList(dlist);
+		glstate.invalidate();
 	} else {
 		if (ind) animate(0);
 		else {
@@ -1015,21 +1082,49 @@ void Model::draw()
         drawModel();
 		lightsOff(GL_LIGHT4);
 
-		// effects are unfogged..?
-		glDisable(GL_FOG);
+		drawEffects();
+	}
+}
 
-		// draw particle systems
-		for (size_t i=0; i<header.nParticleEmitters; i++) {
-			particleSystems[i].draw();
-		}
+void Model::drawEffects()
+{
+	// effects are unfogged..?
+	glDisable(GL_FOG);
 
-		// draw ribbons
-		for (size_t i=0; i<header.nRibbonEmitters; i++) {
-			ribbons[i].draw();
-		}
+	// draw particle systems
+	for (size_t i=0; i<header.nParticleEmitters; i++) {
+		particleSystems[i].draw();
+	}
 
-		if (gWorld && gWorld->drawfog) glEnable(GL_FOG);
+	// draw ribbons
+	for (size_t i=0; i<header.nRibbonEmitters; i++) {
+		ribbons[i].draw();
 	}
+
+	if (gWorld && gWorld->drawfog) glEnable(GL_FOG);
+	// the particles and ribbons set their own state
+	glstate.invalidate();
+}
+
+bool Model::queue(RenderQueue *q, const Matrix *mat, float depth)
+{
+	if (!ok) return true;
+	// per instance animation and model lights need the whole model drawn in one go
+	if (ind || header.nLights) return false;
+
+	if (animated) {
+		if (!animcalc) {
+			animate(0);
+			animcalc = true;
+		}
+		for (size_t i=0; i<passes.size(); i++) passes[i].queued = passes[i].solid(this);
+	}
+	for (size_t i=0; i<passes.size(); i++) {
+		if (passes[i].queued) q->add(this, (int)i, mat, depth);
+		else q->addTransparent(this, (int)i, mat, depth);
+	}
+	if (animated && (header.nParticleEmitters || header.nRibbonEmitters)) q->addEffects(this, mat, depth);
+	return true;
 }
 
 void Model::lightsOn(GLuint lbase)
@@ -1080,17 +1175,30 @@ void ModelManager::updateEmitters(float dt)
 	}
 }
 
-ModelInstance::ModelInstance(Model *m, MPQFile &f) : model (m)
+ModelInstance::ModelInstance(Model *m, const ModelPlacement &p) : model (m)
 {
-	float ff[3];
-    f.read(&d1, 4);
-	f.read(ff,12);
-	pos = Vec3D(ff[0],ff[1],ff[2]);
-	f.read(ff,12);
-	dir = Vec3D(ff[0],ff[1],ff[2]);
-	f.read(&scale,4);
+	d1 = p.uniqueid;
+	pos = Vec3D(p.pos[0],p.pos[1],p.pos[2]);
+	dir = Vec3D(p.dir[0],p.dir[1],p.dir[2]);
+	scale = p.scale;
 	// scale factor - divide by 1024. blizzard devs must be on crack, why not just use a float?
 	sc = scale / 1024.0f;
+
+	// the model's box turned and scaled the way draw() does it
+	Matrix rot = Matrix::newRotation(Vec3D(0,1,0), dir.y - 90.0f) * Matrix::newRotation(Vec3D(0,0,1), -dir.x)
+		* Matrix::newRotation(Vec3D(1,0,0), dir.z);
+	mat = Matrix::newTranslation(pos) * rot * Matrix::newScale(Vec3D(sc,sc,sc));
+	vmin = vmax = pos;
+	for (int k=0; k<8; k++) {
+		Vec3D c((k&1) ? m->vmax.x : m->vmin.x, (k&2) ? m->vmax.y : m->vmin.y, (k&4) ? m->vmax.z : m->vmin.z);
+		c = rot * (c * sc) + pos;
+		if (c.x < vmin.x) vmin.x = c.x;
+		if (c.y < vmin.y) vmin.y = c.y;
+		if (c.z < vmin.z) vmin.z = c.z;
+		if (c.x > vmax.x) vmax.x = c.x;
+		if (c.y > vmax.y) vmax.y = c.y;
+		if (c.z > vmax.z) vmax.z = c.z;
+	}
 }
 
 void ModelInstance::init2(Model *m, MPQFile &f)
@@ -1117,7 +1225,23 @@ void ModelInstance::draw()
 	//if ((pos - gWorld->camera).lengthSquared() > (gWorld->modeldrawdistance2+(model->rad*model->rad*sc))) return;
 	float dist = (pos - gWorld->camera).length() - model->rad;
 	if (dist > gWorld->modeldrawdistance) return;
-	if (!gWorld->frustum.intersectsSphere(pos, model->rad*sc)) return;
+	if (gWorld->modelboxes) {
+		if (!gWorld->frustum.intersects(vmin, vmax)) return;
+		if (!gWorld->skyline->objectVisible(vmin, vmax)) return;
+		if (!gWorld->occlusion->objectVisible(vmin, vmax)) return;
+	} else {
+		if (!gWorld->frustum.intersectsSphere(pos, model->rad*sc)) return;
+		if (!gWorld->skyline->objectVisible(pos, model->rad*sc)) return;
+		if (!gWorld->occlusion->objectVisible(pos, model->rad*sc)) return;
+	}
+	gWorld->modelsdrawn++;
+
+	if (gWorld->renderqueue->enabled) {
+		// the opaque passes get sorted by state with everyone else's, the rest back to front
+		float depth = dist + model->rad;
+		if (!model->queue(gWorld->renderqueue, &mat, depth)) gWorld->renderqueue->addInstance(this, depth);
+		return;
+	}
 
 	glPushMatrix();
 	glTranslatef(pos.x, pos.y, pos.z);
@@ -1132,6 +1256,17 @@ void ModelInstance::draw()
 	glPopMatrix();
 }
 
+void ModelInstance::drawUnqueued()
+{
+	glPushMatrix();
+	Matrix t = mat;
+	t.transpose();
+	glMultMatrixf(t);
+
+	model->draw();
+	glPopMatrix();
+}
+
 void glQuaternionRotate(const Vec3D& vdir, float w)
 {
 	Matrix m;
@@ -1146,6 +1281,8 @@ void ModelInstance::draw2(const Vec3D& ofs, const float rot)
 	rotate(ofs.x,ofs.z,&tpos.x,&tpos.z,rot*PI/180.0f);
 	if ( (tpos - gWorld->camera).lengthSquared() > (gWorld->doodaddrawdistance2*model->rad*sc) ) return;
 	if (!gWorld->frustum.intersectsSphere(tpos, model->rad*sc)) return;
+	if (!gWorld->skyline->objectVisible(tpos, model->rad*sc)) return;
+	if (!gWorld->occlusion->objectVisible(tpos, model->rad*sc)) return;
 
 	glPushMatrix();
 
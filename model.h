@@ -5,11 +5,13 @@
 
 class Model;
 class Bone;
+class RenderQueue;
 Vec3D fixCoordSystem(Vec3D v);
 
 #include "manager.h"
 #include "mpq.h"
 #include "video.h"
+#include "glstate.h"
 
 #include "modelheaders.h"
 #include "quaternion.h"
@@ -83,8 +85,14 @@ struct ModelRenderPass {
 	
 	int16 texanim, color, opacity, blendmode;
 	int16 order;
+	// opaque and drawn sorted by state in the render queue, the rest is sorted by depth
+	bool queued;
 
 	bool init(Model *m);
+	void setup(Model *m);
+	bool setColor(Model *m);
+	bool getColor(Model *m, Vec4D &ocol, Vec4D &ecol);
+	bool solid(Model *m);
 	void deinit();
 
 	bool operator< (const ModelRenderPass &m) const
@@ -123,6 +131,8 @@ struct ModelLight {
 class Model: public ManagedItem {
 
 	GLuint dlist;
+	// static models: each pass's color and geometry on its own
+	GLuint plists;
 	GLuint vbuf, nbuf, tbuf;
 	size_t vbufsize;
 	bool animated;
@@ -143,6 +153,9 @@ class Model: public ManagedItem {
 	RibbonEmitter *ribbons;
 
 	void drawModel();
+	void drawPass(const ModelRenderPass &p);
+	void drawEffects();
+	void bindBuffers();
 	void initCommon(MPQFile &f);
 	bool isAnimated(MPQFile &f);
 	void initAnimated(MPQFile &f);
@@ -169,6 +182,8 @@ public:
 	bool ind;
 
 	float rad;
+	// model space bounds: the vertices and the header's bounding and collision boxes
+	Vec3D vmin, vmax;
 	float trans;
 	bool animcalc;
 	int anim, animtime;
@@ -176,9 +191,12 @@ public:
 	Model(std::string name, bool forceAnim=false);
 	~Model();
 	void draw();
+	// sends the opaque passes and the rest to the queue, false if it has to be drawn whole
+	bool queue(RenderQueue *q, const Matrix *mat, float depth);
 	void updateEmitters(float dt);
 
 	friend struct ModelRenderPass;
+	friend class RenderQueue;
 };
 
 class ModelManager: public SimpleManager {
@@ -195,6 +213,15 @@ public:
 };
 
 
+// model placement record as stored in the ADT MDDF chunk
+struct ModelPlacement {
+	uint32 nameid;
+	uint32 uniqueid;
+	float pos[3];
+	float dir[3];
+	uint32 scale;
+};
+
 class ModelInstance {
 public:
 	Model *model;
@@ -210,10 +237,16 @@ public:
 	Vec3D ldir;
 	Vec3D lcol;
 
+	// world space bounds and model to world transform of map placed instances
+	Vec3D vmin, vmax;
+	Matrix mat;
+
 	ModelInstance() {}
-	ModelInstance(Model *m, MPQFile &f);
+	ModelInstance(Model *m, const ModelPlacement &p);
     void init2(Model *m, MPQFile &f);
 	void draw();
+	// with the precomputed transform, for the render queue
+	void drawUnqueued();
 	void draw2(const Vec3D& ofs, const float rot);
 
 };
@@ -2,11 +2,17 @@
 #include "wowmapview.h"
 
 #include <vector>
+#include <SDL/SDL.h>
 typedef std::vector<mpq_archive*> ArchiveSet;
 ArchiveSet gOpenArchives;
 
+// archives are shared with the tile loader thread, only one file is read at a time
+SDL_mutex *gMPQMutex = 0;
+
 MPQArchive::MPQArchive(const char* filename)
 {
+	if (!gMPQMutex) gMPQMutex = SDL_CreateMutex();
+
 	int result = libmpq_archive_open(&mpq_a, (unsigned char*)filename);
 	gLog("Opening %s\n", filename);
 	if(result) {
@@ -28,6 +34,7 @@ MPQFile::MPQFile(const char* filename):
 	pointer(0),
 	size(0)
 {
+	SDL_LockMutex(gMPQMutex);
 	for(ArchiveSet::iterator i=gOpenArchives.begin(); i!=gOpenArchives.end();++i)
 	{
 		mpq_archive &mpq_a = **i;
@@ -40,12 +47,15 @@ MPQFile::MPQFile(const char* filename):
 		if (size<=1) {
 			eof = true;
 			buffer = 0;
+			SDL_UnlockMutex(gMPQMutex);
 			return;
 		}
 		buffer = new char[size];
 		libmpq_file_getdata(&mpq_a, fileno, (unsigned char*)buffer);
+		SDL_UnlockMutex(gMPQMutex);
 		return;
 	}
+	SDL_UnlockMutex(gMPQMutex);
 	eof = true;
 	buffer = 0;
 }
@@ -0,0 +1,314 @@
+#include "occlusion.h"
+#include "video.h"
+
+#include <cmath>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+#define OCCLUSION_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+OcclusionBuffer::OcclusionBuffer(int threads): ready(false), starttime(0), quit(false), enabled(true)
+{
+	occludertris = chunkstested = chunksculled = objectstested = objectsculled = 0;
+	time = 0;
+
+	depth = new float[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+	done = SDL_CreateSemaphore(0);
+	for (int i=0; i<threads; i++) {
+		OcclusionWorker *w = new OcclusionWorker;
+		w->buffer = this;
+		w->band = i+1;
+		w->start = SDL_CreateSemaphore(0);
+		w->thread = SDL_CreateThread(threadFunc, w);
+		workers.push_back(w);
+	}
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+	quit = true;
+	for (size_t i=0; i<workers.size(); i++) SDL_SemPost(workers[i]->start);
+	for (size_t i=0; i<workers.size(); i++) {
+		SDL_WaitThread(workers[i]->thread, 0);
+		SDL_DestroySemaphore(workers[i]->start);
+		delete workers[i];
+	}
+	SDL_DestroySemaphore(done);
+	delete[] depth;
+}
+
+int OcclusionBuffer::threadFunc(void *p)
+{
+	OcclusionWorker *w = (OcclusionWorker*)p;
+	for (;;) {
+		SDL_SemWait(w->start);
+		if (w->buffer->quit) break;
+		w->buffer->rasterizeBand(w->band);
+		SDL_SemPost(w->buffer->done);
+	}
+	return 0;
+}
+
+void OcclusionBuffer::begin()
+{
+	ready = false;
+	tris.clear();
+	occludertris = chunkstested = chunksculled = objectstested = objectsculled = 0;
+	time = 0;
+	starttime = SDL_GetTicks();
+	if (!enabled) return;
+
+	// GL keeps its matrices column by column
+	float mv[16], proj[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	Matrix m, p;
+	for (int j=0; j<4; j++) {
+		for (int i=0; i<4; i++) {
+			m.m[j][i] = mv[i*4+j];
+			p.m[j][i] = proj[i*4+j];
+		}
+	}
+	viewproj = p * m;
+
+	for (int i=0; i<OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i++) depth[i] = 0;
+}
+
+void OcclusionBuffer::addTriangles(const Vec3D *verts, int nverts, const unsigned short *indices, int nindices, const Matrix *transform)
+{
+	if (!enabled) return;
+
+	// clip space x, y and w of every vertex
+	Matrix m = transform ? viewproj * (*transform) : viewproj;
+	clip.resize(nverts * 3);
+	for (int i=0; i<nverts; i++) {
+		const Vec3D &v = verts[i];
+		clip[i*3+0] = m.m[0][0]*v.x + m.m[0][1]*v.y + m.m[0][2]*v.z + m.m[0][3];
+		clip[i*3+1] = m.m[1][0]*v.x + m.m[1][1]*v.y + m.m[1][2]*v.z + m.m[1][3];
+		clip[i*3+2] = m.m[3][0]*v.x + m.m[3][1]*v.y + m.m[3][2]*v.z + m.m[3][3];
+	}
+	for (int i=0; i+2<nindices; i+=3) {
+		addClipped(&clip[indices[i]*3], &clip[indices[i+1]*3], &clip[indices[i+2]*3]);
+	}
+}
+
+// screen space setup of a clipped triangle, false if it covers no pixel centers
+static bool setupTriangle(const float *a, const float *b, const float *c, OccluderTriangle &t)
+{
+	const float *v[3] = {a, b, c};
+	for (int k=0; k<3; k++) {
+		float iw = 1.0f / v[k][2];
+		t.x[k] = (v[k][0] * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		t.y[k] = (v[k][1] * iw * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+		t.z[k] = iw;
+	}
+
+	// only front faces occlude; the card culls the back ones, and from under the terrain or
+	// inside a WMO's shell they would hide what can be seen
+	float area = (t.x[1]-t.x[0]) * (t.y[2]-t.y[0]) - (t.y[1]-t.y[0]) * (t.x[2]-t.x[0]);
+	if (area <= 0) return false;
+
+	// pixels whose centers might be inside
+	float minx = t.x[0], maxx = t.x[0], miny = t.y[0], maxy = t.y[0];
+	for (int k=1; k<3; k++) {
+		if (t.x[k] < minx) minx = t.x[k];
+		if (t.x[k] > maxx) maxx = t.x[k];
+		if (t.y[k] < miny) miny = t.y[k];
+		if (t.y[k] > maxy) maxy = t.y[k];
+	}
+	t.minx = (int)ceilf(minx - 0.5f);
+	t.maxx = (int)floorf(maxx - 0.5f);
+	t.miny = (int)ceilf(miny - 0.5f);
+	t.maxy = (int)floorf(maxy - 0.5f);
+	if (t.minx < 0) t.minx = 0;
+	if (t.miny < 0) t.miny = 0;
+	if (t.maxx > OCCLUSION_WIDTH-1) t.maxx = OCCLUSION_WIDTH-1;
+	if (t.maxy > OCCLUSION_HEIGHT-1) t.maxy = OCCLUSION_HEIGHT-1;
+	return t.minx <= t.maxx && t.miny <= t.maxy;
+}
+
+// clip planes on (x, y, w): the near plane and a guard band of a few screens around the
+// view, which keeps the screen coordinates small enough for float edge functions
+static const float guard = 4.0f;
+static float clipDistance(int plane, const float *v)
+{
+	switch (plane) {
+		case 0: return v[2] - OCCLUSION_NEAR;
+		case 1: return v[0] + guard * v[2];
+		case 2: return guard * v[2] - v[0];
+		case 3: return v[1] + guard * v[2];
+		default: return guard * v[2] - v[1];
+	}
+}
+
+void OcclusionBuffer::addClipped(const float *a, const float *b, const float *c)
+{
+	// a triangle cut by 5 planes has 8 corners at most
+	float poly[2][8][3];
+	int n = 3, cur = 0;
+	for (int i=0; i<3; i++) {
+		poly[0][0][i] = a[i];
+		poly[0][1][i] = b[i];
+		poly[0][2][i] = c[i];
+	}
+	for (int plane=0; plane<5 && n>=3; plane++) {
+		float (*in)[3] = poly[cur], (*out)[3] = poly[cur^1];
+		int m = 0;
+		for (int k=0; k<n; k++) {
+			const float *p = in[k], *q = in[(k+1)%n];
+			float dp = clipDistance(plane, p), dq = clipDistance(plane, q);
+			if (dp >= 0) {
+				for (int i=0; i<3; i++) out[m][i] = p[i];
+				m++;
+			}
+			if ((dp >= 0) != (dq >= 0)) {
+				float f = dp / (dp - dq);
+				for (int i=0; i<3; i++) out[m][i] = p[i] + (q[i] - p[i]) * f;
+				m++;
+			}
+		}
+		n = m;
+		cur ^= 1;
+	}
+
+	OccluderTriangle t;
+	for (int k=1; k+1<n; k++) {
+		if (setupTriangle(poly[cur][0], poly[cur][k], poly[cur][k+1], t)) tris.push_back(t);
+	}
+}
+
+void OcclusionBuffer::rasterize()
+{
+	occludertris = (int)tris.size();
+	if (!enabled || tris.empty()) return;
+
+	for (size_t i=0; i<workers.size(); i++) SDL_SemPost(workers[i]->start);
+	rasterizeBand(0);
+	for (size_t i=0; i<workers.size(); i++) SDL_SemWait(done);
+
+	ready = true;
+	time = SDL_GetTicks() - starttime;
+}
+
+void OcclusionBuffer::rasterizeBand(int band)
+{
+	const int bands = (int)workers.size() + 1;
+	const int y0 = band * OCCLUSION_HEIGHT / bands, y1 = (band+1) * OCCLUSION_HEIGHT / bands;
+
+	for (vector<OccluderTriangle>::iterator it = tris.begin(); it != tris.end(); ++it) {
+		const OccluderTriangle &t = *it;
+		if (t.maxy < y0 || t.miny >= y1) continue;
+
+		// edge functions, positive inside: e0 is the edge across from vertex 0 and so on
+		float ea[3], eb[3], ec[3];
+		for (int k=0; k<3; k++) {
+			int i = (k+1)%3, j = (k+2)%3;
+			ea[k] = -(t.y[j] - t.y[i]);
+			eb[k] = t.x[j] - t.x[i];
+			ec[k] = -(ea[k] * t.x[i] + eb[k] * t.y[i]);
+		}
+		// and 1/w as a plane over the screen
+		float invarea = 1.0f / (ea[0] * t.x[0] + eb[0] * t.y[0] + ec[0]);
+		float za = (ea[0]*t.z[0] + ea[1]*t.z[1] + ea[2]*t.z[2]) * invarea;
+		float zb = (eb[0]*t.z[0] + eb[1]*t.z[1] + eb[2]*t.z[2]) * invarea;
+		float zc = (ec[0]*t.z[0] + ec[1]*t.z[1] + ec[2]*t.z[2]) * invarea;
+
+		int ystart = t.miny > y0 ? t.miny : y0;
+		int yend = t.maxy < y1-1 ? t.maxy : y1-1;
+		for (int y=ystart; y<=yend; y++) {
+			float py = y + 0.5f;
+			float *row = depth + y * OCCLUSION_WIDTH;
+#ifdef OCCLUSION_SSE
+			// 4 pixels at a time from a multiple of 4, the rows are too
+			int xstart = t.minx & ~3;
+			__m128 px = _mm_add_ps(_mm_set1_ps(xstart + 0.5f), _mm_set_ps(3, 2, 1, 0));
+			__m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[0]), px), _mm_set1_ps(eb[0]*py + ec[0]));
+			__m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[1]), px), _mm_set1_ps(eb[1]*py + ec[1]));
+			__m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[2]), px), _mm_set1_ps(eb[2]*py + ec[2]));
+			__m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(za), px), _mm_set1_ps(zb*py + zc));
+			const __m128 de0 = _mm_set1_ps(ea[0]*4), de1 = _mm_set1_ps(ea[1]*4), de2 = _mm_set1_ps(ea[2]*4);
+			const __m128 dz = _mm_set1_ps(za*4);
+			const __m128 zero = _mm_setzero_ps();
+			for (int x=xstart; x<=t.maxx; x+=4) {
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 nearer = _mm_max_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+				e0 = _mm_add_ps(e0, de0);
+				e1 = _mm_add_ps(e1, de1);
+				e2 = _mm_add_ps(e2, de2);
+				z = _mm_add_ps(z, dz);
+			}
+#else
+			for (int x=t.minx; x<=t.maxx; x++) {
+				float px = x + 0.5f;
+				if (ea[0]*px + eb[0]*py + ec[0] < 0) continue;
+				if (ea[1]*px + eb[1]*py + ec[1] < 0) continue;
+				if (ea[2]*px + eb[2]*py + ec[2] < 0) continue;
+				float z = za*px + zb*py + zc;
+				if (z > row[x]) row[x] = z;
+			}
+#endif
+		}
+	}
+}
+
+bool OcclusionBuffer::visible(const Vec3D &vmin, const Vec3D &vmax)
+{
+	if (!ready) return true;
+
+	// screen rectangle and nearest point of the box, anything reaching behind the camera is in
+	float minx = 1e9f, maxx = -1e9f, miny = 1e9f, maxy = -1e9f, z = 0;
+	for (int k=0; k<8; k++) {
+		Vec3D v(k&4 ? vmax.x : vmin.x, k&2 ? vmax.y : vmin.y, k&1 ? vmax.z : vmin.z);
+		float cw = viewproj.m[3][0]*v.x + viewproj.m[3][1]*v.y + viewproj.m[3][2]*v.z + viewproj.m[3][3];
+		if (cw < OCCLUSION_NEAR) return true;
+		float iw = 1.0f / cw;
+		float sx = ((viewproj.m[0][0]*v.x + viewproj.m[0][1]*v.y + viewproj.m[0][2]*v.z + viewproj.m[0][3]) * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+		float sy = ((viewproj.m[1][0]*v.x + viewproj.m[1][1]*v.y + viewproj.m[1][2]*v.z + viewproj.m[1][3]) * iw * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+		if (sx < minx) minx = sx;
+		if (sx > maxx) maxx = sx;
+		if (sy < miny) miny = sy;
+		if (sy > maxy) maxy = sy;
+		if (iw > z) z = iw;
+	}
+
+	// every pixel the box touches; the part off the screen is for the frustum to deal with
+	int x0 = minx < 0 ? 0 : (int)minx, x1 = maxx >= OCCLUSION_WIDTH ? OCCLUSION_WIDTH-1 : (int)maxx;
+	int y0 = miny < 0 ? 0 : (int)miny, y1 = maxy >= OCCLUSION_HEIGHT ? OCCLUSION_HEIGHT-1 : (int)maxy;
+	if (x0 > x1 || y0 > y1) return true;
+	for (int y=y0; y<=y1; y++) {
+		const float *row = depth + y * OCCLUSION_WIDTH;
+		for (int x=x0; x<=x1; x++) {
+			if (row[x] < z) return true;
+		}
+	}
+	return false;
+}
+
+bool OcclusionBuffer::chunkVisible(const Vec3D &vmin, const Vec3D &vmax)
+{
+	if (!ready) return true;
+	chunkstested++;
+	if (visible(vmin, vmax)) return true;
+	chunksculled++;
+	return false;
+}
+
+bool OcclusionBuffer::objectVisible(const Vec3D &center, float radius)
+{
+	Vec3D r(radius, radius, radius);
+	return objectVisible(center - r, center + r);
+}
+
+bool OcclusionBuffer::objectVisible(const Vec3D &vmin, const Vec3D &vmax)
+{
+	if (!ready) return true;
+	objectstested++;
+	if (visible(vmin, vmax)) return true;
+	objectsculled++;
+	return false;
+}
@@ -0,0 +1,90 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "vec3d.h"
+#include "matrix.h"
+#include <SDL/SDL.h>
+#include <vector>
+
+/*
+	Software occlusion culling.
+
+	Every frame the terrain in view and the big outdoor WMO groups nearby are
+	rasterized into a small depth buffer on the CPU, then the bounding boxes of
+	terrain chunks, WMO groups and models are checked against it before they go
+	to the card. The buffer keeps 1/w of the nearest occluder in each pixel (0
+	where there is none); a box is hidden if every pixel it covers has an
+	occluder nearer than the box's nearest corner.
+
+	Occluders must not stick out of the real geometry: terrain is a coarse grid
+	sunk by its height error, WMO groups only give their opaque one-sided faces.
+
+	The rows are split into bands rasterized on worker threads, with SSE doing
+	4 pixels at a time where the compiler has it.
+*/
+
+const int OCCLUSION_WIDTH = 256;
+const int OCCLUSION_HEIGHT = 128;
+// occluders are clipped this close to the camera
+const float OCCLUSION_NEAR = 1.0f;
+// terrain closer than this occludes with its 5x5 grid, beyond that with the 3x3 one
+const float OCCLUSION_FINEDIST = 200.0f;
+// WMO groups smaller than this don't occlude, nor do ones with more triangles than this
+const float OCCLUSION_WMORADIUS = 20.0f;
+const size_t OCCLUSION_WMOTRIS = 4096;
+
+struct OccluderTriangle {
+	float x[3], y[3], z[3];		// pixels, and 1/w
+	int minx, maxx, miny, maxy;
+};
+
+class OcclusionBuffer;
+
+struct OcclusionWorker {
+	OcclusionBuffer *buffer;
+	int band;
+	SDL_Thread *thread;
+	SDL_sem *start;
+};
+
+class OcclusionBuffer {
+	float *depth;
+	Matrix viewproj;
+	std::vector<OccluderTriangle> tris;
+	std::vector<float> clip;
+	bool ready;
+	unsigned int starttime;
+
+	std::vector<OcclusionWorker*> workers;
+	SDL_sem *done;
+	bool quit;
+
+	static int threadFunc(void *p);
+	void rasterizeBand(int band);
+	void addClipped(const float *a, const float *b, const float *c);
+
+public:
+	bool enabled;
+
+	// this frame, time in ms
+	int occludertris;
+	int chunkstested, chunksculled, objectstested, objectsculled;
+	unsigned int time;
+
+	OcclusionBuffer(int threads);
+	~OcclusionBuffer();
+
+	// takes the current modelview and projection and clears the buffer
+	void begin();
+	// triangles in object space, transform goes to world space (0 for none)
+	void addTriangles(const Vec3D *verts, int nverts, const unsigned short *indices, int nindices, const Matrix *transform);
+	void rasterize();
+
+	bool visible(const Vec3D &vmin, const Vec3D &vmax);
+	// the same, counted in the stats
+	bool chunkVisible(const Vec3D &vmin, const Vec3D &vmax);
+	bool objectVisible(const Vec3D &center, float radius);
+	bool objectVisible(const Vec3D &vmin, const Vec3D &vmax);
+};
+
+#endif
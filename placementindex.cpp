@@ -0,0 +1,366 @@
+#include "placementindex.h"
+#include "adtcache.h"
+#include "maptile.h"
+#include "modelheaders.h"
+#include "wowmapview.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+using namespace std;
+
+struct PlacementIndexHeader {
+	char magic[4];
+	uint32 version;
+	uint32 archivekey;
+	uint32 size;
+	uint32 nNames, ofsNames, sizeNames;
+	uint32 nPlacements, ofsPlacements;
+	uint32 ofsCells;
+};
+
+string PlacementIndex::fileName(const string &basename)
+{
+	return gADTCache.dir + "/" + basename + ".wpi";
+}
+
+// how far the model reaches from its origin, from the M2 header's bounding box and sphere
+static float modelRadius(const string &name)
+{
+	// .mdx -> .m2, as the model manager does
+	string m2 = name.substr(0, name.length()-2) + "2";
+	MPQFile f(m2.c_str());
+	if (f.isEof() || f.getSize() < sizeof(ModelHeader)) return 0;
+	ModelHeader h;
+	memcpy(&h, f.getBuffer(), sizeof(ModelHeader));
+
+	float r = h.floats[6], corner = 0;
+	for (int k=0; k<3; k++) {
+		float a = fabsf(h.floats[k]), b = fabsf(h.floats[3+k]);
+		float c = a > b ? a : b;
+		corner += c*c;
+	}
+	corner = sqrtf(corner);
+	return corner > r ? corner : r;
+}
+
+static int tileOf(float v)
+{
+	int t = (int)(v / TILESIZE);
+	if (t < 0) t = 0;
+	if (t > 63) t = 63;
+	return t;
+}
+
+static bool cellOrder(const pair<int, IndexedPlacement> &a, const pair<int, IndexedPlacement> &b)
+{
+	return a.first < b.first;
+}
+
+// names from an MMDX/MWMO block
+static void readNames(MPQFile &f, size_t size, vector<string> &names)
+{
+	if (!size) return;
+	char *buf = new char[size];
+	f.read(buf, size);
+	char *p = buf;
+	while (p < buf+size) {
+		string path(p);
+		p += strlen(p)+1;
+		fixname(path);
+		names.push_back(path);
+	}
+	delete[] buf;
+}
+
+bool PlacementIndex::build(const string &basename)
+{
+	unsigned int t0 = SDL_GetTicks();
+
+	// which tiles the map has
+	char fn[256];
+	sprintf(fn,"World\\Maps\\%s\\%s.wdt", basename.c_str(), basename.c_str());
+	MPQFile wdt(fn);
+	if (wdt.isEof()) {
+		gLog("Placement index: no map %s\n", basename.c_str());
+		return false;
+	}
+	bool tiles[64][64];
+	memset(tiles, 0, sizeof(tiles));
+	char fourcc[5];
+	size_t size;
+	while (!wdt.isEof()) {
+		wdt.read(fourcc,4);
+		wdt.read(&size, 4);
+		flipcc(fourcc);
+		fourcc[4] = 0;
+		size_t nextpos = wdt.getPos() + size;
+		if (!strcmp(fourcc,"MAIN")) {
+			for (int j=0; j<64; j++) {
+				for (int i=0; i<64; i++) {
+					int d[2];
+					wdt.read(d, 8);
+					tiles[j][i] = d[0] != 0;
+				}
+			}
+		}
+		wdt.seek((int)nextpos);
+	}
+	wdt.close();
+
+	PlacementIndex index;
+	map<string, int> nameids;
+	map<int, float> radii;
+	// the same placement turns up in every ADT it reaches into
+	set< pair<int, uint32> > seen;
+	vector< pair<int, IndexedPlacement> > found;
+	int ntiles = 0, listed = 0;
+	size_t bytes = 0;
+
+	for (int j=0; j<64; j++) {
+		for (int i=0; i<64; i++) {
+			if (!tiles[j][i]) continue;
+			sprintf(fn,"World\\Maps\\%s\\%s_%d_%d.adt", basename.c_str(), basename.c_str(), i, j);
+			MPQFile f(fn);
+			if (f.isEof()) continue;
+			ntiles++;
+			bytes += f.getSize();
+
+			vector<string> models, wmos;
+			vector<ModelPlacement> mp;
+			vector<WMOPlacement> wp;
+			while (!f.isEof()) {
+				f.read(fourcc,4);
+				f.read(&size, 4);
+				flipcc(fourcc);
+				fourcc[4] = 0;
+				size_t nextpos = f.getPos() + size;
+				if (!strcmp(fourcc,"MMDX")) readNames(f, size, models);
+				else if (!strcmp(fourcc,"MWMO")) readNames(f, size, wmos);
+				else if (!strcmp(fourcc,"MDDF")) {
+					mp.resize(size / sizeof(ModelPlacement));
+					if (!mp.empty()) f.read(&mp[0], mp.size() * sizeof(ModelPlacement));
+				}
+				else if (!strcmp(fourcc,"MODF")) {
+					wp.resize(size / sizeof(WMOPlacement));
+					if (!wp.empty()) f.read(&wp[0], wp.size() * sizeof(WMOPlacement));
+				}
+				f.seek((int)nextpos);
+			}
+
+			for (size_t k=0; k<mp.size(); k++) {
+				listed++;
+				if (mp[k].nameid >= models.size() || !seen.insert(make_pair(0, mp[k].uniqueid)).second) continue;
+				const string &name = models[mp[k].nameid];
+				if (nameids.find(name) == nameids.end()) {
+					nameids[name] = (int)index.names.size();
+					index.names.push_back(name);
+				}
+				IndexedPlacement p;
+				p.uniqueid = mp[k].uniqueid;
+				p.nameid = nameids[name];
+				p.flags = 0;
+				if (radii.find(p.nameid) == radii.end()) radii[p.nameid] = modelRadius(name);
+				float r = radii[p.nameid] * mp[k].scale / 1024.0f;
+				for (int c=0; c<3; c++) {
+					p.vmin[c] = mp[k].pos[c] - r;
+					p.vmax[c] = mp[k].pos[c] + r;
+				}
+				found.push_back(make_pair(0, p));
+			}
+			for (size_t k=0; k<wp.size(); k++) {
+				listed++;
+				if (wp[k].nameid >= wmos.size() || !seen.insert(make_pair(1, wp[k].id)).second) continue;
+				const string &name = wmos[wp[k].nameid];
+				if (nameids.find(name) == nameids.end()) {
+					nameids[name] = (int)index.names.size();
+					index.names.push_back(name);
+				}
+				IndexedPlacement p;
+				p.uniqueid = wp[k].id;
+				p.nameid = nameids[name];
+				p.flags = PLACEMENT_WMO;
+				for (int c=0; c<3; c++) {
+					p.vmin[c] = wp[k].pos2[c] < wp[k].pos3[c] ? wp[k].pos2[c] : wp[k].pos3[c];
+					p.vmax[c] = wp[k].pos2[c] > wp[k].pos3[c] ? wp[k].pos2[c] : wp[k].pos3[c];
+				}
+				found.push_back(make_pair(0, p));
+			}
+		}
+	}
+
+	// sort into the tile cells by the centers
+	for (size_t k=0; k<found.size(); k++) {
+		IndexedPlacement &p = found[k].second;
+		found[k].first = tileOf((p.vmin[2] + p.vmax[2]) * 0.5f) * 64 + tileOf((p.vmin[0] + p.vmax[0]) * 0.5f);
+	}
+	stable_sort(found.begin(), found.end(), cellOrder);
+
+	PlacementCell empty;
+	memset(&empty, 0, sizeof(empty));
+	vector<PlacementCell> cells(64*64, empty);
+	vector<IndexedPlacement> placements;
+	for (size_t k=0; k<found.size(); k++) {
+		const IndexedPlacement &p = found[k].second;
+		PlacementCell &c = cells[found[k].first];
+		if (c.count == 0) {
+			c.first = (uint32)k;
+			memcpy(c.vmin, p.vmin, sizeof(c.vmin));
+			memcpy(c.vmax, p.vmax, sizeof(c.vmax));
+		}
+		for (int a=0; a<3; a++) {
+			if (p.vmin[a] < c.vmin[a]) c.vmin[a] = p.vmin[a];
+			if (p.vmax[a] > c.vmax[a]) c.vmax[a] = p.vmax[a];
+		}
+		c.count++;
+		placements.push_back(p);
+	}
+
+	// header, names, placements, cells
+	vector<char> buf(sizeof(PlacementIndexHeader));
+	PlacementIndexHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "WMVP", 4);
+	h.version = PLACEMENTINDEX_VERSION;
+	h.archivekey = gADTCache.key();
+	h.nNames = (uint32)index.names.size();
+	h.ofsNames = (uint32)buf.size();
+	for (size_t k=0; k<index.names.size(); k++) {
+		buf.insert(buf.end(), index.names[k].c_str(), index.names[k].c_str() + index.names[k].size() + 1);
+	}
+	h.sizeNames = (uint32)buf.size() - h.ofsNames;
+	while (buf.size() & 3) buf.push_back(0);
+	h.nPlacements = (uint32)placements.size();
+	h.ofsPlacements = (uint32)buf.size();
+	if (!placements.empty()) buf.insert(buf.end(), (char*)&placements[0], (char*)&placements[0] + placements.size() * sizeof(IndexedPlacement));
+	h.ofsCells = (uint32)buf.size();
+	buf.insert(buf.end(), (char*)&cells[0], (char*)&cells[0] + cells.size() * sizeof(PlacementCell));
+	h.size = (uint32)buf.size();
+	memcpy(&buf[0], &h, sizeof(h));
+
+#ifdef _WIN32
+	_mkdir(gADTCache.dir.c_str());
+#else
+	mkdir(gADTCache.dir.c_str(), 0755);
+#endif
+	string name = fileName(basename);
+	FILE *out = fopen(name.c_str(), "wb");
+	bool written = out && fwrite(&buf[0], buf.size(), 1, out) == 1;
+	if (out) written = (fclose(out) == 0) && written;
+	if (!written) {
+		gLog("Placement index: could not write %s\n", name.c_str());
+		remove(name.c_str());
+		return false;
+	}
+
+	float secs = (SDL_GetTicks() - t0) / 1000.0f;
+	if (secs <= 0) secs = 0.001f;
+	gLog("Placement index %s: %d tiles, %.1f MB scanned in %.1f s (%.1f tiles/s, %.1f MB/s)\n",
+		basename.c_str(), ntiles, bytes / (1024.0f*1024.0f), secs, ntiles / secs, bytes / (1024.0f*1024.0f) / secs);
+	gLog("Placement index %s: %d placements (%d listed in the ADTs), %d names, %.1f KB written to %s\n",
+		basename.c_str(), (int)placements.size(), listed, (int)index.names.size(), buf.size() / 1024.0f, name.c_str());
+	return true;
+}
+
+bool PlacementIndex::load(const string &basename)
+{
+	placements.clear();
+	cells.clear();
+	names.clear();
+
+	string name = fileName(basename);
+	MappedFile mf(name.c_str());
+	const PlacementIndexHeader *h = (const PlacementIndexHeader*)mf.data;
+	if (!mf.data || mf.size < sizeof(PlacementIndexHeader) || memcmp(h->magic, "WMVP", 4)
+		|| h->version != PLACEMENTINDEX_VERSION || h->archivekey != gADTCache.key() || h->size != mf.size
+		|| !mf.holds(h->ofsNames, h->sizeNames, 1)
+		|| !mf.holds(h->ofsPlacements, h->nPlacements, sizeof(IndexedPlacement))
+		|| !mf.holds(h->ofsCells, 64*64, sizeof(PlacementCell))) {
+		return false;
+	}
+
+	const char *p = mf.data + h->ofsNames, *pend = p + h->sizeNames;
+	for (uint32 i=0; i<h->nNames; i++) {
+		if (p >= pend || !memchr(p, 0, pend-p)) {
+			names.clear();
+			return false;
+		}
+		names.push_back(p);
+		p += strlen(p)+1;
+	}
+	// the queries go from the cells to the placements and from those to the names
+	const IndexedPlacement *ip = (const IndexedPlacement*)(mf.data + h->ofsPlacements);
+	const PlacementCell *pc = (const PlacementCell*)(mf.data + h->ofsCells);
+	bool valid = true;
+	for (uint32 k=0; k<h->nPlacements; k++) valid = valid && ip[k].nameid < h->nNames;
+	for (int k=0; k<64*64; k++) valid = valid && pc[k].first <= h->nPlacements && pc[k].count <= h->nPlacements - pc[k].first;
+	if (!valid) {
+		gLog("Placement index %s is damaged\n", name.c_str());
+		names.clear();
+		return false;
+	}
+	placements.assign(ip, ip + h->nPlacements);
+	cells.assign(pc, pc + 64*64);
+
+	// the furthest any placement reaches out of its cell, for the queries
+	reach = 0;
+	for (size_t k=0; k<placements.size(); k++) {
+		for (int a=0; a<3; a++) {
+			float r = placements[k].vmax[a] - placements[k].vmin[a];
+			if (r > reach) reach = r;
+		}
+	}
+
+	gLog("Placement index %s: %d placements\n", basename.c_str(), (int)placements.size());
+	return true;
+}
+
+int PlacementIndex::count(int x0, int z0, int x1, int z1) const
+{
+	if (cells.empty()) return 0;
+	if (x0 < 0) x0 = 0;
+	if (z0 < 0) z0 = 0;
+	if (x1 > 63) x1 = 63;
+	if (z1 > 63) z1 = 63;
+	int n = 0;
+	for (int j=z0; j<=z1; j++) {
+		for (int i=x0; i<=x1; i++) n += cells[j*64+i].count;
+	}
+	return n;
+}
+
+void PlacementIndex::query(const Vec3D &vmin, const Vec3D &vmax, vector<const IndexedPlacement*> &out) const
+{
+	if (cells.empty()) return;
+	int x0 = tileOf(vmin.x - reach), x1 = tileOf(vmax.x + reach);
+	int z0 = tileOf(vmin.z - reach), z1 = tileOf(vmax.z + reach);
+	float lo[3] = {vmin.x, vmin.y, vmin.z}, hi[3] = {vmax.x, vmax.y, vmax.z};
+	for (int j=z0; j<=z1; j++) {
+		for (int i=x0; i<=x1; i++) {
+			const PlacementCell &c = cells[j*64+i];
+			if (!c.count) continue;
+			bool overlap = true;
+			for (int a=0; a<3; a++) {
+				if (c.vmin[a] > hi[a] || c.vmax[a] < lo[a]) overlap = false;
+			}
+			if (!overlap) continue;
+			for (uint32 k=c.first; k<c.first+c.count; k++) {
+				const IndexedPlacement &p = placements[k];
+				bool in = true;
+				for (int a=0; a<3; a++) {
+					if (p.vmin[a] > hi[a] || p.vmax[a] < lo[a]) in = false;
+				}
+				if (in) out.push_back(&p);
+			}
+		}
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef PLACEMENTINDEX_H
+#define PLACEMENTINDEX_H
+
+#include "vec3d.h"
+#include "modelheaders.h"
+#include <string>
+#include <vector>
+
+/*
+	Map-wide index of model and WMO placements.
+
+	Built once per map by a headless scan of every ADT (wowmapview -index <map>)
+	and stored next to the tile cache, stamped with the same archive key. Each
+	placement keeps its unique id, its model or WMO name and a world space box:
+	the MODF extents for WMOs, the M2 header radius times the scale for models.
+	Placements listed in several ADTs are stored once.
+
+	The placements are sorted into the 64x64 tile cells by the center of their
+	box, so the world can see what's in a tile before the tile is loaded: the
+	prefetcher loads the models and WMOs of the tiles on the camera's way with
+	it (World::updatePreloads).
+*/
+
+const int PLACEMENTINDEX_VERSION = 1;
+
+enum PlacementFlags {
+	PLACEMENT_WMO = 1
+};
+
+struct IndexedPlacement {
+	uint32 uniqueid;
+	uint32 nameid;		// into the index's name list
+	uint32 flags;
+	float vmin[3], vmax[3];
+};
+
+struct PlacementCell {
+	uint32 first, count;
+	float vmin[3], vmax[3];		// of all the placements in the cell
+};
+
+class PlacementIndex {
+	std::vector<IndexedPlacement> placements;
+	std::vector<PlacementCell> cells;		// 64*64 when loaded
+	float reach;
+
+	static std::string fileName(const std::string &basename);
+
+public:
+	std::vector<std::string> names;
+
+	PlacementIndex(): reach(0) {}
+
+	bool loaded() const { return !cells.empty(); }
+	int size() const { return (int)placements.size(); }
+
+	// scans all ADTs of the map and writes the index, logging the throughput
+	static bool build(const std::string &basename);
+	bool load(const std::string &basename);
+
+	// placements in tile cells x0..x1, z0..z1
+	int count(int x0, int z0, int x1, int z1) const;
+	// placements whose box overlaps the given one
+	void query(const Vec3D &vmin, const Vec3D &vmax, std::vector<const IndexedPlacement*> &out) const;
+};
+
+#endif
@@ -0,0 +1,318 @@
+#include "renderqueue.h"
+#include "model.h"
+#include "world.h"
+#include "maptile.h"
+
+#include <algorithm>
+
+using namespace std;
+
+RenderQueue::RenderQueue(): enabled(true)
+{
+	itemsdrawn = statechanges = texturechanges = bufferchanges = matrixchanges = avoided = 0;
+	transparentdrawn = 0;
+}
+
+void RenderQueue::add(Model *m, int pass, const Matrix *mat, float depth)
+{
+	const ModelRenderPass &p = m->passes[pass];
+	RenderItem it;
+	it.state = 0;
+	if (p.blendmode == BM_TRANSPARENT) it.state |= RQ_ALPHATEST;
+	if (!p.cull) it.state |= RQ_NOCULL;
+	if (p.unlit) it.state |= RQ_UNLIT;
+	if (p.useenvmap) it.state |= RQ_ENVMAP;
+	if (m->animated) it.state |= RQ_ANIMATED;
+	it.texture = p.texture;
+	it.buffer = m->animated ? m->vbuf : m->plists;
+	it.depth = depth;
+	it.model = m;
+	it.pass = pass;
+	it.mat = mat;
+	items.push_back(it);
+}
+
+void RenderQueue::addItem(TransparentItem &it, float depth)
+{
+	// positive floats sort like their bits; flipped, the furthest comes first
+	union {
+		float f;
+		unsigned int u;
+	} d;
+	d.f = depth > 0 ? depth : 0;
+	it.key = ~d.u;
+	transparent.push_back(it);
+}
+
+void RenderQueue::addTransparent(Model *m, int pass, const Matrix *mat, float depth)
+{
+	TransparentItem it;
+	it.kind = RQ_PASS;
+	it.model = m;
+	it.pass = pass;
+	it.mat = mat;
+	it.instance = 0;
+	it.chunk = 0;
+	addItem(it, depth);
+}
+
+void RenderQueue::addEffects(Model *m, const Matrix *mat, float depth)
+{
+	TransparentItem it;
+	it.kind = RQ_EFFECTS;
+	it.model = m;
+	it.pass = 0;
+	it.mat = mat;
+	it.instance = 0;
+	it.chunk = 0;
+	addItem(it, depth);
+}
+
+void RenderQueue::addInstance(ModelInstance *mi, float depth)
+{
+	TransparentItem it;
+	it.kind = RQ_INSTANCE;
+	it.model = 0;
+	it.pass = 0;
+	it.mat = 0;
+	it.instance = mi;
+	it.chunk = 0;
+	addItem(it, depth);
+}
+
+void RenderQueue::addWater(MapChunk *c, float depth)
+{
+	TransparentItem it;
+	it.kind = RQ_WATER;
+	it.model = 0;
+	it.pass = 0;
+	it.mat = 0;
+	it.instance = 0;
+	it.chunk = c;
+	addItem(it, depth);
+}
+
+// stable LSD radix sort on the keys, a byte at a time; passes where every key has
+// the same byte are skipped
+static void radixSort(vector<TransparentItem> &items, vector<TransparentItem> &tmp)
+{
+	size_t n = items.size();
+	tmp.resize(n);
+	for (int shift=0; shift<32; shift+=8) {
+		size_t count[257];
+		for (int b=0; b<257; b++) count[b] = 0;
+		for (size_t i=0; i<n; i++) count[((items[i].key >> shift) & 0xff) + 1]++;
+		if (count[((items[0].key >> shift) & 0xff) + 1] == n) continue;
+		for (int b=0; b<256; b++) count[b+1] += count[b];
+		for (size_t i=0; i<n; i++) tmp[count[(items[i].key >> shift) & 0xff]++] = items[i];
+		items.swap(tmp);
+	}
+}
+
+// whether one of the state bits has to be set, because it differs from the current state or nothing is set yet
+static bool changeState(unsigned int bit, unsigned int state, unsigned int current, bool first)
+{
+	return first || ((state ^ current) & bit);
+}
+
+void RenderQueue::drawOpaque(const Matrix &view)
+{
+	if (items.empty()) return;
+	sort(items.begin(), items.end());
+
+	// the same for everything in the queue
+	glstate.disable(GL_BLEND);
+	glstate.depthMask(GL_TRUE);
+	glstate.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glAlphaFunc(GL_GREATER, 0.3f);
+	glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_SPHERE_MAP);
+	glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_SPHERE_MAP);
+
+	unsigned int state = 0;
+	GLuint texture = 0, buffer = 0;
+	const Matrix *mat = 0;
+	for (size_t i=0; i<items.size(); i++) {
+		const RenderItem &it = items[i];
+		Model *m = it.model;
+		ModelRenderPass &p = m->passes[it.pass];
+		bool first = i == 0;
+
+		// each of these used to be set by every pass
+		if (changeState(RQ_ALPHATEST, it.state, state, first)) {
+			if (it.state & RQ_ALPHATEST) glstate.enable(GL_ALPHA_TEST);
+			else glstate.disable(GL_ALPHA_TEST);
+			statechanges++;
+		} else avoided++;
+		if (changeState(RQ_NOCULL, it.state, state, first)) {
+			if (it.state & RQ_NOCULL) glstate.disable(GL_CULL_FACE);
+			else glstate.enable(GL_CULL_FACE);
+			statechanges++;
+		} else avoided++;
+		if (changeState(RQ_UNLIT, it.state, state, first)) {
+			if (it.state & RQ_UNLIT) {
+				glstate.disable(GL_LIGHTING);
+				glstate.disable(GL_FOG);
+			} else {
+				glstate.enable(GL_LIGHTING);
+				if (gWorld->drawfog) glstate.enable(GL_FOG);
+			}
+			statechanges++;
+		} else avoided++;
+		if (changeState(RQ_ENVMAP, it.state, state, first)) {
+			if (it.state & RQ_ENVMAP) {
+				glstate.enable(GL_TEXTURE_GEN_S);
+				glstate.enable(GL_TEXTURE_GEN_T);
+			} else {
+				glstate.disable(GL_TEXTURE_GEN_S);
+				glstate.disable(GL_TEXTURE_GEN_T);
+			}
+			statechanges++;
+		} else avoided++;
+		state = it.state;
+
+		if (first || it.texture != texture) {
+			glstate.bindTexture(it.texture);
+			texture = it.texture;
+			texturechanges++;
+		} else avoided++;
+
+		if (m->animated) {
+			if (it.buffer != buffer) {
+				m->bindBuffers();
+				buffer = it.buffer;
+				bufferchanges++;
+			} else avoided++;
+		}
+
+		if (it.mat != mat) {
+			Matrix t = view * *it.mat;
+			t.transpose();
+			glLoadMatrixf(t);
+			mat = it.mat;
+			matrixchanges++;
+		} else avoided++;
+
+		if (m->animated) {
+			if (p.setColor(m)) m->drawPass(p);
+		} else {
+			glCallList(m->plists + (GLuint)it.pass);
+		}
+	}
+
+	// back to what the passes leave behind
+	if (state & RQ_UNLIT) {
+		glstate.enable(GL_LIGHTING);
+		if (gWorld->drawfog) glstate.enable(GL_FOG);
+	}
+	if (state & RQ_ENVMAP) {
+		glstate.disable(GL_TEXTURE_GEN_S);
+		glstate.disable(GL_TEXTURE_GEN_T);
+	}
+	glAlphaFunc(GL_GREATER, 0.0f);
+	glstate.disable(GL_ALPHA_TEST);
+	GLfloat czero[4] = {0,0,0,1};
+	glMaterialfv(GL_FRONT, GL_EMISSION, czero);
+	glColor4f(1,1,1,1);
+
+	items.clear();
+}
+
+void RenderQueue::drawTransparent(const Matrix &view)
+{
+	if (transparent.empty()) return;
+	radixSort(transparent, sorted);
+
+	glstate.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glAlphaFunc(GL_GREATER, 0.3f);
+
+	GLuint buffer = 0;
+	const Matrix *mat = 0;
+	for (size_t i=0; i<transparent.size(); i++) {
+		const TransparentItem &it = transparent[i];
+
+		// model passes and effects are in model space, the rest goes on top of the camera
+		const Matrix *want = (it.kind == RQ_PASS || it.kind == RQ_EFFECTS) ? it.mat : 0;
+		if (i == 0 || want != mat) {
+			Matrix t = want ? view * *want : view;
+			t.transpose();
+			glLoadMatrixf(t);
+			mat = want;
+			matrixchanges++;
+		} else avoided++;
+
+		switch (it.kind) {
+		case RQ_PASS:
+			{
+				Model *m = it.model;
+				ModelRenderPass &p = m->passes[it.pass];
+				if (m->animated) {
+					if (m->vbuf != buffer) {
+						m->bindBuffers();
+						buffer = m->vbuf;
+						bufferchanges++;
+					} else avoided++;
+					if (p.init(m)) m->drawPass(p);
+				} else {
+					p.setup(m);
+					glCallList(m->plists + (GLuint)it.pass);
+					glstate.forget(GL_BLEND);
+				}
+				p.deinit();
+			}
+			break;
+		case RQ_EFFECTS:
+			it.model->drawEffects();
+			break;
+		case RQ_INSTANCE:
+			it.instance->drawUnqueued();
+			break;
+		case RQ_WATER:
+			// a model pass before it may have left the alpha test on, which would clip thin water
+			glstate.disable(GL_ALPHA_TEST);
+			glAlphaFunc(GL_GREATER, 0.0f);
+			it.chunk->drawWater();
+			break;
+		}
+
+		if (it.kind != RQ_PASS) {
+			// these set their state directly
+			glstate.invalidate();
+			glstate.activeTexture(GL_TEXTURE0_ARB);
+			glstate.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glAlphaFunc(GL_GREATER, 0.3f);
+			buffer = 0;
+		}
+	}
+	transparent.clear();
+
+	// what Model::drawModel leaves behind
+	glAlphaFunc(GL_GREATER, 0.0f);
+	glstate.disable(GL_ALPHA_TEST);
+	GLfloat czero[4] = {0,0,0,1};
+	glMaterialfv(GL_FRONT, GL_EMISSION, czero);
+	glColor4f(1,1,1,1);
+	glstate.depthMask(GL_TRUE);
+}
+
+void RenderQueue::flush()
+{
+	itemsdrawn = (int)items.size();
+	transparentdrawn = (int)transparent.size();
+	statechanges = texturechanges = bufferchanges = matrixchanges = avoided = 0;
+	if (items.empty() && transparent.empty()) return;
+
+	// what came before didn't go through the state cache
+	glstate.invalidate();
+	glstate.activeTexture(GL_TEXTURE0_ARB);
+
+	// the items' transforms go on top of the camera's
+	Matrix view;
+	glGetFloatv(GL_MODELVIEW_MATRIX, view);
+	view.transpose();
+	glPushMatrix();
+
+	drawOpaque(view);
+	drawTransparent(view);
+
+	glPopMatrix();
+}
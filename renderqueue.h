@@ -0,0 +1,103 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include "video.h"
+#include "matrix.h"
+#include <vector>
+
+class Model;
+class ModelInstance;
+class MapChunk;
+
+/*
+	Opaque model passes, sorted by state before they are drawn, and everything
+	see-through, sorted back to front.
+
+	Drawing the doodads one by one switches blending, culling, lighting and
+	textures for every pass of every instance, in whatever order the instances
+	come in. Instead their opaque passes are queued with a key of (state,
+	texture, buffer, depth) and drawn in key order once all of them are in,
+	setting only what differs from the item before.
+
+	The rest (blended passes, texture animation, particles, transparent terrain
+	water, and models with their own lights or per instance animation, which
+	go whole) is drawn after that in one list, furthest first. The list is
+	radix sorted on the distance, which keeps the order things were added in
+	for equal keys, so the passes of one instance stay in their own order.
+*/
+
+// state bits of the keys
+const unsigned int RQ_ALPHATEST = 1;
+const unsigned int RQ_NOCULL = 2;
+const unsigned int RQ_UNLIT = 4;
+const unsigned int RQ_ENVMAP = 8;
+const unsigned int RQ_ANIMATED = 16;	// vertex buffers rather than display lists
+
+// what a transparent item draws
+enum TransparentKind {
+	RQ_PASS,		// one pass of a model
+	RQ_EFFECTS,		// a model's particles and ribbons
+	RQ_INSTANCE,	// a model instance, all of it
+	RQ_WATER		// a terrain chunk's water
+};
+
+struct TransparentItem {
+	unsigned int key;	// back to front
+	int kind;
+
+	Model *model;
+	int pass;
+	const Matrix *mat;
+	ModelInstance *instance;
+	MapChunk *chunk;
+};
+
+struct RenderItem {
+	unsigned int state;
+	GLuint texture;
+	GLuint buffer;		// display lists of static models, vertex buffer of animated ones
+	float depth;
+
+	Model *model;
+	int pass;
+	const Matrix *mat;
+
+	bool operator< (const RenderItem &r) const
+	{
+		if (state != r.state) return state < r.state;
+		if (texture != r.texture) return texture < r.texture;
+		if (buffer != r.buffer) return buffer < r.buffer;
+		return depth < r.depth;
+	}
+};
+
+class RenderQueue {
+	std::vector<RenderItem> items;
+	std::vector<TransparentItem> transparent, sorted;
+
+	void addItem(TransparentItem &it, float depth);
+	void drawOpaque(const Matrix &view);
+	void drawTransparent(const Matrix &view);
+
+public:
+	bool enabled;
+
+	// last flush: items drawn, changes made by kind, and ones that were skipped
+	// because the item before had already set the same thing
+	int itemsdrawn;
+	int statechanges, texturechanges, bufferchanges, matrixchanges;
+	int avoided;
+	// transparent items drawn back to front
+	int transparentdrawn;
+
+	RenderQueue();
+
+	void add(Model *m, int pass, const Matrix *mat, float depth);
+	void addTransparent(Model *m, int pass, const Matrix *mat, float depth);
+	void addEffects(Model *m, const Matrix *mat, float depth);
+	void addInstance(ModelInstance *mi, float depth);
+	void addWater(MapChunk *c, float depth);
+	void flush();
+};
+
+#endif
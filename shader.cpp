@@ -0,0 +1,82 @@
+#include "shader.h"
+#include "wowmapview.h"
+
+static void logInfo(GLhandleARB obj)
+{
+	char log[1024];
+	GLsizei len = 0;
+	glGetInfoLogARB(obj, sizeof(log), &len, log);
+	if (len > 0) gLog("%s\n", log);
+}
+
+Shader::Shader(const char *vertexsrc, const char *fragmentsrc): program(0), ok(false)
+{
+	if (!glCreateShaderObjectARB || !glUseProgramObjectARB) {
+		gLog("No GLSL support\n");
+		return;
+	}
+
+	GLhandleARB vs = compile(GL_VERTEX_SHADER_ARB, vertexsrc);
+	GLhandleARB fs = compile(GL_FRAGMENT_SHADER_ARB, fragmentsrc);
+	if (!vs || !fs) {
+		if (vs) glDeleteObjectARB(vs);
+		if (fs) glDeleteObjectARB(fs);
+		return;
+	}
+
+	program = glCreateProgramObjectARB();
+	glAttachObjectARB(program, vs);
+	glAttachObjectARB(program, fs);
+	glLinkProgramARB(program);
+	// the program keeps them alive
+	glDeleteObjectARB(vs);
+	glDeleteObjectARB(fs);
+
+	GLint linked = 0;
+	glGetObjectParameterivARB(program, GL_OBJECT_LINK_STATUS_ARB, &linked);
+	if (!linked) {
+		gLog("Error linking shader program:\n");
+		logInfo(program);
+		glDeleteObjectARB(program);
+		program = 0;
+		return;
+	}
+	ok = true;
+}
+
+Shader::~Shader()
+{
+	if (program) glDeleteObjectARB(program);
+}
+
+GLhandleARB Shader::compile(GLenum type, const char *src)
+{
+	GLhandleARB sh = glCreateShaderObjectARB(type);
+	glShaderSourceARB(sh, 1, &src, 0);
+	glCompileShaderARB(sh);
+
+	GLint compiled = 0;
+	glGetObjectParameterivARB(sh, GL_OBJECT_COMPILE_STATUS_ARB, &compiled);
+	if (!compiled) {
+		gLog("Error compiling %s shader:\n", type == GL_VERTEX_SHADER_ARB ? "vertex" : "fragment");
+		logInfo(sh);
+		glDeleteObjectARB(sh);
+		return 0;
+	}
+	return sh;
+}
+
+void Shader::use()
+{
+	glUseProgramObjectARB(program);
+}
+
+void Shader::unuse()
+{
+	glUseProgramObjectARB(0);
+}
+
+GLint Shader::uniform(const char *name)
+{
+	return glGetUniformLocationARB(program, name);
+}
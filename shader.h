@@ -0,0 +1,24 @@
+#ifndef SHADER_H
+#define SHADER_H
+
+#include "video.h"
+
+// GLSL program from a vertex and a fragment shader; ok is false if the driver
+// can't do GLSL or the shaders don't compile, the caller then falls back to fixed function
+class Shader {
+	GLhandleARB program;
+
+	GLhandleARB compile(GLenum type, const char *src);
+
+public:
+	bool ok;
+
+	Shader(const char *vertexsrc, const char *fragmentsrc);
+	~Shader();
+
+	void use();
+	static void unuse();
+	GLint uniform(const char *name);
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "skyline.h"
+
+#include <SDL/SDL.h>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// columns per unit of pseudo-angle, a full turn is 4
+const float skylinescale = SKYLINE_COLUMNS / 4.0f;
+
+// cheaper than atan2 and just as good for telling directions apart:
+// goes from 0 to 4 counterclockwise around the circle, starting at +x
+static float pseudoAngle(float x, float z)
+{
+	float a = x / (fabsf(x) + fabsf(z));
+	return z >= 0 ? 1.0f - a : 3.0f + a;
+}
+
+static bool nearerGround(const SkylineGround &a, const SkylineGround &b)
+{
+	return a.dmax < b.dmax;
+}
+
+Skyline::Skyline(): ready(false), starttime(0), enabled(true)
+{
+	groundboxes = chunkstested = chunksculled = objectstested = objectsculled = 0;
+	time = 0;
+}
+
+bool Skyline::span(float x0, float z0, float x1, float z1, float &dmin, float &dmax, float &a0, float &a1)
+{
+	// horizontal distances to a rectangle and the directions it covers; false if the camera is above it
+	float dx0 = x0 - camera.x, dx1 = x1 - camera.x;
+	float dz0 = z0 - camera.z, dz1 = z1 - camera.z;
+	if (dx0 <= 0 && dx1 >= 0 && dz0 <= 0 && dz1 >= 0) return false;
+
+	float nx = dx0 > 0 ? dx0 : (dx1 < 0 ? -dx1 : 0);
+	float nz = dz0 > 0 ? dz0 : (dz1 < 0 ? -dz1 : 0);
+	float fx = fabsf(dx0) > fabsf(dx1) ? fabsf(dx0) : fabsf(dx1);
+	float fz = fabsf(dz0) > fabsf(dz1) ? fabsf(dz0) : fabsf(dz1);
+	dmin = sqrtf(nx*nx + nz*nz);
+	dmax = sqrtf(fx*fx + fz*fz);
+
+	// the camera is outside, so the corners lie within half a turn of the first one
+	float first = pseudoAngle(dx0, dz0);
+	float cx[3] = {dx1, dx0, dx1}, cz[3] = {dz0, dz1, dz1};
+	float lo = 0, hi = 0;
+	for (int i=0; i<3; i++) {
+		float d = pseudoAngle(cx[i], cz[i]) - first;
+		if (d > 2.0f) d -= 4.0f;
+		else if (d < -2.0f) d += 4.0f;
+		if (d < lo) lo = d;
+		if (d > hi) hi = d;
+	}
+	a0 = first + lo;
+	a1 = first + hi;
+	return true;
+}
+
+void Skyline::begin(const Vec3D &camera)
+{
+	this->camera = camera;
+	starttime = SDL_GetTicks();
+	ready = false;
+	ground.clear();
+	for (int c=0; c<SKYLINE_COLUMNS; c++) columns[c].clear();
+	groundboxes = chunkstested = chunksculled = objectstested = objectsculled = 0;
+	time = 0;
+}
+
+void Skyline::addGround(float x0, float z0, float x1, float z1, float height)
+{
+	float dmin, dmax, a0, a1;
+	if (!span(x0, z0, x1, z1, dmin, dmax, a0, a1)) return;
+
+	// any line of sight through the rectangle is blocked below the flattest slope to it
+	SkylineGround g;
+	float h = height - camera.y;
+	g.dmax = dmax;
+	g.slope = h / (h >= 0 ? dmax : dmin);
+	g.c0 = (int)ceilf(a0 * skylinescale);
+	g.c1 = (int)floorf(a1 * skylinescale);
+	if (g.c1 > g.c0) ground.push_back(g);
+}
+
+void Skyline::build()
+{
+	// front to back, so each column only gets a new step where the ground gets steeper
+	sort(ground.begin(), ground.end(), nearerGround);
+	for (vector<SkylineGround>::iterator it = ground.begin(); it != ground.end(); ++it) {
+		for (int c=it->c0; c<it->c1; c++) {
+			vector<SkylineStep> &col = columns[c & (SKYLINE_COLUMNS-1)];
+			if (col.empty() || it->slope > col.back().slope) {
+				SkylineStep s;
+				s.dist = it->dmax;
+				s.slope = it->slope;
+				col.push_back(s);
+			}
+		}
+	}
+	groundboxes = (int)ground.size();
+	ready = true;
+	time = SDL_GetTicks() - starttime;
+}
+
+bool Skyline::visible(const Vec3D &vmin, const Vec3D &vmax)
+{
+	if (!ready) return true;
+
+	float dmin, dmax, a0, a1;
+	if (!span(vmin.x, vmin.z, vmax.x, vmax.z, dmin, dmax, a0, a1)) return true;
+
+	// the steepest slope up to the top of the box
+	float h = vmax.y - camera.y;
+	float slope = h / (h >= 0 ? dmin : dmax);
+
+	int c0 = (int)floorf(a0 * skylinescale), c1 = (int)floorf(a1 * skylinescale);
+	for (int c=c0; c<=c1; c++) {
+		const vector<SkylineStep> &col = columns[c & (SKYLINE_COLUMNS-1)];
+		// the last step made entirely by ground in front of the box
+		int lo = 0, hi = (int)col.size();
+		while (lo < hi) {
+			int m = (lo + hi) / 2;
+			if (col[m].dist <= dmin) lo = m + 1;
+			else hi = m;
+		}
+		if (lo == 0 || col[lo-1].slope <= slope) return true;
+	}
+	return false;
+}
+
+bool Skyline::chunkVisible(const Vec3D &vmin, const Vec3D &vmax)
+{
+	if (!ready) return true;
+	chunkstested++;
+	if (visible(vmin, vmax)) return true;
+	chunksculled++;
+	return false;
+}
+
+bool Skyline::objectVisible(const Vec3D &center, float radius)
+{
+	Vec3D r(radius, radius, radius);
+	return objectVisible(center - r, center + r);
+}
+
+bool Skyline::objectVisible(const Vec3D &vmin, const Vec3D &vmax)
+{
+	if (!ready) return true;
+	objectstested++;
+	if (visible(vmin, vmax)) return true;
+	objectsculled++;
+	return false;
+}
@@ -0,0 +1,66 @@
+#ifndef SKYLINE_H
+#define SKYLINE_H
+
+#include "vec3d.h"
+#include <vector>
+
+/*
+	Terrain horizon culling.
+
+	Seen from the camera the terrain makes a skyline: in every direction around
+	it (a column, by azimuth) there is a steepest slope up to the ground. Anything
+	whose top stays below that slope, and is further away than the ground making
+	it, can't be seen. Unlike the occlusion buffer this doesn't care which way the
+	camera looks, and it is cheap enough to build from the whole window.
+
+	Each column keeps a staircase of (distance, slope) steps with the slope rising
+	with distance, so things are only tested against the ground in front of them.
+	The ground is taken as flat boxes at the lowest of the chunks' sunk occluder
+	heights (MapChunk::occheights), which stay under the real terrain.
+*/
+
+const int SKYLINE_COLUMNS = 512;	// must be a power of two
+// chunks closer than this give 2x2 boxes of ground, the rest one each
+const float SKYLINE_FINEDIST = 300.0f;
+
+struct SkylineStep {
+	float dist, slope;
+};
+
+struct SkylineGround {
+	float dmax, slope;
+	int c0, c1;		// columns it covers completely, c1 excluded
+};
+
+class Skyline {
+	std::vector<SkylineStep> columns[SKYLINE_COLUMNS];
+	std::vector<SkylineGround> ground;
+	Vec3D camera;
+	bool ready;
+	unsigned int starttime;
+
+	bool span(float x0, float z0, float x1, float z1, float &dmin, float &dmax, float &a0, float &a1);
+
+public:
+	bool enabled;
+
+	// this frame, time in ms
+	int groundboxes;
+	int chunkstested, chunksculled, objectstested, objectsculled;
+	unsigned int time;
+
+	Skyline();
+
+	void begin(const Vec3D &camera);
+	// ground at least this high all over the rectangle
+	void addGround(float x0, float z0, float x1, float z1, float height);
+	void build();
+
+	bool visible(const Vec3D &vmin, const Vec3D &vmax);
+	// the same, counted in the stats
+	bool chunkVisible(const Vec3D &vmin, const Vec3D &vmax);
+	bool objectVisible(const Vec3D &center, float radius);
+	bool objectVisible(const Vec3D &vmin, const Vec3D &vmax);
+};
+
+#endif
@@ -23,6 +23,8 @@ Test::Test(World *w, float ah0, float av0): world(w), ah(ah0), av(av0)
 
 	movespd = SPEED;
 
+	recording = playing = false;
+
 	look = false;
 	mapmode = false;
 	hud = true;
@@ -52,19 +54,58 @@ Test::~Test()
 
 void Test::tick(float t, float dt)
 {
+	Vec3D oldcam = world->camera;
+
+	if (playing) {
+		pathtime += dt;
+		pathframes++;
+		pathtiles += world->tilesVisible();
+		if (dt > pathmaxdt) pathmaxdt = dt;
+		OcclusionBuffer *ob = world->occlusion;
+		pathchunks += ob->chunkstested;
+		pathchunksculled += ob->chunksculled;
+		pathobjects += ob->objectstested;
+		pathobjectsculled += ob->objectsculled;
+		pathocctime += ob->time;
+		while (pathpos+1 < campath.size() && campath[pathpos+1].t <= pathtime) pathpos++;
+		if (pathpos+1 >= campath.size()) {
+			stopPlayback();
+		} else {
+			CameraKey &k0 = campath[pathpos], &k1 = campath[pathpos+1];
+			float r = (pathtime - k0.t) / (k1.t - k0.t);
+			world->camera = k0.pos * (1.0f-r) + k1.pos * r;
+			ah = k0.ah * (1.0f-r) + k1.ah * r;
+			av = k0.av * (1.0f-r) + k1.av * r;
+		}
+	}
+
 	Vec3D dir(1,0,0);
 	rotate(0,0, &dir.x,&dir.y, av*PI/180.0f);
     rotate(0,0, &dir.x,&dir.z, ah*PI/180.0f);
 
-	if (moving != 0) world->camera += dir * dt * movespd * moving;
-	if (strafing != 0) {
-		Vec3D right = dir % Vec3D(0,1,0);
-		right.normalize();
-		world->camera += right * dt * movespd * strafing;
+	if (!playing) {
+		if (moving != 0) world->camera += dir * dt * movespd * moving;
+		if (strafing != 0) {
+			Vec3D right = dir % Vec3D(0,1,0);
+			right.normalize();
+			world->camera += right * dt * movespd * strafing;
+		}
+		if (updown != 0) world->camera += Vec3D(0, dt * movespd * updown, 0);
 	}
-	if (updown != 0) world->camera += Vec3D(0, dt * movespd * updown, 0);
 	world->lookat = world->camera + dir;
 
+	// the tile prefetcher extrapolates from this
+	if (dt > 0) world->velocity = (world->camera - oldcam) * (1.0f / dt);
+
+	if (recording) {
+		CameraKey k;
+		k.t = campath.empty() ? 0 : campath.back().t + dt;
+		k.pos = world->camera;
+		k.ah = ah;
+		k.av = av;
+		campath.push_back(k);
+	}
+
 	world->time += (world->modelmanager.v * /*360.0f*/ 90.0f * dt);
 	world->animtime += dt * 1000.0f;
 	globalTime = (int)world->animtime;
@@ -164,6 +205,46 @@ void Test::display(float t, float dt)
 			//f16->print(5, 60, "%02d:%02d", hh,mm);
 			f16->print(video.xres - 50, 0, "%02d:%02d", hh,mm);
 
+			if (world->horizon && world->drawhorizon) {
+				f16->print(5, video.yres-102, "Horizon: %d nodes, %d tris", world->horizon->nodesdrawn, world->horizon->trisdrawn);
+			}
+			f16->print(5, video.yres-182, "WMO: %d of %d groups drawn%s", world->wmogroupsdrawn, world->wmogroups,
+				world->portalculling ? "" : ", portals off");
+			f16->print(5, video.yres-202, "Models: %d drawn, culled by %s", world->modelsdrawn,
+				world->modelboxes ? "boxes" : "spheres");
+			if (world->renderqueue->enabled) {
+				RenderQueue *rq = world->renderqueue;
+				f16->print(5, video.yres-222, "Queue: %d passes, %d transparent, changes %d state %d texture %d buffer %d matrix, %d avoided",
+					rq->itemsdrawn, rq->transparentdrawn, rq->statechanges, rq->texturechanges, rq->bufferchanges, rq->matrixchanges, rq->avoided);
+			}
+			f16->print(5, video.yres-242, "GL state: %d calls, %d sent%s", glstate.calls, glstate.sent,
+				glstate.filter ? "" : ", filter off");
+			if (glstate.check) {
+				f16->print(5, video.yres-262, "GL state check: %d mismatches", glstate.mismatches);
+			}
+			if (world->skyline->enabled) {
+				Skyline *sl = world->skyline;
+				f16->print(5, video.yres-162, "Skyline: %d of %d chunks, %d of %d objects culled by %d boxes",
+					sl->chunksculled, sl->chunkstested, sl->objectsculled, sl->objectstested, sl->groundboxes);
+			}
+			if (world->occlusion->enabled) {
+				OcclusionBuffer *ob = world->occlusion;
+				f16->print(5, video.yres-142, "Occlusion: %d of %d chunks, %d of %d objects culled by %d tris",
+					ob->chunksculled, ob->chunkstested, ob->objectsculled, ob->objectstested, ob->occludertris);
+			}
+			f16->print(5, video.yres-122, "Terrain: %d draw calls for %d chunk passes, %dk of %dk tris at %.1f px",
+				world->terraincalls, world->terrainpasses, world->terraintris / 1000, world->terrainfulltris / 1000, world->lodpixels);
+			f16->print(5, video.yres-82, "Window: radius %d %s, %d tiles, %d visible, %d placements indexed", world->tileradius,
+				world->circularwindow ? "circular" : "square", world->tilesInWindow(), world->tilesVisible(),
+				world->placements.count(world->cx - world->tileradius, world->cz - world->tileradius,
+					world->cx + world->tileradius, world->cz + world->tileradius));
+			f16->print(5, video.yres-62, "Tiles: %d cached, %.1f/%.0f MB", world->tilesCached(),
+				world->tilecachebytes / (1024.0f*1024.0f), world->tilecachebudget / (1024.0f*1024.0f));
+			f16->print(5, video.yres-42, "Prefetch: %d queued, %d stalls, %d prevented, %d models preloaded", world->tilesPending(),
+				world->tilestalls, world->stallsprevented, world->modelsPreloaded());
+			if (recording) f16->print(video.xres - 120, 20, "Recording");
+			else if (playing) f16->print(video.xres - 120, 20, "Playback");
+
 			f16->print(5, video.yres-22, "(%.0f, %.0f, %.0f)", 
 				-(world->camera.x - ZEROPOINT), 
 				-(world->camera.z - ZEROPOINT),
@@ -187,6 +268,38 @@ void Test::display(float t, float dt)
 
 };
 
+void Test::benchmarkHorizon()
+{
+	// draw the same view at increasing far terrain distances and log the cost of each
+	const int dists[] = {2, 4, 8, 16, 32, 64};
+	const int frames = 20;
+	float olddist = world->horizon->viewdist;
+	bool olddraw = world->drawhorizon;
+	world->drawhorizon = true;
+
+	gLog("Horizon benchmark at (%.0f, %.0f, %.0f):\n", world->camera.x, world->camera.z, world->camera.y);
+	for (int d=0; d<6; d++) {
+		world->horizon->viewdist = dists[d] * TILESIZE;
+		int tris = 0, nodes = 0;
+		glFinish();
+		int t0 = SDL_GetTicks();
+		for (int i=0; i<frames; i++) {
+			video.clearScreen();
+			video.set3D();
+			world->draw();
+			tris += world->horizon->trisdrawn;
+			nodes += world->horizon->nodesdrawn;
+			glFinish();
+		}
+		int t1 = SDL_GetTicks();
+		gLog("  %2d tiles: %.2f ms/frame, %d nodes, %d tris\n", dists[d], (t1-t0) / (float)frames,
+			nodes / frames, tris / frames);
+	}
+
+	world->horizon->viewdist = olddist;
+	world->drawhorizon = olddraw;
+}
+
 void Test::keypressed(SDL_KeyboardEvent *e)
 {
 	if (e->type == SDL_KEYDOWN) {
@@ -270,6 +383,24 @@ void Test::keypressed(SDL_KeyboardEvent *e)
 		if (e->keysym.sym == SDLK_f) {
 			world->drawfog = !world->drawfog;
 		}
+		if (e->keysym.sym == SDLK_c) {
+			world->occlusion->enabled = !world->occlusion->enabled;
+		}
+		if (e->keysym.sym == SDLK_k) {
+			world->skyline->enabled = !world->skyline->enabled;
+		}
+		if (e->keysym.sym == SDLK_g) {
+			world->portalculling = !world->portalculling;
+		}
+		if (e->keysym.sym == SDLK_j) {
+			world->modelboxes = !world->modelboxes;
+		}
+		if (e->keysym.sym == SDLK_u) {
+			world->renderqueue->enabled = !world->renderqueue->enabled;
+		}
+		if (e->keysym.sym == SDLK_x) {
+			glstate.filter = !glstate.filter;
+		}
 
 		if (e->keysym.sym == SDLK_KP_PLUS || e->keysym.sym == SDLK_PLUS) {
 			world->fogdistance += 60.0f;
@@ -278,6 +409,15 @@ void Test::keypressed(SDL_KeyboardEvent *e)
 			world->fogdistance -= 60.0f;
 		}
 
+		// terrain detail
+		if (e->keysym.sym == SDLK_RIGHTBRACKET) {
+			world->lodpixels += 0.5f;
+		}
+		if (e->keysym.sym == SDLK_LEFTBRACKET) {
+			world->lodpixels -= 0.5f;
+			if (world->lodpixels < 0) world->lodpixels = 0;
+		}
+
 		// minimap
 		if (e->keysym.sym == SDLK_m) {
 			mapmode = !mapmode;
@@ -337,6 +477,51 @@ void Test::keypressed(SDL_KeyboardEvent *e)
 			fclose(bf);
 		}
 
+		// high detail tile window: page up/down changes the radius, home toggles the shape
+		if (e->keysym.sym == SDLK_PAGEUP || e->keysym.sym == SDLK_PAGEDOWN || e->keysym.sym == SDLK_HOME) {
+			int r = world->tileradius;
+			bool circ = world->circularwindow;
+			if (e->keysym.sym == SDLK_PAGEUP) r++;
+			else if (e->keysym.sym == SDLK_PAGEDOWN) r--;
+			else circ = !circ;
+			world->setTileRadius(r, circ);
+			world->enterTile(world->cx, world->cz);
+		}
+
+		if (e->keysym.sym == SDLK_v) {
+			world->drawhorizon = !world->drawhorizon;
+		}
+		if (e->keysym.sym == SDLK_F12 && world->horizon) {
+			benchmarkHorizon();
+		}
+		if (e->keysym.sym == SDLK_F11) {
+			world->benchmarkCulling();
+		}
+
+		// camera path: F7 records to camerapath.txt, F8 plays it back
+		if (e->keysym.sym == SDLK_F7 && !playing) {
+			if (!recording) {
+				campath.clear();
+				recording = true;
+			} else {
+				recording = false;
+				FILE *pf = fopen("camerapath.txt","w");
+				if (pf) {
+					fprintf(pf, "%s\n", world->basename.c_str());
+					for (size_t i=0; i<campath.size(); i++) {
+						CameraKey &k = campath[i];
+						fprintf(pf, "%f %f %f %f %f %f\n", k.t, k.pos.x, k.pos.y, k.pos.z, k.ah, k.av);
+					}
+					fclose(pf);
+				}
+				gLog("Recorded camera path: %d keys, %.1f s\n", (int)campath.size(), campath.empty() ? 0.0f : campath.back().t);
+			}
+		}
+		if (e->keysym.sym == SDLK_F8 && !recording) {
+			if (!playing) startPlayback();
+			else stopPlayback();
+		}
+
 	} else {
 		// key UP
 
@@ -361,6 +546,63 @@ void Test::keypressed(SDL_KeyboardEvent *e)
 	}
 }
 
+void Test::startPlayback()
+{
+	FILE *pf = fopen("camerapath.txt","r");
+	if (!pf) {
+		gLog("No camera path to play back\n");
+		return;
+	}
+	char mapname[256];
+	if (fscanf(pf, "%255s", mapname) != 1 || world->basename != mapname) {
+		gLog("Camera path is not for map %s\n", world->basename.c_str());
+		fclose(pf);
+		return;
+	}
+	campath.clear();
+	CameraKey k;
+	while (fscanf(pf, "%f %f %f %f %f %f", &k.t, &k.pos.x, &k.pos.y, &k.pos.z, &k.ah, &k.av) == 6) {
+		campath.push_back(k);
+	}
+	fclose(pf);
+	if (campath.size() < 2) return;
+
+	// jump to the start and load it up front, so only the flight itself is measured
+	world->camera = campath[0].pos;
+	ah = campath[0].ah;
+	av = campath[0].av;
+	world->enterTile((int)(world->camera.x / TILESIZE), (int)(world->camera.z / TILESIZE));
+	world->resetTileStats();
+
+	playing = true;
+	pathtime = 0;
+	pathpos = 0;
+	pathframes = 0;
+	pathtiles = 0;
+	pathmaxdt = 0;
+	pathchunks = pathchunksculled = pathobjects = pathobjectsculled = 0;
+	pathocctime = 0;
+}
+
+void Test::stopPlayback()
+{
+	playing = false;
+	gLog("Flythrough: %.1f s, %d frames, %.2f fps avg, slowest frame %.0f ms, prefetch %.1f s\n",
+		pathtime, pathframes, pathtime > 0 ? pathframes / pathtime : 0.0f, pathmaxdt * 1000.0f, world->prefetchtime);
+	gLog("Flythrough window: radius %d %s, %d tiles, %.1f visible per frame\n", world->tileradius,
+		world->circularwindow ? "circular" : "square", world->tilesInWindow(), pathframes > 0 ? pathtiles / (float)pathframes : 0.0f);
+	gLog("Flythrough tiles: %d synchronous stalls, %d stalls prevented, %d tiles prefetched\n",
+		world->tilestalls, world->stallsprevented, world->tilesprefetched);
+	if (world->occlusion->enabled) {
+		gLog("Flythrough occlusion: %.1f%% of %d chunks and %.1f%% of %d objects culled, %.2f ms/frame for the occluders\n",
+			pathchunks ? 100.0f * pathchunksculled / pathchunks : 0.0f, pathchunks,
+			pathobjects ? 100.0f * pathobjectsculled / pathobjects : 0.0f, pathobjects,
+			pathframes > 0 ? pathocctime / (float)pathframes : 0.0f);
+	} else {
+		gLog("Flythrough occlusion: off\n");
+	}
+}
+
 void Test::mousemove(SDL_MouseMotionEvent *e)
 {
 	if (look || fullscreen) {
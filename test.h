@@ -5,6 +5,14 @@
 #include "video.h"
 
 #include "world.h"
+#include <vector>
+
+// one sample of a recorded camera path
+struct CameraKey {
+	float t;
+	Vec3D pos;
+	float ah, av;
+};
 
 
 class Test :public AppState
@@ -18,6 +26,22 @@ class Test :public AppState
 
 	World *world;
 
+	// camera path recording/playback for repeatable flythroughs
+	std::vector<CameraKey> campath;
+	bool recording, playing;
+	float pathtime;
+	size_t pathpos;
+	int pathframes, pathtiles;
+	float pathmaxdt;
+	// occlusion culling totals over the path
+	int pathchunks, pathchunksculled, pathobjects, pathobjectsculled;
+	unsigned int pathocctime;
+
+	void startPlayback();
+	void stopPlayback();
+
+	void benchmarkHorizon();
+
 
 public:
 
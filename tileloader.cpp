@@ -0,0 +1,134 @@
+#include "tileloader.h"
+#include "maptile.h"
+#include "wowmapview.h"
+
+#include <cstdio>
+#include <algorithm>
+
+using namespace std;
+
+bool operator<(const TileRequest &a, const TileRequest &b)
+{
+	return a.eta < b.eta;
+}
+
+TileLoader::TileLoader(const string &basename): basename(basename), busyx(-1), busyz(-1), quit(false)
+{
+	mutex = SDL_CreateMutex();
+	cond = SDL_CreateCond();
+	thread = SDL_CreateThread(threadFunc, this);
+}
+
+TileLoader::~TileLoader()
+{
+	SDL_LockMutex(mutex);
+	quit = true;
+	queue.clear();
+	SDL_CondBroadcast(cond);
+	SDL_UnlockMutex(mutex);
+
+	SDL_WaitThread(thread, 0);
+
+	// never uploaded, so these only hold CPU data
+	for (vector<MapTile*>::iterator it = done.begin(); it != done.end(); ++it) {
+		delete *it;
+	}
+
+	SDL_DestroyCond(cond);
+	SDL_DestroyMutex(mutex);
+}
+
+int TileLoader::threadFunc(void *p)
+{
+	((TileLoader*)p)->run();
+	return 0;
+}
+
+void TileLoader::run()
+{
+	SDL_LockMutex(mutex);
+	while (!quit) {
+		if (queue.empty()) {
+			SDL_CondWait(cond, mutex);
+			continue;
+		}
+
+		TileRequest r = queue.front();
+		queue.erase(queue.begin());
+		busyx = r.x;
+		busyz = r.z;
+		SDL_UnlockMutex(mutex);
+
+		char name[256];
+		sprintf(name,"World\\Maps\\%s\\%s_%d_%d.adt", basename.c_str(), basename.c_str(), r.x, r.z);
+		MapTile *tile = new MapTile(r.x, r.z, name);
+
+		SDL_LockMutex(mutex);
+		busyx = busyz = -1;
+		done.push_back(tile);
+		// someone might be waiting for exactly this tile
+		SDL_CondBroadcast(cond);
+	}
+	SDL_UnlockMutex(mutex);
+}
+
+void TileLoader::setQueue(vector<TileRequest> &requests)
+{
+	// replaces whatever was queued before; tiles in flight or already decoded are skipped
+	SDL_LockMutex(mutex);
+	queue.clear();
+	for (vector<TileRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
+		if (it->x == busyx && it->z == busyz) continue;
+		bool isdone = false;
+		for (vector<MapTile*>::iterator dt = done.begin(); dt != done.end(); ++dt) {
+			if ((*dt)->x == it->x && (*dt)->z == it->z) isdone = true;
+		}
+		if (!isdone) queue.push_back(*it);
+	}
+	stable_sort(queue.begin(), queue.end());
+	if (!queue.empty()) SDL_CondSignal(cond);
+	SDL_UnlockMutex(mutex);
+}
+
+MapTile *TileLoader::take(int x, int z, bool &waited)
+{
+	// returns the decoded tile if the loader has (or is just making) it, 0 otherwise
+	waited = false;
+	SDL_LockMutex(mutex);
+	for (vector<TileRequest>::iterator it = queue.begin(); it != queue.end(); ++it) {
+		if (it->x == x && it->z == z) {
+			queue.erase(it);
+			break;
+		}
+	}
+	while (busyx == x && busyz == z) {
+		waited = true;
+		SDL_CondWait(cond, mutex);
+	}
+	MapTile *tile = 0;
+	for (vector<MapTile*>::iterator it = done.begin(); it != done.end(); ++it) {
+		if ((*it)->x == x && (*it)->z == z) {
+			tile = *it;
+			done.erase(it);
+			break;
+		}
+	}
+	SDL_UnlockMutex(mutex);
+	return tile;
+}
+
+void TileLoader::takeAll(vector<MapTile*> &tiles)
+{
+	SDL_LockMutex(mutex);
+	tiles.insert(tiles.end(), done.begin(), done.end());
+	done.clear();
+	SDL_UnlockMutex(mutex);
+}
+
+int TileLoader::pending()
+{
+	SDL_LockMutex(mutex);
+	int n = (int)queue.size() + (busyx != -1 ? 1 : 0);
+	SDL_UnlockMutex(mutex);
+	return n;
+}
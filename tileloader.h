@@ -0,0 +1,41 @@
+#ifndef TILELOADER_H
+#define TILELOADER_H
+
+#include <SDL/SDL.h>
+#include <vector>
+#include <string>
+
+class MapTile;
+
+struct TileRequest {
+	int x, z;
+	float eta; // estimated time until the camera needs the tile, in seconds
+};
+
+// decodes map tiles on a background thread; the GL upload stays on the main thread
+class TileLoader {
+	SDL_Thread *thread;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+
+	std::string basename;
+
+	std::vector<TileRequest> queue;		// sorted by eta
+	std::vector<MapTile*> done;			// decoded, waiting to be uploaded
+	int busyx, busyz;
+	bool quit;
+
+	static int threadFunc(void *p);
+	void run();
+
+public:
+	TileLoader(const std::string &basename);
+	~TileLoader();
+
+	void setQueue(std::vector<TileRequest> &requests);
+	MapTile *take(int x, int z, bool &waited);
+	void takeAll(std::vector<MapTile*> &tiles);
+	int pending();
+};
+
+#endif
@@ -162,17 +162,18 @@ WMO::WMO(std::string name): ManagedItem(name)
 			}
 		}
 		else if (!strcmp(fourcc,"MOPV")) {
-			WMOPV p;
-			for (int i=0; i<nP; i++) {
-				f.read(ff,12);
-				p.a = Vec3D(ff[0],ff[2],-ff[1]);
-				f.read(ff,12);
-				p.b = Vec3D(ff[0],ff[2],-ff[1]);
-				f.read(ff,12);
-				p.c = Vec3D(ff[0],ff[2],-ff[1]);
+			// not always 4 per portal, MOPT says which belong to which
+			int nn = (int)size / 12;
+			for (int i=0; i<nn; i++) {
 				f.read(ff,12);
-				p.d = Vec3D(ff[0],ff[2],-ff[1]);
-				pvs.push_back(p);
+				pvs.push_back(Vec3D(ff[0],ff[2],-ff[1]));
+			}
+		}
+		else if (!strcmp(fourcc,"MOPT")) {
+			int nn = (int)size / 20;
+			WMOPT *pt = (WMOPT*)f.getPointer();
+			for (int i=0; i<nn; i++) {
+				pts.push_back(*pt++);
 			}
 		}
 		else if (!strcmp(fourcc,"MOPR")) {
@@ -224,12 +225,13 @@ WMO::~WMO()
 	}
 }
 
-void WMO::draw(int doodadset, const Vec3D &ofs, const float rot)
+void WMO::draw(int doodadset, const Matrix &m, const Vec3D &ofs, const float rot)
 {
 	if (!ok) return;
+	gWorld->wmogroups += nGroups;
 	
 	for (int i=0; i<nGroups; i++) {
-		groups[i].draw(ofs, rot);
+		groups[i].draw(m);
 	}
 
 	if (gWorld->drawdoodads) {
@@ -306,10 +308,12 @@ void WMO::draw(int doodadset, const Vec3D &ofs, const float rot)
 	glBegin(GL_LINES);
 	for (size_t i=0; i<prs.size(); i++) {
 		WMOPR &pr = prs[i];
-		WMOPV &pv = pvs[pr.portal];
+		WMOPT &pt = pts[pr.portal];
 		if (pr.dir>0) glColor4f(1,0,0,1);
 		else glColor4f(0,0,1,1);
-		Vec3D pc = (pv.a+pv.b+pv.c+pv.d)*0.25f;
+		Vec3D pc(0,0,0);
+		for (int k=0; k<pt.count; k++) pc += pvs[pt.start+k];
+		pc *= 1.0f / pt.count;
 		Vec3D gc = (groups[pr.group].b1 + groups[pr.group].b2)*0.5f;
 		glVertex3fv(pc);
 		glVertex3fv(gc);
@@ -317,12 +321,9 @@ void WMO::draw(int doodadset, const Vec3D &ofs, const float rot)
 	glEnd();
 	glColor4f(1,1,1,1);
 	// draw portals
-	for (int i=0; i<nP; i++) {
+	for (size_t i=0; i<pts.size(); i++) {
 		glBegin(GL_LINE_STRIP);
-		glVertex3fv(pvs[i].d);
-		glVertex3fv(pvs[i].c);
-		glVertex3fv(pvs[i].b);
-		glVertex3fv(pvs[i].a);
+		for (int k=pts[i].count-1; k>=0; k--) glVertex3fv(pvs[pts[i].start+k]);
 		glEnd();
 	}
 	glEnable(GL_TEXTURE_2D);
@@ -330,6 +331,153 @@ void WMO::draw(int doodadset, const Vec3D &ofs, const float rot)
 	*/
 }
 
+void WMO::addOccluders(OcclusionBuffer *ob, const Matrix &m)
+{
+	if (!ok) return;
+
+	for (int i=0; i<nGroups; i++) {
+		groups[i].addOccluder(ob, m);
+	}
+}
+
+int WMO::cameraGroup(const Vec3D &camera, bool &floor)
+{
+	// the group with the nearest floor under the camera has it; only interior groups
+	// count, from anywhere else the way in is through the exterior. floor tells whether
+	// there was any floor under the camera at all
+	int best = -1;
+	float besty = 0;
+	for (int i=0; i<nGroups; i++) {
+		WMOGroup &g = groups[i];
+		if (!g.contains(camera)) continue;
+		float y;
+		if (g.floorBelow(camera, y) && (best < 0 || y > besty)) {
+			best = i;
+			besty = y;
+		}
+	}
+	floor = best >= 0;
+	if (best >= 0 && !groups[best].interior()) best = -1;
+	return best;
+}
+
+void WMO::findVisibleGroups(const Vec3D &camera, const Plane *planes)
+{
+	if (!ok) return;
+
+	if (!gWorld->portalculling || pvs.empty() || pts.empty() || prs.empty()) {
+		for (int i=0; i<nGroups; i++) groups[i].reachable = true;
+		return;
+	}
+	for (int i=0; i<nGroups; i++) groups[i].reachable = false;
+
+	// near and far first, they stay when the sides get narrowed
+	vector<Plane> frustum;
+	frustum.push_back(planes[FRONT]);
+	frustum.push_back(planes[BACK]);
+	for (int i=RIGHT; i<=TOP; i++) frustum.push_back(planes[i]);
+	int path[WMO_PORTALDEPTH + 1];
+	bool floor;
+	int start = cameraGroup(camera, floor);
+	if (start >= 0) {
+		traversePortals(start, frustum, camera, 0, path);
+	} else {
+		// outside, everything exterior is in plain sight
+		for (int i=0; i<nGroups; i++) {
+			if (!groups[i].interior()) traversePortals(i, frustum, camera, 0, path);
+		}
+		// with no floor under it (a tall hall, a stairwell, a gap in the floor) the camera
+		// could be in any of the interior groups around it
+		if (!floor) {
+			for (int i=0; i<nGroups; i++) {
+				if (groups[i].interior() && groups[i].contains(camera)) traversePortals(i, frustum, camera, 0, path);
+			}
+		}
+	}
+}
+
+// keeps the part of a convex polygon on the inner side of a plane
+static void clipPolygon(vector<Vec3D> &poly, const Plane &p)
+{
+	vector<Vec3D> out;
+	for (size_t i=0; i<poly.size(); i++) {
+		const Vec3D &a = poly[i], &b = poly[(i+1) % poly.size()];
+		float da = p.a*a.x + p.b*a.y + p.c*a.z + p.d;
+		float db = p.a*b.x + p.b*b.y + p.c*b.z + p.d;
+		if (da >= 0) out.push_back(a);
+		if ((da >= 0) != (db >= 0)) out.push_back(a + (b - a) * (da / (da - db)));
+	}
+	poly.swap(out);
+}
+
+void WMO::traversePortals(int g, const vector<Plane> &planes, const Vec3D &camera, int depth, int *path)
+{
+	groups[g].reachable = true;
+	path[depth] = g;
+	if (depth >= WMO_PORTALDEPTH) return;
+
+	for (int i=groups[g].portalStart; i<groups[g].portalStart + groups[g].portalCount; i++) {
+		if (i < 0 || i >= (int)prs.size()) break;
+		const WMOPR &pr = prs[i];
+		if (pr.portal < 0 || pr.portal >= (int)pts.size() || pr.group < 0 || pr.group >= nGroups) continue;
+
+		// never back into a group on the way here
+		bool onpath = false;
+		for (int k=0; k<=depth; k++) {
+			if (path[k] == pr.group) onpath = true;
+		}
+		if (onpath) continue;
+
+		// a portal without a proper polygon can't narrow anything, look through it as it is
+		const WMOPT &pt = pts[pr.portal];
+		if (pt.count < 3 || (size_t)pt.start + pt.count > pvs.size()) {
+			traversePortals(pr.group, planes, camera, depth+1, path);
+			continue;
+		}
+
+		// what can be seen of the portal
+		const Vec3D *pv = &pvs[pt.start];
+		vector<Vec3D> poly(pv, pv + pt.count);
+		for (size_t k=0; k<planes.size() && poly.size() >= 3; k++) clipPolygon(poly, planes[k]);
+		if (poly.size() < 3) continue;
+
+		// the view through it is narrowed to planes through the camera and its edges;
+		// standing right in the portal, just pass the frustum on
+		Vec3D n = (pv[1] - pv[0]) % (pv[2] - pv[0]);
+		n.normalize();
+		if (fabsf((camera - pv[0]) * n) < 1.0f) {
+			traversePortals(pr.group, planes, camera, depth+1, path);
+			continue;
+		}
+		Vec3D centre(0,0,0);
+		for (size_t k=0; k<poly.size(); k++) centre += poly[k];
+		centre *= 1.0f / poly.size();
+
+		vector<Plane> narrowed;
+		narrowed.push_back(planes[0]);
+		narrowed.push_back(planes[1]);
+		for (size_t k=0; k<poly.size(); k++) {
+			Vec3D e = (poly[k] - camera) % (poly[(k+1) % poly.size()] - camera);
+			float len = e.length();
+			if (len < 0.0001f) continue;
+			e *= 1.0f / len;
+			Plane p;
+			p.a = e.x;
+			p.b = e.y;
+			p.c = e.z;
+			p.d = -(e * camera);
+			if (p.a*centre.x + p.b*centre.y + p.c*centre.z + p.d < 0) {
+				p.a = -p.a;
+				p.b = -p.b;
+				p.c = -p.c;
+				p.d = -p.d;
+			}
+			narrowed.push_back(p);
+		}
+		traversePortals(pr.group, narrowed, camera, depth+1, path);
+	}
+}
+
 void WMO::drawSkybox()
 {
 	if (skybox) {
@@ -361,14 +509,11 @@ void WMO::drawSkybox()
 void WMO::drawPortals()
 {
 	// not used ;)
-	glBegin(GL_QUADS);
-	for (int i=0; i<nP; i++) {
-		glVertex3fv(pvs[i].d);
-		glVertex3fv(pvs[i].c);
-		glVertex3fv(pvs[i].b);
-		glVertex3fv(pvs[i].a);
+	for (size_t i=0; i<pts.size(); i++) {
+		glBegin(GL_POLYGON);
+		for (int k=pts[i].count-1; k>=0; k--) glVertex3fv(pvs[pts[i].start+k]);
+		glEnd();
 	}
-	glEnd();
 }
 */
 
@@ -523,6 +668,8 @@ void WMOGroup::initDisplayList()
 
 	b1 = Vec3D(gh.box1[0], gh.box1[2], -gh.box1[1]);
 	b2 = Vec3D(gh.box2[0], gh.box2[2], -gh.box2[1]);
+	portalStart = gh.portalStart;
+	portalCount = gh.portalCount;
 
 	gf.seek(0x58); // first chunk
 	char fourcc[5];
@@ -718,6 +865,35 @@ void WMOGroup::initDisplayList()
 
 	glEndList();
 
+	// keep the solid surfaces of big outdoor groups around as occluders; glass, foliage and
+	// anything two-sided could have things showing through
+	if (!indoor && rad >= OCCLUSION_WMORADIUS) {
+		for (int b=0; b<nBatches; b++) {
+			WMOMaterial *mat = &wmo->mat[batches[b].texture];
+			if (mat->transparent || (mat->flags & 0x04)) continue;
+			for (int t=0, i=batches[b].indexStart; t<batches[b].indexCount; t++,i++) {
+				occindices.push_back(indices[i]);
+			}
+		}
+		if (occindices.size() > OCCLUSION_WMOTRIS * 3) occindices.clear();
+		if (!occindices.empty()) {
+			occverts.resize(nVertices);
+			for (int i=0; i<nVertices; i++) occverts[i] = Vec3D(vertices[i].x, vertices[i].z, -vertices[i].y);
+		}
+	}
+
+	// floors and ramps, walls and ceilings can't have the camera standing over them
+	for (int t=0; t<nTriangles; t++) {
+		Vec3D v[3];
+		for (int k=0; k<3; k++) {
+			Vec3D &s = vertices[indices[t*3+k]];
+			v[k] = Vec3D(s.x, s.z, -s.y);
+		}
+		Vec3D n = (v[1] - v[0]) % (v[2] - v[0]);
+		if (n.y < 0.5f * n.length()) continue;
+		for (int k=0; k<3; k++) floortris.push_back(v[k]);
+	}
+
 	gf.close();
 
 	// hmm
@@ -759,16 +935,47 @@ void WMOGroup::initLighting(int nLR, short *useLights)
 	}
 }
 
-void WMOGroup::draw(const Vec3D& ofs, const float rot)
+void WMOGroup::addOccluder(OcclusionBuffer *ob, const Matrix &m)
+{
+	if (occindices.empty()) return;
+	Vec3D pos = m * center;
+	if (!gWorld->frustum.intersectsSphere(pos, rad)) return;
+	if ((pos - gWorld->camera).length() - rad >= gWorld->culldistance) return;
+	ob->addTriangles(&occverts[0], (int)occverts.size(), &occindices[0], (int)occindices.size(), &m);
+}
+
+bool WMOGroup::floorBelow(const Vec3D &p, float &y) const
+{
+	// highest floor triangle straight under p
+	bool found = false;
+	for (size_t t=0; t<floortris.size(); t+=3) {
+		const Vec3D &a = floortris[t], &b = floortris[t+1], &c = floortris[t+2];
+		float det = (b.x - a.x) * (c.z - a.z) - (c.x - a.x) * (b.z - a.z);
+		if (det == 0) continue;
+		float u = ((p.x - a.x) * (c.z - a.z) - (c.x - a.x) * (p.z - a.z)) / det;
+		float v = ((b.x - a.x) * (p.z - a.z) - (p.x - a.x) * (b.z - a.z)) / det;
+		if (u < 0 || v < 0 || u + v > 1) continue;
+		float h = a.y + u * (b.y - a.y) + v * (c.y - a.y);
+		if (h > p.y || (found && h <= y)) continue;
+		y = h;
+		found = true;
+	}
+	return found;
+}
+
+void WMOGroup::draw(const Matrix &m)
 {
 	visible = false;
+	if (!reachable) return;
 	// view frustum culling
-	Vec3D pos = center + ofs;
-	rotate(ofs.x,ofs.z,&pos.x,&pos.z,rot*PI/180.0f);
+	Vec3D pos = m * center;
 	if (!gWorld->frustum.intersectsSphere(pos,rad)) return;
 	float dist = (pos - gWorld->camera).length() - rad;
 	if (dist >= gWorld->culldistance) return;
+	if (!gWorld->skyline->objectVisible(pos, rad)) return;
+	if (!gWorld->occlusion->objectVisible(pos, rad)) return;
 	visible = true;
+	gWorld->wmogroupsdrawn++;
 	
 	if (hascv) {
 		glDisable(GL_LIGHTING);
@@ -930,43 +1137,65 @@ int WMOManager::add(std::string name)
 
 
 
-WMOInstance::WMOInstance(WMO *wmo, MPQFile &f) : wmo (wmo)
+WMOInstance::WMOInstance(WMO *wmo, const WMOPlacement &p) : wmo (wmo)
 {
-	float ff[3];
-    f.read(&id, 4);
-	f.read(ff,12);
-	pos = Vec3D(ff[0],ff[1],ff[2]);
-	f.read(ff,12);
-	dir = Vec3D(ff[0],ff[1],ff[2]);
-	f.read(ff,12);
-	pos2 = Vec3D(ff[0],ff[1],ff[2]);
-	f.read(ff,12);
-	pos3 = Vec3D(ff[0],ff[1],ff[2]);
-	f.read(&d2,4);
-	f.read(&d3,4);
+	id = p.id;
+	pos = Vec3D(p.pos[0],p.pos[1],p.pos[2]);
+	dir = Vec3D(p.dir[0],p.dir[1],p.dir[2]);
+	pos2 = Vec3D(p.pos2[0],p.pos2[1],p.pos2[2]);
+	pos3 = Vec3D(p.pos3[0],p.pos3[1],p.pos3[2]);
+	d2 = p.d2;
+	d3 = p.d3;
 	
 	doodadset = (d2 & 0xFFFF0000) >> 16;
 
+	// the rotations the instance used to do with glRotatef every frame
+	mat = Matrix::newTranslation(pos) * Matrix::newRotation(Vec3D(0,1,0), dir.y - 90.0f)
+		* Matrix::newRotation(Vec3D(0,0,1), -dir.x) * Matrix::newRotation(Vec3D(1,0,0), dir.z);
+	invmat = mat;
+	invmat.invert();
+
+	// the placement record carries the extents already, in the same space as pos
+	vmin = Vec3D(pos2.x < pos3.x ? pos2.x : pos3.x, pos2.y < pos3.y ? pos2.y : pos3.y, pos2.z < pos3.z ? pos2.z : pos3.z);
+	vmax = Vec3D(pos2.x > pos3.x ? pos2.x : pos3.x, pos2.y > pos3.y ? pos2.y : pos3.y, pos2.z > pos3.z ? pos2.z : pos3.z);
+
+	drawn = gWorld->wmoStamp(id);
+
 	//gLog("WMO instance: %s (%d, %d)\n", wmo->name.c_str(), d2, d3);
 }
 
 void WMOInstance::draw()
 {
-	if (ids.find(id) != ids.end()) return;
-	ids.insert(id);
+	if (*drawn == gWorld->drawframe) return;
+	*drawn = gWorld->drawframe;
+
+	if (!gWorld->frustum.intersects(vmin, vmax)) return;
+	// distance to the bounds
+	Vec3D d(0,0,0);
+	const Vec3D &c = gWorld->camera;
+	if (c.x < vmin.x) d.x = vmin.x - c.x; else if (c.x > vmax.x) d.x = c.x - vmax.x;
+	if (c.y < vmin.y) d.y = vmin.y - c.y; else if (c.y > vmax.y) d.y = c.y - vmax.y;
+	if (c.z < vmin.z) d.z = vmin.z - c.z; else if (c.z > vmax.z) d.z = c.z - vmax.z;
+	if (d.lengthSquared() >= gWorld->culldistance2) return;
+
+	// the portals are walked in the WMO's own space, so bring the camera and frustum there
+	Plane planes[6];
+	for (int i=0; i<6; i++) {
+		const Plane &p = gWorld->frustum.planes[i];
+		planes[i].a = p.a*mat.m[0][0] + p.b*mat.m[1][0] + p.c*mat.m[2][0] + p.d*mat.m[3][0];
+		planes[i].b = p.a*mat.m[0][1] + p.b*mat.m[1][1] + p.c*mat.m[2][1] + p.d*mat.m[3][1];
+		planes[i].c = p.a*mat.m[0][2] + p.b*mat.m[1][2] + p.c*mat.m[2][2] + p.d*mat.m[3][2];
+		planes[i].d = p.a*mat.m[0][3] + p.b*mat.m[1][3] + p.c*mat.m[2][3] + p.d*mat.m[3][3];
+	}
+	wmo->findVisibleGroups(invmat * c, planes);
 
 	glPushMatrix();
-	glTranslatef(pos.x, pos.y, pos.z);
+	Matrix t = mat;
+	t.transpose();
+	glMultMatrixf(t);
 
 	float rot = -90.0f + dir.y;
-
-	// TODO: replace this with a single transform matrix calculated at load time
-
-	glRotatef(dir.y - 90.0f, 0, 1, 0);
-	glRotatef(-dir.x, 0, 0, 1);
-	glRotatef(dir.z, 1, 0, 0);
-
-	wmo->draw(doodadset,pos,-rot);
+	wmo->draw(doodadset,mat,pos,-rot);
 
 	glPopMatrix();
 }
@@ -974,8 +1203,8 @@ void WMOInstance::draw()
 /*
 void WMOInstance::drawPortals()
 {
-	if (ids.find(id) != ids.end()) return;
-	ids.insert(id);
+	if (*drawn == gWorld->drawframe) return;
+	*drawn = gWorld->drawframe;
 
 	glPushMatrix();
 	glTranslatef(pos.x, pos.y, pos.z);
@@ -989,9 +1218,7 @@ void WMOInstance::drawPortals()
 }
 */
 
-void WMOInstance::reset()
+void WMOInstance::addOccluders(OcclusionBuffer *ob)
 {
-    ids.clear();
+	wmo->addOccluders(ob, mat);
 }
-
-std::set<int> WMOInstance::ids;
@@ -6,14 +6,19 @@
 #include "mpq.h"
 #include "model.h"
 #include <vector>
-#include <set>
 #include "video.h"
+#include "matrix.h"
+#include "frustum.h"
 
 class WMO;
 class WMOGroup;
 class WMOInstance;
 class WMOManager;
 class Liquid;
+class OcclusionBuffer;
+
+// portals followed from the camera's group before giving up on narrowing any further
+const int WMO_PORTALDEPTH = 8;
 
 
 class WMOGroup {
@@ -29,24 +34,39 @@ class WMOGroup {
 	int nDoodads;
 	short *ddr;
 	Liquid *lq;
+	// opaque one-sided faces of big outdoor groups, for occlusion culling
+	std::vector<Vec3D> occverts;
+	std::vector<unsigned short> occindices;
+	// walkable triangles, three vertices each, for finding the group the camera is in
+	std::vector<Vec3D> floortris;
 public:
 	Vec3D b1,b2;
 	Vec3D vmin, vmax;
 	bool indoor, hascv;
 	bool visible;
+	// seen through the portals this frame, see WMO::findVisibleGroups
+	bool reachable;
+	int portalStart, portalCount;
 
 	bool outdoorLights;
 	std::string name;
 
-	WMOGroup() : dl(0) {}
+	WMOGroup() : dl(0), reachable(true), portalStart(0), portalCount(0) {}
 	~WMOGroup();
 	void init(WMO *wmo, MPQFile &f, int num, char *names);
 	void initDisplayList();
 	void initLighting(int nLR, short *useLights);
-	void draw(const Vec3D& ofs, const float rot);
+	void draw(const Matrix &m);
 	void drawLiquid();
 	void drawDoodads(int doodadset, const Vec3D& ofs, const float rot);
 	void setupFog();
+	void addOccluder(OcclusionBuffer *ob, const Matrix &m);
+	bool interior() const { return (flags & 0x2000) != 0; }
+	bool floorBelow(const Vec3D &p, float &y) const;
+	bool contains(const Vec3D &p) const
+	{
+		return p.x >= vmin.x && p.x <= vmax.x && p.y >= vmin.y && p.y <= vmax.y && p.z >= vmin.z && p.z <= vmax.z;
+	}
 };
 
 struct WMOMaterial {
@@ -80,8 +100,10 @@ struct WMOLight {
 	static void setupOnce(GLint light, Vec3D dir, Vec3D lcol);
 };
 
-struct WMOPV {
-	Vec3D a,b,c,d;
+// a portal's polygon, count vertices from start on in the portal vertex list
+struct WMOPT {
+	unsigned short start, count;
+	float plane[4];
 };
 
 struct WMOPR {
@@ -116,6 +138,9 @@ struct WMOFog {
 };
 
 class WMO: public ManagedItem {
+	int cameraGroup(const Vec3D &camera, bool &floor);
+	void traversePortals(int g, const std::vector<Plane> &planes, const Vec3D &camera, int depth, int *path);
+
 public:
 	WMOGroup *groups;
 	int nTextures, nGroups, nP, nLights, nModels, nDoodads, nDoodadSets, nX;
@@ -127,7 +152,8 @@ public:
 	std::vector<ModelInstance> modelis;
 
 	std::vector<WMOLight> lights;
-	std::vector<WMOPV> pvs;
+	std::vector<Vec3D> pvs;
+	std::vector<WMOPT> pts;
 	std::vector<WMOPR> prs;
 
 	std::vector<WMOFog> fogs;
@@ -139,9 +165,12 @@ public:
 
 	WMO(std::string name);
 	~WMO();
-	void draw(int doodadset, const Vec3D& ofs, const float rot);
+	void draw(int doodadset, const Matrix &m, const Vec3D& ofs, const float rot);
 	//void drawPortals();
 	void drawSkybox();
+	void addOccluders(OcclusionBuffer *ob, const Matrix &m);
+	// camera and view frustum in the WMO's own coordinates
+	void findVisibleGroups(const Vec3D &camera, const Plane *planes);
 };
 
 
@@ -151,8 +180,19 @@ public:
 };
 
 
+// wmo placement record as stored in the ADT/WDT MODF chunk
+struct WMOPlacement {
+	uint32 nameid;
+	uint32 id;
+	float pos[3];
+	float dir[3];
+	float pos2[3];
+	float pos3[3];
+	uint32 d2;
+	uint32 d3;
+};
+
 class WMOInstance {
-	static std::set<int> ids;
 public:
 	WMO *wmo;
 	Vec3D pos;
@@ -160,11 +200,16 @@ public:
 	int id, d2, d3;
 	int doodadset;
 
-	WMOInstance(WMO *wmo, MPQFile &f);
+	// placement transform and its inverse, and the world space bounds
+	Matrix mat, invmat;
+	Vec3D vmin, vmax;
+	// frame this id was last drawn in, shared with the copies in neighbouring tiles
+	int *drawn;
+
+	WMOInstance(WMO *wmo, const WMOPlacement &p);
 	void draw();
 	//void drawPortals();
-
-	static void reset();
+	void addOccluders(OcclusionBuffer *ob);
 };
 
 
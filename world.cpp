@@ -1,6 +1,7 @@
 #include "world.h"
 
 #include <cassert>
+#include <algorithm>
 
 using namespace std;
 
@@ -8,6 +9,30 @@ using namespace std;
 
 World *gWorld=0;
 
+size_t gTileCacheBudget = TILECACHE_DEFAULTBUDGET;
+float gPrefetchTime = 5.0f;
+unsigned int gUploadTimeBudget = 4;
+size_t gUploadByteBudget = 2 * 1024 * 1024;
+int gTileRadius = 1;
+int gLowresRadius = 2;
+bool gCircularWindow = false;
+bool gDrawHorizon = true;
+bool gUseShaders = true;
+float gLODPixels = 2.0f;
+bool gOcclusion = true;
+int gOcclusionThreads = 2;
+bool gSkyline = true;
+bool gPortalCulling = true;
+bool gModelBoxes = true;
+bool gRenderQueue = true;
+bool gStateCache = true;
+bool gStateCheck = false;
+
+
+bool oktile(int i, int j)
+{
+	return i>=0 && j >= 0 && i<64 && j<64;
+}
 
 World::World(const char* name):basename(name)
 {
@@ -15,7 +40,35 @@ World::World(const char* name):basename(name)
 
 	gLog("\nLoading world %s\n", name);
 
-	for (int i=0; i<MAPTILECACHESIZE; i++) maptilecache[i] = 0;
+	tilecachebytes = 0;
+	tilecachebudget = gTileCacheBudget;
+
+	curtile = 0;
+	tileradius = gTileRadius;
+	circularwindow = gCircularWindow;
+	lowresradius = gLowresRadius;
+	horizon = 0;
+	drawhorizon = gDrawHorizon;
+	occlusion = new OcclusionBuffer(gOcclusionThreads);
+	occlusion->enabled = gOcclusion;
+	skyline = new Skyline();
+	skyline->enabled = gSkyline;
+	renderqueue = new RenderQueue();
+	renderqueue->enabled = gRenderQueue;
+	glstate.filter = gStateCache;
+	glstate.check = gStateCheck;
+	portalculling = gPortalCulling;
+	wmogroups = wmogroupsdrawn = 0;
+	modelboxes = gModelBoxes;
+	modelsdrawn = 0;
+	underground = false;
+
+	loader = 0;
+	velocity = Vec3D(0,0,0);
+	prefetchtime = gPrefetchTime;
+	uploadtimebudget = gUploadTimeBudget;
+	uploadbytebudget = gUploadByteBudget;
+	resetTileStats();
 
 	autoheight = false;
 
@@ -32,9 +85,11 @@ void World::init()
 {
 	for (int j=0; j<64; j++) {
 		for (int i=0; i<64; i++) {
-			lowrestiles[j][i] = 0;
+			lowresindex[j][i] = -1;
 		}
 	}
+	nLowres = 0;
+	lowresvbo = lowresibo = 0;
 
 	gnWMO = 0;
 	nMaps = 0;
@@ -88,16 +143,92 @@ void World::init()
 	}
 	f.close();
 
+	placements.load(basename);
+
 	mapstrip = 0;
 	mapstrip2 = 0;
+	stripibo = 0;
+	stripibosize = 0;
+	strip2ofs = 0;
+	terraincalls = terrainpasses = 0;
+	terraintris = terrainfulltris = 0;
+	lodpixels = gLODPixels;
+	lodframe = 0;
+	drawframe = 0;
+	terrainshader = 0;
 
 	minimap = 0;
-	if (nMaps) initMinimap();
+	terrainstep = TERRAIN_QUANT * 4;
+	if (nMaps) initWDL();
 }
 
 
-void World::initMinimap()
+// minimap palette: blue below sea level, green-brown-gray-white going up
+void heightColor(short hval, unsigned char &r, unsigned char &g, unsigned char &b)
+{
+	if (hval < 0) {
+		// water = blue
+		if (hval < -511) hval = -511;
+		hval /= -2;
+		r = g = 0;
+		b = 255 - hval;
+	} else {
+		// above water = should apply a palette :(
+		/*
+		float fh = hval / 1600.0f;
+		if (fh > 1.0f) fh = 1.0f;
+		unsigned char c = (unsigned char) (fh * 255.0f);
+		r = g = b = c;
+		*/
+
+		// green: 20,149,7		0-600
+		// brown: 137, 84, 21	600-1200
+		// gray: 96, 96, 96		1200-1600
+		// white: 255, 255, 255
+		unsigned char r1,r2,g1,g2,b1,b2;
+		float t;
+
+		if (hval < 600) {
+			r1 = 20;
+			r2 = 137;
+			g1 = 149;
+			g2 = 84;
+			b1 = 7;
+			b2 = 21;
+			t = hval / 600.0f;
+		}
+		else if (hval < 1200) {
+			r2 = 96;
+			r1 = 137;
+			g2 = 96;
+			g1 = 84;
+			b2 = 96;
+			b1 = 21;
+			t = (hval-600) / 600.0f;
+		}
+		else /*if (hval < 1600)*/ {
+			r1 = 96;
+			r2 = 255;
+			g1 = 96;
+			g2 = 255;
+			b1 = 96;
+			b2 = 255;
+			if (hval >= 1600) hval = 1599;
+			t = (hval-1200) / 600.0f;
+		}
+
+		// TODO: add a regular palette here
+
+		r = (unsigned char)(r2*t + r1*(1.0f-t));
+		g = (unsigned char)(g2*t + g1*(1.0f-t));
+		b = (unsigned char)(b2*t + b1*(1.0f-t));
+	}
+}
+
+void World::initWDL()
 {
+	// the WDL holds a 17x17 + 16x16 height grid for every tile, read it once for
+	// both the minimap and the low-res far terrain (see initLowresTerrain)
 	glGenTextures(1, &minimap);
 
 	// zomg, data on the stack!!1
@@ -105,9 +236,6 @@ void World::initMinimap()
 	unsigned int *texbuf = new unsigned int[512*512];
 	memset(texbuf,0,512*512*4);
 
-	// as alpha is unused, maybe I should try 24bpp? :(
-	short tilebuf[17*17];
-
 	int ofsbuf[64][64];
 
 	char fn[256];
@@ -123,19 +251,16 @@ void World::initMinimap()
 				f.seek(ofsbuf[j][i]+8);
 				// read height values ^_^
 
-				/*
-				short *sp = tilebuf;
-				for (int z=0; z<33; z++) {
-					f.read(sp, 2 * ( (z%2) ? 16 : 17 ));
-					sp += 17;
-				}*/
 				/*
 				fucking win. in the .adt files, height maps are stored in 9-8-9-8-... interleaved order.
 				here, apparently, a 17x17 map is stored followed by a 16x16 map.
 				yay for consistency.
-				I'm only using the 17x17 map here.
+				The minimap only uses the 17x17 map.
 				*/
-				f.read(tilebuf,17*17*2);
+				lowresindex[j][i] = nLowres++;
+				wdlheights.resize(nLowres * lowresbufsize);
+				short *tilebuf = &wdlheights[lowresindex[j][i] * lowresbufsize];
+				f.read(tilebuf, lowresbufsize*2);
 
 				// make minimap
 				// for a 512x512 minimap texture, and 64x64 tiles, one tile is 8x8 pixels
@@ -145,63 +270,7 @@ void World::initMinimap()
 
 						// make rgb from height value
 						unsigned char r,g,b;
-						if (hval < 0) {
-							// water = blue
-							if (hval < -511) hval = -511;
-							hval /= -2;
-							r = g = 0;
-							b = 255 - hval;
-						} else {
-							// above water = should apply a palette :(
-							/*
-							float fh = hval / 1600.0f;
-							if (fh > 1.0f) fh = 1.0f;
-							unsigned char c = (unsigned char) (fh * 255.0f);
-							r = g = b = c;
-							*/
-
-							// green: 20,149,7		0-600
-							// brown: 137, 84, 21	600-1200
-							// gray: 96, 96, 96		1200-1600
-							// white: 255, 255, 255
-							unsigned char r1,r2,g1,g2,b1,b2;
-							float t;
-
-							if (hval < 600) {
-								r1 = 20;
-								r2 = 137;
-								g1 = 149;
-								g2 = 84;
-								b1 = 7;
-								b2 = 21;
-								t = hval / 600.0f;
-							}
-							else if (hval < 1200) {
-								r2 = 96;
-								r1 = 137;
-								g2 = 96;
-								g1 = 84;
-								b2 = 96;
-								b1 = 21;
-								t = (hval-600) / 600.0f;
-							}
-							else /*if (hval < 1600)*/ {
-								r1 = 96;
-								r2 = 255;
-								g1 = 96;
-								g2 = 255;
-								b1 = 96;
-								b2 = 255;
-								if (hval >= 1600) hval = 1599;
-								t = (hval-1200) / 600.0f;
-							}
-
-							// TODO: add a regular palette here
-
-							r = (unsigned char)(r2*t + r1*(1.0f-t));
-							g = (unsigned char)(g2*t + g1*(1.0f-t));
-							b = (unsigned char)(b2*t + b1*(1.0f-t));
-						}
+						heightColor(hval, r, g, b);
 
 						texbuf[(j*8+z)*512 + i*8+x] = (r) | (g<<8) | (b<<16) | (255 << 24);
 					}
@@ -210,6 +279,16 @@ void World::initMinimap()
 		}
 	}
 	
+	// the finest height step that holds all of the map's terrain, with some room for peaks
+	// between the WDL's samples
+	int hmax = 0;
+	for (size_t k=0; k<wdlheights.size(); k++) {
+		int h = abs(wdlheights[k]);
+		if (h > hmax) hmax = h;
+	}
+	terrainstep = TERRAIN_QUANT;
+	while ((hmax + 256) / terrainstep > 32767.0f) terrainstep *= 2.0f;
+
 	/*
 	// TEMP - draw sky areas
 	skies = new Skies(basename.c_str());
@@ -229,70 +308,119 @@ void World::initMinimap()
 
 void World::initLowresTerrain()
 {
-	char fn[256];
-	sprintf(fn,"World\\Maps\\%s\\%s.wdl", basename.c_str(), basename.c_str());
-	short tilebuf[17*17];
-	short tilebuf2[16*16];
-	Vec3D lowres[17][17];
-	Vec3D lowsub[16][16];
-	int ofsbuf[64][64];
+	// all low-res tiles go into one vertex buffer, 17x17 outer + 16x16 inner vertices per tile,
+	// and share a single index buffer
+	if (nLowres == 0) return;
 
-	MPQFile f(fn);
-	f.seek(0x14);
-	f.read(ofsbuf,64*64*4);
+	vector<Vec3D> verts(nLowres * lowresbufsize);
+	lowresmin.resize(nLowres);
+	lowresmax.resize(nLowres);
 
 	for (int j=0; j<64; j++) {
 		for (int i=0; i<64; i++) {
-			if (ofsbuf[j][i]) {
-				f.seek(ofsbuf[j][i]+8);
-				f.read(tilebuf,17*17*2);
-				f.read(tilebuf2,16*16*2);
-			
-				for (int y=0; y<17; y++) {
-					for (int x=0; x<17; x++) {
-						lowres[y][x] = Vec3D(TILESIZE*(i+x/16.0f), tilebuf[y*17+x], TILESIZE*(j+y/16.0f));
-					}
-				}
-				for (int y=0; y<16; y++) {
-					for (int x=0; x<16; x++) {
-						lowsub[y][x] = Vec3D(TILESIZE*(i+(x+0.5f)/16.0f), tilebuf2[y*16+x], TILESIZE*(j+(y+0.5f)/16.0f));
-					}
+			int idx = lowresindex[j][i];
+			if (idx < 0) continue;
+
+			short *tilebuf = &wdlheights[idx * lowresbufsize];
+			short *tilebuf2 = tilebuf + 17*17;
+			Vec3D *v = &verts[idx * lowresbufsize];
+			Vec3D vmin( 9999999.0f, 9999999.0f, 9999999.0f);
+			Vec3D vmax(-9999999.0f,-9999999.0f,-9999999.0f);
+
+			for (int y=0; y<17; y++) {
+				for (int x=0; x<17; x++) {
+					*v++ = Vec3D(TILESIZE*(i+x/16.0f), tilebuf[y*17+x], TILESIZE*(j+y/16.0f));
 				}
-
-				GLuint dl;
-				dl = glGenLists(1);
-				glNewList(dl, GL_COMPILE);
-				/*
-				// draw tiles 16x16?
-				glBegin(GL_TRIANGLE_STRIP);
-				for (int y=0; y<16; y++) {
-					// end jump
-					if (y>0) glVertex3fv(lowres[y][0]);
-					for (int x=0; x<17; x++) {
-                        glVertex3fv(lowres[y][x]);
-                        glVertex3fv(lowres[y+1][x]);
-					}
-                    // start jump
-					if (y<15) glVertex3fv(lowres[y+1][16]);
-				}
-				glEnd();
-				*/
-				// draw tiles 17*17+16*16
-				glBegin(GL_TRIANGLES);
-				for (int y=0; y<16; y++) {
-					for (int x=0; x<16; x++) {
-						glVertex3fv(lowres[y][x]);		glVertex3fv(lowsub[y][x]);	glVertex3fv(lowres[y][x+1]);
-						glVertex3fv(lowres[y][x+1]);	glVertex3fv(lowsub[y][x]);	glVertex3fv(lowres[y+1][x+1]);
-						glVertex3fv(lowres[y+1][x+1]);	glVertex3fv(lowsub[y][x]);	glVertex3fv(lowres[y+1][x]);
-						glVertex3fv(lowres[y+1][x]);	glVertex3fv(lowsub[y][x]);	glVertex3fv(lowres[y][x]);
-					}
+			}
+			for (int y=0; y<16; y++) {
+				for (int x=0; x<16; x++) {
+					*v++ = Vec3D(TILESIZE*(i+(x+0.5f)/16.0f), tilebuf2[y*16+x], TILESIZE*(j+(y+0.5f)/16.0f));
 				}
-				glEnd();
-				glEndList();
-				lowrestiles[j][i] = dl;
 			}
+			for (int k=0; k<lowresbufsize; k++) {
+				float h = verts[idx * lowresbufsize + k].y;
+				if (h < vmin.y) vmin.y = h;
+				if (h > vmax.y) vmax.y = h;
+			}
+			vmin.x = TILESIZE * i;
+			vmin.z = TILESIZE * j;
+			vmax.x = TILESIZE * (i+1);
+			vmax.z = TILESIZE * (j+1);
+			lowresmin[idx] = vmin;
+			lowresmax[idx] = vmax;
+		}
+	}
+
+	// four triangles around the inner vertex of every cell
+	unsigned short indices[lowresindices], *p = indices;
+	for (int y=0; y<16; y++) {
+		for (int x=0; x<16; x++) {
+			unsigned short a = y*17+x, b = a+1, c = (y+1)*17+x+1, d = (y+1)*17+x, m = 17*17 + y*16+x;
+			*p++ = a;	*p++ = m;	*p++ = b;
+			*p++ = b;	*p++ = m;	*p++ = c;
+			*p++ = c;	*p++ = m;	*p++ = d;
+			*p++ = d;	*p++ = m;	*p++ = a;
+		}
+	}
+
+	glGenBuffersARB(1, &lowresvbo);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, lowresvbo);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, verts.size()*sizeof(Vec3D), &verts[0], GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+	glGenBuffersARB(1, &lowresibo);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, lowresibo);
+	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, sizeof(indices), indices, GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+
+	horizon = new Horizon(&wdlheights[0], lowresindex);
+
+	// heights are on the card now
+	vector<short>().swap(wdlheights);
+}
+
+void World::drawHorizon()
+{
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+	glDisable(GL_LIGHTING);
+	horizon->draw(camera);
+	// the near terrain goes on top with its own depth range
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glColor4f(1,1,1,1);
+}
+
+void World::drawLowresTerrain()
+{
+	if (!lowresvbo) return;
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glClientActiveTextureARB(GL_TEXTURE1_ARB);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glClientActiveTextureARB(GL_TEXTURE0_ARB);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, lowresvbo);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, lowresibo);
+
+	const int lrr = lowresradius > tileradius ? lowresradius : tileradius + 1;
+	for (int j=cz-lrr; j<=cz+lrr; j++) {
+		for (int i=cx-lrr; i<=cx+lrr; i++) {
+			// TODO: some annoying visual artifacts when the verylowres terrain overlaps
+			// maptiles that are close (1-off) - figure out how to fix.
+			// still less annoying than hoels in the horizon when only 2-off verylowres tiles are drawn
+			if ((i==cx && j==cz) || !oktile(i,j)) continue;
+			int idx = lowresindex[j][i];
+			if (idx < 0 || !frustum.intersects(lowresmin[idx], lowresmax[idx])) continue;
+
+			glVertexPointer(3, GL_FLOAT, 0, (GLvoid*)(idx * lowresbufsize * sizeof(Vec3D)));
+			glDrawElements(GL_TRIANGLES, lowresindices, GL_UNSIGNED_SHORT, 0);
 		}
 	}
+
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 }
 
 GLuint gdetailtexcoords=0, galphatexcoords=0;
@@ -303,11 +431,13 @@ void initGlobalVBOs()
 
 		GLuint detailtexcoords, alphatexcoords;
 
-		Vec2D temp[mapbufsize], *vt;
+		// the same coordinates for every chunk of a tile vertex buffer
+		vector<Vec2D> temp(256 * mapbufsize);
+		Vec2D *vt;
 		float tx,ty;
 		
 		// init texture coordinates for detail map:
-		vt = temp;
+		vt = &temp[0];
 		const float detail_half = 0.5f * detail_size / 8.0f;
 		for (int j=0; j<17; j++) {
 			for (int i=0; i<((j%2)?8:9); i++) {
@@ -323,10 +453,11 @@ void initGlobalVBOs()
 
 		glGenBuffersARB(1, &detailtexcoords);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, detailtexcoords);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, mapbufsize*2*sizeof(float), temp, GL_STATIC_DRAW_ARB);
+		for (int k=1; k<256; k++) copy(temp.begin(), temp.begin() + mapbufsize, temp.begin() + k*mapbufsize);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, temp.size()*sizeof(Vec2D), &temp[0], GL_STATIC_DRAW_ARB);
 
 		// init texture coordinates for alpha map:
-		vt = temp;
+		vt = &temp[0];
 		const float alpha_half = 0.5f * 1.0f / 8.0f;
 		for (int j=0; j<17; j++) {
 			for (int i=0; i<((j%2)?8:9); i++) {
@@ -340,9 +471,18 @@ void initGlobalVBOs()
 			}
 		}
 
+		// moved into each slot's cell of the tile's 1024x1024 alpha atlas, half a texel in
+		// so the filter doesn't reach into the neighbouring cell
+		for (int k=255; k>=0; k--) {
+			float cx = (k%16) * 64.0f + 0.5f, cz = (k/16) * 64.0f + 0.5f;
+			for (int n=0; n<mapbufsize; n++) {
+				temp[k*mapbufsize + n] = Vec2D((cx + temp[n].x * 63.0f) / 1024.0f, (cz + temp[n].y * 63.0f) / 1024.0f);
+			}
+		}
+
 		glGenBuffersARB(1, &alphatexcoords);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, alphatexcoords);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, mapbufsize*2*sizeof(float), temp, GL_STATIC_DRAW_ARB);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, temp.size()*sizeof(Vec2D), &temp[0], GL_STATIC_DRAW_ARB);
 
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
@@ -354,6 +494,66 @@ void initGlobalVBOs()
 }
 
 
+// terrain splatting: lighting, fog and texture env of the fixed function passes, in one go
+static const char *terrainvs =
+	"varying vec2 detailcoord, alphacoord;\n"
+	"varying vec3 light;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = ftransform();\n"
+	"	vec3 n = normalize(gl_NormalMatrix * gl_Normal);\n"
+	"	float d = max(dot(n, normalize(gl_LightSource[0].position.xyz)), 0.0);\n"
+	"	light = min(gl_LightModel.ambient.rgb + gl_LightSource[0].diffuse.rgb * d, 1.0);\n"
+	"	detailcoord = gl_MultiTexCoord0.st;\n"
+	"	alphacoord = gl_MultiTexCoord1.st;\n"
+	"	gl_FogFragCoord = abs((gl_ModelViewMatrix * gl_Vertex).z);\n"
+	"}\n";
+
+static const char *terrainfs =
+	"uniform sampler2D layer0, layer1, layer2, layer3, splat;\n"
+	"uniform int layers;\n"
+	"uniform vec2 anim[4];\n"
+	"uniform vec3 shadowcolor;\n"
+	"uniform float fog;\n"
+	"varying vec2 detailcoord, alphacoord;\n"
+	"varying vec3 light;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 a = texture2D(splat, alphacoord);\n"
+	"	vec3 c = texture2D(layer0, detailcoord + anim[0]).rgb;\n"
+	"	vec4 t;\n"
+	"	if (layers > 1) { t = texture2D(layer1, detailcoord + anim[1]); c = mix(c, t.rgb, t.a * a.r); }\n"
+	"	if (layers > 2) { t = texture2D(layer2, detailcoord + anim[2]); c = mix(c, t.rgb, t.a * a.g); }\n"
+	"	if (layers > 3) { t = texture2D(layer3, detailcoord + anim[3]); c = mix(c, t.rgb, t.a * a.b); }\n"
+	"	c = mix(c * light, shadowcolor, a.a);\n"
+	"	float f = clamp((gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale, 0.0, 1.0);\n"
+	"	gl_FragColor = vec4(mix(gl_Fog.color.rgb, c, mix(1.0, f, fog)), 1.0);\n"
+	"}\n";
+
+void World::initTerrainShader()
+{
+	terrainshader = new Shader(terrainvs, terrainfs);
+	if (!terrainshader->ok) {
+		gLog("Terrain shader not available, using texture passes\n");
+		delete terrainshader;
+		terrainshader = 0;
+		return;
+	}
+
+	terrainshader->use();
+	glUniform1iARB(terrainshader->uniform("layer0"), 0);
+	glUniform1iARB(terrainshader->uniform("layer1"), 1);
+	glUniform1iARB(terrainshader->uniform("layer2"), 2);
+	glUniform1iARB(terrainshader->uniform("layer3"), 3);
+	glUniform1iARB(terrainshader->uniform("splat"), 4);
+	terrainlayers = terrainshader->uniform("layers");
+	terrainanim = terrainshader->uniform("anim");
+	terrainshadow = terrainshader->uniform("shadowcolor");
+	terrainfog = terrainshader->uniform("fog");
+	Shader::unuse();
+	gLog("Terrain shader: one pass per chunk\n");
+}
+
 void World::initDisplay()
 {
 	// temp code until I figure out water properly
@@ -372,17 +572,41 @@ void World::initDisplay()
 	stripify2<short>(defstrip, mapstrip2);
 	delete[] defstrip;
 
+	stripindices.resize(256 * (stripsize + stripsize2));
+	strip2ofs = 256 * stripsize;
+	for (int k=0; k<256; k++) {
+		for (int i=0; i<stripsize; i++) stripindices[k*stripsize + i] = k*mapbufsize + mapstrip[i];
+		for (int i=0; i<stripsize2; i++) stripindices[strip2ofs + k*stripsize2 + i] = k*mapbufsize + mapstrip2[i];
+	}
+	// room for the hole strips to come
+	stripibosize = stripindices.size() * 2;
+	glGenBuffersARB(1, &stripibo);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, stripibo);
+	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, stripibosize * sizeof(unsigned short), 0, GL_STATIC_DRAW_ARB);
+	glBufferSubDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0, stripindices.size() * sizeof(unsigned short), &stripindices[0]);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+
 	initGlobalVBOs();
 	detailtexcoords = gdetailtexcoords;
 	alphatexcoords = galphatexcoords;
 
+	if (gUseShaders) initTerrainShader();
+
+	// per tile: 256 chunks of mapbufsize vertices, fetched again for every texture pass drawn
+	int oldkb = (int)(256 * mapbufsize * 2 * sizeof(Vec3D) / 1024), newkb = (int)(256 * mapbufsize * sizeof(MapVertex) / 1024);
+	gLog("Terrain vertices: %d bytes each, %d KB per tile instead of %d KB as float arrays, %d KB less per tile and texture pass drawn\n",
+		(int)sizeof(MapVertex), newkb, oldkb, oldkb - newkb);
+
 	highresdistance = 384.0f;
-	mapdrawdistance = 998.0f;
 	modeldrawdistance = 384.0f;
 	doodaddrawdistance = 64.0f;
+	setTileRadius(tileradius, circularwindow);
+	setLowresRadius(lowresradius);
 
 	oob = false;
 
+	if (nMaps > 0 && prefetchtime > 0) loader = new TileLoader(basename);
+
 	if (gnWMO > 0) initWMOs();
 
 	skies = new Skies(basename.c_str(), gnWMO==0);
@@ -433,10 +657,10 @@ void World::initWMOs()
 			// global wmo instance data
 			gnWMO = (int)size / 64;
 			for (int i=0; i<gnWMO; i++) {
-				int id;
-				f.read(&id, 4);
-				WMO *wmo = (WMO*)wmomanager.items[wmomanager.get(gwmos[id])];
-				WMOInstance inst(wmo, f);
+				WMOPlacement p;
+				f.read(&p, sizeof(WMOPlacement));
+				WMO *wmo = (WMO*)wmomanager.items[wmomanager.get(gwmos[p.nameid])];
+				WMOInstance inst(wmo, p);
 				gwmois.push_back(inst);
 			}
 		}
@@ -447,14 +671,25 @@ void World::initWMOs()
 
 World::~World()
 {
-	for (int j=0; j<64; j++) {
-		for (int i=0; i<64; i++) {
-			if (lowrestiles[j][i]!=0) glDeleteLists(lowrestiles[j][i],1);
-		}
+	if (horizon) delete horizon;
+	delete occlusion;
+	delete skyline;
+	delete renderqueue;
+	if (lowresvbo) glDeleteBuffersARB(1, &lowresvbo);
+	if (lowresibo) glDeleteBuffersARB(1, &lowresibo);
+
+	// stop the loader before the tiles go away
+	if (loader) delete loader;
+
+	for (vector<MapTile*>::iterator it = uploadqueue.begin(); it != uploadqueue.end(); ++it) {
+		delete *it;
 	}
 
-	for (int i=0; i<MAPTILECACHESIZE; i++) {
-		if (maptilecache[i] != 0) delete maptilecache[i];
+	for (map<int, MapTile*>::iterator it = maptilecache.begin(); it != maptilecache.end(); ++it) {
+		delete it->second;
+	}
+	for (map<string, bool>::iterator it = preloaded.begin(); it != preloaded.end(); ++it) {
+		releasePreload(it->first, it->second);
 	}
 
 	for (vector<string>::iterator it = gwmos.begin(); it != gwmos.end(); ++it) {
@@ -471,15 +706,12 @@ World::~World()
 
 	if (mapstrip) delete[] mapstrip;
 	if (mapstrip2) delete[] mapstrip2;
+	if (stripibo) glDeleteBuffersARB(1, &stripibo);
+	if (terrainshader) delete terrainshader;
 
 	gLog("Unloaded world %s\n", basename.c_str());
 }
 
-bool oktile(int i, int j)
-{
-	return i>=0 && j >= 0 && i<64 && j<64;
-}
-
 void World::enterTile(int x, int z)
 {
 	if (!oktile(x,z)) {
@@ -489,14 +721,24 @@ void World::enterTile(int x, int z)
 
 	cx = x;
 	cz = z;
-	for (int j=0; j<3; j++) {
-		for (int i=0; i<3; i++) {
-			current[j][i] = loadTile(x-1+i, z-1+j);
+	unsigned int now = SDL_GetTicks();
+	current.clear();
+	curtile = 0;
+	for (int j=z-tileradius; j<=z+tileradius; j++) {
+		for (int i=x-tileradius; i<=x+tileradius; i++) {
+			if (!inWindow(i-x, j-z)) continue;
+			MapTile *tile = loadTile(i, j);
+			if (tile == 0) continue;
+			tile->lastused = now;
+			current.push_back(tile);
+			if (i==x && j==z) curtile = tile;
 		}
 	}
-	if (autoheight && current[1][1]!=0 && current[1][1]->ok) {
-		//Vec3D vc = (current[1][1]->topnode.vmax + current[1][1]->topnode.vmin) * 0.5f;
-		Vec3D vc = current[1][1]->topnode.vmax;
+	trimTileCache();
+
+	if (autoheight && curtile!=0 && curtile->ok) {
+		//Vec3D vc = (curtile->topnode.vmax + curtile->topnode.vmin) * 0.5f;
+		Vec3D vc = curtile->topnode.vmax;
 		if (vc.y < 0) vc.y = 0;
 		camera.y = vc.y + 50.0f;
 
@@ -504,6 +746,353 @@ void World::enterTile(int x, int z)
 	}
 }
 
+bool World::inWindow(int dx, int dz)
+{
+	if (abs(dx) > tileradius || abs(dz) > tileradius) return false;
+	if (!circularwindow) return true;
+	float r = tileradius + 0.5f;
+	return dx*dx + dz*dz <= r*r;
+}
+
+void World::setTileRadius(int r, bool circular)
+{
+	if (r < 1) r = 1;
+	if (r > 16) r = 16;
+	tileradius = r;
+	circularwindow = circular;
+
+	// push the draw distance and far plane out along with the window
+	mapdrawdistance = 998.0f + (r-1) * TILESIZE;
+	updateFarClip();
+
+	int n = 0;
+	for (int j=-r; j<=r; j++) {
+		for (int i=-r; i<=r; i++) {
+			if (inWindow(i,j)) n++;
+		}
+	}
+	gLog("Tile window: radius %d, %s, %d tiles\n", r, circular ? "circular" : "square", n);
+}
+
+// chunks of a quadtree node in view, the way the tiles used to cull
+static int walkNodes(MapNode *n, const Frustum &frustum)
+{
+	if (!frustum.intersects(n->vmin, n->vmax)) return 0;
+	if (n->size == 0) return 1;
+	int count = 0;
+	for (int i=0; i<4; i++) count += walkNodes(n->children[i], frustum);
+	return count;
+}
+
+void World::benchmarkCulling()
+{
+	// cull the chunks of the tile window against the current view a number of times each way
+	const int runs = 1000;
+	MapChunk *inview[chunkboundsize];
+	vector<MapTile*> tiles;
+	for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+		if ((*it)->ok && (*it)->uploaded) tiles.push_back(*it);
+	}
+	int chunks = (int)tiles.size() * chunkboundsize;
+	if (!chunks) return;
+
+	int visible[3] = {0, 0, 0};
+	unsigned int times[3];
+	for (int method=0; method<3; method++) {
+		unsigned int t0 = SDL_GetTicks();
+		for (int r=0; r<runs; r++) {
+			int n = 0;
+			for (size_t i=0; i<tiles.size(); i++) {
+				if (method == 0) n += walkNodes(&tiles[i]->topnode, frustum);
+				else if (method == 1) n += tiles[i]->bounds.cullScalar(frustum, inview);
+				else n += tiles[i]->bounds.cull(frustum, inview);
+			}
+			visible[method] = n;
+		}
+		times[method] = SDL_GetTicks() - t0;
+	}
+
+	gLog("Culling %d chunks, %d runs:\n", chunks, runs);
+	const char *names[3] = {"quadtree", "flat", "flat sse"};
+	for (int method=0; method<3; method++) {
+		gLog("  %-10s %.1f us/frame, %d in view\n", names[method], times[method] * 1000.0f / runs, visible[method]);
+	}
+
+	// the model instances, each on its own by sphere and by box, and through the grid cells
+	int doodads = 0, cells = 0;
+	for (size_t i=0; i<tiles.size(); i++) {
+		doodads += tiles[i]->nMDX;
+		cells += tiles[i]->doodads.size();
+	}
+	const DoodadCell *cellsinview[DOODADGRID_SIZE*DOODADGRID_SIZE];
+	for (int method=0; method<3; method++) {
+		unsigned int t0 = SDL_GetTicks();
+		for (int r=0; r<runs; r++) {
+			int n = 0;
+			for (size_t i=0; i<tiles.size(); i++) {
+				MapTile *tile = tiles[i];
+				if (method < 2) {
+					for (int k=0; k<tile->nMDX; k++) {
+						ModelInstance &mi = tile->modelis[k];
+						if ((mi.pos - camera).length() - mi.model->rad > modeldrawdistance) continue;
+						if (method == 0 ? frustum.intersectsSphere(mi.pos, mi.model->rad*mi.sc)
+							: frustum.intersects(mi.vmin, mi.vmax)) n++;
+					}
+				} else {
+					int nc = tile->doodads.cull(frustum, camera, modeldrawdistance, cellsinview);
+					for (int c=0; c<nc; c++) {
+						for (int k=cellsinview[c]->first; k<cellsinview[c]->first+cellsinview[c]->count; k++) {
+							ModelInstance &mi = tile->modelis[k];
+							if ((mi.pos - camera).length() - mi.model->rad > modeldrawdistance) continue;
+							if (frustum.intersects(mi.vmin, mi.vmax)) n++;
+						}
+					}
+				}
+			}
+			visible[method] = n;
+		}
+		times[method] = SDL_GetTicks() - t0;
+	}
+	gLog("Culling %d doodads in %d cells, %d runs:\n", doodads, cells, runs);
+	const char *dnames[3] = {"spheres", "boxes", "grid"};
+	for (int method=0; method<3; method++) {
+		gLog("  %-10s %.1f us/frame, %d in view\n", dnames[method], times[method] * 1000.0f / runs, visible[method]);
+	}
+}
+
+void World::setLowresRadius(int r)
+{
+	if (r < 0) r = 0;
+	if (r > 63) r = 63;
+	lowresradius = r;
+	updateFarClip();
+}
+
+void World::updateFarClip()
+{
+	// far enough for the high detail window and the low-res ring, whichever reaches further; the ring
+	// goes lrr tiles out from the edges of the camera's tile, so its far edge is a tile beyond that
+	float farclip = 1024.0f + (tileradius-1) * TILESIZE;
+	const int lrr = lowresradius > tileradius ? lowresradius : tileradius + 1;
+	if ((lrr+1) * TILESIZE > farclip) farclip = (lrr+1) * TILESIZE;
+	video.farclip = farclip;
+}
+
+int World::holeStrip(int holes, int slot, int &len)
+{
+	// strips of chunks with holes are shared by every chunk with the same holes in the same slot
+	int key = (holes << 8) | slot;
+	map<int, pair<int,int> >::iterator it = holestrips.find(key);
+	if (it != holestrips.end()) {
+		len = it->second.second;
+		return it->second.first;
+	}
+
+	unsigned short s[256];
+	len = makeHoleStrip(holes, slot * mapbufsize, s);
+	int ofs = addStrip(s, len);
+	holestrips[key] = make_pair(ofs, len);
+	return ofs;
+}
+
+int World::lodStrip(int lod, int stitch, int slot, int &len)
+{
+	int key = (lod << 12) | (stitch << 8) | slot;
+	map<int, pair<int,int> >::iterator it = lodstrips.find(key);
+	if (it != lodstrips.end()) {
+		len = it->second.second;
+		return it->second.first;
+	}
+
+	unsigned short s[216];
+	len = makeLODTris(lod, stitch, slot * mapbufsize, s);
+	int ofs = addStrip(s, len);
+	lodstrips[key] = make_pair(ofs, len);
+	return ofs;
+}
+
+int World::addStrip(const unsigned short *s, int len)
+{
+	// appends to the terrain index buffer; called while uploading as well as in the middle of
+	// drawing the terrain, so whatever was bound stays bound
+	int ofs = (int)stripindices.size();
+	stripindices.insert(stripindices.end(), s, s + len);
+
+	GLint bound;
+	glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING_ARB, &bound);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, stripibo);
+	if (stripindices.size() > stripibosize) {
+		// out of room, start over with twice the size
+		stripibosize *= 2;
+		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, stripibosize * sizeof(unsigned short), 0, GL_STATIC_DRAW_ARB);
+		glBufferSubDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0, stripindices.size() * sizeof(unsigned short), &stripindices[0]);
+	} else {
+		glBufferSubDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, ofs * sizeof(unsigned short), len * sizeof(unsigned short), s);
+	}
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, bound);
+	return ofs;
+}
+
+void World::cullTerrain()
+{
+	// decides what gets drawn this frame before any of it is: the terrain levels first, the
+	// culling picks each chunk's strip; the chunk lists it makes serve the water passes too
+	uselowlod = drawfog;
+	terraintris = terrainfulltris = 0;
+	if (drawterrain) {
+		selectTerrainLOD();
+		for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+			(*it)->cull();
+		}
+	}
+	underground = cameraUnderground();
+	updateSkyline();
+	updateOcclusion();
+
+	// then drop the hidden chunks from the lists
+	if (drawterrain && (skyline->enabled || occlusion->enabled)) {
+		for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+			(*it)->occlusionCull();
+		}
+	}
+}
+
+int *World::wmoStamp(int id)
+{
+	// map entries stay put, so the instances can keep the pointer
+	std::map<int, int>::iterator it = wmoframes.find(id);
+	if (it == wmoframes.end()) it = wmoframes.insert(std::make_pair(id, -1)).first;
+	return &it->second;
+}
+
+bool World::cameraUnderground()
+{
+	// the chunk under the camera, if its tile is up yet
+	for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+		MapTile *tile = *it;
+		if (!tile->uploaded || camera.x < tile->xbase || camera.x >= tile->xbase + TILESIZE
+			|| camera.z < tile->zbase || camera.z >= tile->zbase + TILESIZE) continue;
+		int i = (int)((camera.x - tile->xbase) / CHUNKSIZE), j = (int)((camera.z - tile->zbase) / CHUNKSIZE);
+		if (i > 15) i = 15;
+		if (j > 15) j = 15;
+		return tile->chunks[j][i].underground(camera);
+	}
+	return false;
+}
+
+void World::updateSkyline()
+{
+	skyline->begin(camera);
+	// from under the ground its slopes would hide what's down there with the camera
+	if (!skyline->enabled || !drawterrain || underground) return;
+
+	// the whole of every tile in view, ground off to the side still hides what's behind it
+	for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+		for (int j=0; j<16; j++) {
+			for (int i=0; i<16; i++) {
+				MapChunk *c = &(*it)->chunks[j][i];
+				float dist = (camera - c->vcenter).length() - c->r;
+				c->addGround(skyline, dist < SKYLINE_FINEDIST);
+			}
+		}
+	}
+	skyline->build();
+}
+
+void World::updateOcclusion()
+{
+	occlusion->begin();
+	if (!occlusion->enabled) return;
+
+	// the terrain in view occludes (unless the camera is under it), and the big outdoor parts
+	// of the WMOs around
+	if (drawterrain && !underground) {
+		for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+			vector<MapChunk*> &chunks = (*it)->drawchunks;
+			for (vector<MapChunk*>::iterator c = chunks.begin(); c != chunks.end(); ++c) {
+				float dist = (camera - (*c)->vcenter).length() - (*c)->r;
+				(*c)->addOccluder(occlusion, dist < OCCLUSION_FINEDIST);
+			}
+		}
+	}
+	if (drawwmo) {
+		// instances reaching into several tiles are listed in each of them
+		set<int> ids;
+		for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+			MapTile *tile = *it;
+			for (int i=0; i<tile->nWMO; i++) {
+				if (ids.insert(tile->wmois[i].id).second) tile->wmois[i].addOccluders(occlusion);
+			}
+		}
+	}
+	occlusion->rasterize();
+}
+
+void World::selectTerrainLOD()
+{
+	// pixels per unit of height error at distance 1, for the 45 degree field of view
+	const float pixels = video.yres / (2.0f * tanf(22.5f * PI / 180.0f));
+
+	lodframe++;
+	vector<MapChunk*> chunks;
+	for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+		for (int j=0; j<16; j++) {
+			for (int i=0; i<16; i++) {
+				MapChunk *c = &(*it)->chunks[j][i];
+				float dist = (camera - c->vcenter).length() - c->r;
+				if (dist < 1.0f) dist = 1.0f;
+				float scale = pixels / dist;
+
+				int lod = 1;
+				if (!c->hasholes) {
+					lod = TERRAIN_LODS-1;
+					while (lod > 1 && c->loderror[lod] * scale >= lodpixels) lod--;
+					if (lod == 1 && drawhighres && c->loderror[1] * scale >= lodpixels) lod = 0;
+				}
+				c->lod = lod;
+				c->lodframe = lodframe;
+				chunks.push_back(c);
+			}
+		}
+	}
+
+	// the stitched edges only bridge one level, refine chunks that are further off than that
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (vector<MapChunk*>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+			MapChunk *c = *it;
+			for (int side=0; side<4; side++) {
+				MapChunk *n = terrainNeighbour(c, side);
+				if (n && lodEdge(c->lod) > lodEdge(n->lod) + 1) {
+					c->lod = lodEdge(n->lod) + 1;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+MapChunk *World::terrainNeighbour(MapChunk *c, int side)
+{
+	// sides are -z, +z, -x, +x; 0 if the neighbour got no level this frame
+	int i = c->slot % 16 + (side == 2 ? -1 : side == 3 ? 1 : 0);
+	int j = c->slot / 16 + (side == 0 ? -1 : side == 1 ? 1 : 0);
+	MapTile *tile = c->mt;
+	if (i < 0 || i > 15 || j < 0 || j > 15) {
+		int x = tile->x + (i < 0 ? -1 : i > 15 ? 1 : 0);
+		int z = tile->z + (j < 0 ? -1 : j > 15 ? 1 : 0);
+		if (!oktile(x,z)) return 0;
+		map<int, MapTile*>::iterator it = maptilecache.find(z*64+x);
+		if (it == maptilecache.end() || !it->second->uploaded) return 0;
+		tile = it->second;
+		i &= 15;
+		j &= 15;
+	}
+	MapChunk *n = &tile->chunks[j][i];
+	return n->lodframe == lodframe ? n : 0;
+}
+
 MapTile *World::loadTile(int x, int z)
 {
 	if (!oktile(x,z) || !maps[z][x]) {
@@ -511,37 +1100,226 @@ MapTile *World::loadTile(int x, int z)
 		return 0;
 	}
 
-	int firstnull = MAPTILECACHESIZE;
-	for (int i=0; i<MAPTILECACHESIZE; i++) {
-		if ((maptilecache[i] != 0)  && (maptilecache[i]->x == x) && (maptilecache[i]->z == z)) {
-            return maptilecache[i];
+	map<int, MapTile*>::iterator it = maptilecache.find(z*64+x);
+	if (it != maptilecache.end()) {
+		if (it->second->prefetched) {
+			it->second->prefetched = false;
+			stallsprevented++;
 		}
-		if (maptilecache[i] == 0 && i < firstnull) firstnull = i;
+		return it->second;
 	}
-	// ok we need to find a place in the cache
-	if (firstnull == MAPTILECACHESIZE) {
-		int score, maxscore = 0, maxidx = 0;
-		// oh shit we need to throw away a tile
-		for (int i=0; i<MAPTILECACHESIZE; i++) {
-			score = abs(maptilecache[i]->x - cx) + abs(maptilecache[i]->z - cz);
-			if (score>maxscore) {
-				maxscore = score;
-				maxidx = i;
-			}
+
+	// halfway uploaded: finish it now
+	for (vector<MapTile*>::iterator it = uploadqueue.begin(); it != uploadqueue.end(); ++it) {
+		if ((*it)->x == x && (*it)->z == z) {
+			MapTile *tile = *it;
+			uploadqueue.erase(it);
+			stallsprevented++;
+			addTile(tile);
+			return tile;
 		}
+	}
 
-		// maxidx is the winner (loser)
-		delete maptilecache[maxidx];
-		firstnull = maxidx;
+	// not there yet: take it from the loader if it has it, otherwise load it right here
+	MapTile *tile = 0;
+	bool waited = false;
+	if (loader) tile = loader->take(x, z, waited);
+	if (tile && !waited) stallsprevented++;
+	else tilestalls++;
+
+	if (!tile) {
+		char name[256];
+		sprintf(name,"World\\Maps\\%s\\%s_%d_%d.adt", basename.c_str(), basename.c_str(), x, z);
+		tile = new MapTile(x,z,name);
 	}
+	addTile(tile);
+	return tile;
+}
+
+void World::addTile(MapTile *tile)
+{
+	tile->upload();
+	tile->lastused = SDL_GetTicks();
+	maptilecache[tile->z*64+tile->x] = tile;
+	tilecachebytes += tile->cpubytes + tile->gpubytes;
+}
+
+bool World::tileLoaded(int x, int z)
+{
+	// in the cache or on its way there
+	if (maptilecache.find(z*64+x) != maptilecache.end()) return true;
+	for (vector<MapTile*>::iterator it = uploadqueue.begin(); it != uploadqueue.end(); ++it) {
+		if ((*it)->x == x && (*it)->z == z) return true;
+	}
+	return false;
+}
+
+void World::uploadTiles()
+{
+	// spend at most the configured time/bytes per frame, but always make some progress
+	unsigned int start = SDL_GetTicks();
+	size_t bytes = 0;
+	bool added = false;
+	while (!uploadqueue.empty()) {
+		MapTile *tile = uploadqueue.front();
+		if (tile->uploadStep(bytes)) {
+			uploadqueue.erase(uploadqueue.begin());
+			tile->prefetched = true;
+			addTile(tile);
+			tilesprefetched++;
+			added = true;
+		}
+		if (SDL_GetTicks() - start >= uploadtimebudget || bytes >= uploadbytebudget) break;
+	}
+	if (added) trimTileCache();
+
+	// whatever is left goes to the models and WMOs of the tiles still to come
+	while (!preloadqueue.empty() && SDL_GetTicks() - start < uploadtimebudget && bytes < uploadbytebudget) {
+		pair<string, bool> p = preloadqueue.front();
+		preloadqueue.erase(preloadqueue.begin());
+		if (p.second) wmomanager.add(p.first);
+		else modelmanager.add(p.first);
+		preloaded[p.first] = p.second;
+	}
+}
+
+void World::releasePreload(const string &name, bool wmo)
+{
+	if (wmo) wmomanager.delbyname(name);
+	else modelmanager.delbyname(name);
+}
+
+void World::updatePreloads(const vector<TileRequest> &requests)
+{
+	if (!placements.loaded()) return;
+
+	// the tiles on the way, soonest first, and the ones being uploaded
+	vector<pair<int,int> > tiles;
+	for (vector<TileRequest>::const_iterator it = requests.begin(); it != requests.end(); ++it) {
+		tiles.push_back(make_pair(it->x, it->z));
+	}
+	for (vector<MapTile*>::iterator it = uploadqueue.begin(); it != uploadqueue.end(); ++it) {
+		tiles.push_back(make_pair((*it)->x, (*it)->z));
+	}
+	if (tiles == preloadtiles) return;
+	preloadtiles = tiles;
+
+	// what's placed in them, including what reaches in from the tiles around
+	map<string, bool> wanted;
+	vector<pair<string, bool> > order;
+	vector<const IndexedPlacement*> found;
+	for (vector<pair<int,int> >::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+		Vec3D vmin(it->first * TILESIZE, -1e9f, it->second * TILESIZE);
+		Vec3D vmax((it->first+1) * TILESIZE, 1e9f, (it->second+1) * TILESIZE);
+		found.clear();
+		placements.query(vmin, vmax, found);
+		for (vector<const IndexedPlacement*>::iterator p = found.begin(); p != found.end(); ++p) {
+			pair<string, bool> e(placements.names[(*p)->nameid], ((*p)->flags & PLACEMENT_WMO) != 0);
+			if (wanted.insert(e).second) order.push_back(e);
+		}
+	}
+
+	// let go of what the path has moved away from; tiles that got loaded meanwhile hold their own references
+	for (map<string, bool>::iterator it = preloaded.begin(); it != preloaded.end(); ) {
+		if (wanted.find(it->first) == wanted.end()) {
+			releasePreload(it->first, it->second);
+			preloaded.erase(it++);
+		} else ++it;
+	}
+	preloadqueue.clear();
+	for (vector<pair<string, bool> >::iterator it = order.begin(); it != order.end(); ++it) {
+		if (preloaded.find(it->first) == preloaded.end()) preloadqueue.push_back(*it);
+	}
+}
+
+void World::prefetchTiles()
+{
+	// queue up whatever the loader finished since the last tick
+	vector<MapTile*> ready;
+	loader->takeAll(ready);
+	for (vector<MapTile*>::iterator it = ready.begin(); it != ready.end(); ++it) {
+		MapTile *tile = *it;
+		if (tileLoaded(tile->x, tile->z)) {
+			delete tile;
+			continue;
+		}
+		uploadqueue.push_back(tile);
+	}
+	uploadTiles();
+
+	// extrapolate the camera path and queue the tiles around every tile it crosses,
+	// ordered by when we'd get there
+	vector<TileRequest> requests;
+	float speed = velocity.length();
+	if (prefetchtime > 0 && speed > 1.0f) {
+		// sample a few times per tile, but don't go crazy at very high speeds
+		float step = TILESIZE * 0.25f / speed;
+		if (step < prefetchtime / 256.0f) step = prefetchtime / 256.0f;
+		int lastx = cx, lastz = cz;
+		for (float t = step; t <= prefetchtime; t += step) {
+			Vec3D p = camera + velocity * t;
+			if (p.x < 0 || p.z < 0) break;
+			int tx = (int)(p.x / TILESIZE), tz = (int)(p.z / TILESIZE);
+			if (tx == lastx && tz == lastz) continue;
+			lastx = tx;
+			lastz = tz;
+			for (int j=tz-tileradius; j<=tz+tileradius; j++) {
+				for (int i=tx-tileradius; i<=tx+tileradius; i++) {
+					if (!inWindow(i-tx, j-tz) || !oktile(i,j) || !maps[j][i]) continue;
+					if (tileLoaded(i,j)) continue;
+					bool queued = false;
+					for (vector<TileRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
+						if (it->x == i && it->z == j) queued = true;
+					}
+					if (!queued) {
+						TileRequest r;
+						r.x = i;
+						r.z = j;
+						r.eta = t;
+						requests.push_back(r);
+					}
+				}
+			}
+		}
+	}
+	loader->setQueue(requests);
+	updatePreloads(requests);
+}
 
-	// TODO: make a loader thread  or something :(
+void World::resetTileStats()
+{
+	tilestalls = 0;
+	stallsprevented = 0;
+	tilesprefetched = 0;
+}
 
-	char name[256];
-	sprintf(name,"World\\Maps\\%s\\%s_%d_%d.adt", basename.c_str(), basename.c_str(), x, z);
+void World::trimTileCache()
+{
+	// throw away tiles until we're within budget, the ones around the camera are always kept
+	unsigned int now = SDL_GetTicks();
+	while (tilecachebytes > tilecachebudget) {
+		map<int, MapTile*>::iterator victim = maptilecache.end();
+		float maxscore = -1.0f;
+		for (map<int, MapTile*>::iterator it = maptilecache.begin(); it != maptilecache.end(); ++it) {
+			MapTile *t = it->second;
+			int dx = t->x - cx, dz = t->z - cz;
+			if (inWindow(dx, dz)) continue;
+			// far away and long unseen goes first
+			float score = sqrtf((float)(dx*dx + dz*dz)) + (now - t->lastused) / TILECACHE_AGEUNIT;
+			if (score > maxscore) {
+				maxscore = score;
+				victim = it;
+			}
+		}
+		if (victim == maptilecache.end()) break;
 
-	maptilecache[firstnull] = new MapTile(x,z,name);
-	return maptilecache[firstnull];
+		MapTile *t = victim->second;
+		tilecachebytes -= t->cpubytes + t->gpubytes;
+		maptilecache.erase(victim);
+		delete t;
+	}
+	gLog("Tile cache: %d tiles, %.1f of %.1f MB\n", (int)maptilecache.size(),
+		tilecachebytes / (1024.0f*1024.0f), tilecachebudget / (1024.0f*1024.0f));
 }
 
 
@@ -661,8 +1439,9 @@ void World::setupFog()
 
 void World::draw()
 {
-	WMOInstance::reset();
+	drawframe++;
 	modelmanager.resetAnim();
+	glstate.frame();
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
@@ -680,6 +1459,9 @@ void World::draw()
 	// camera is set up
 	frustum.retrieve();
 
+	updateVisibleTiles();
+	cullTerrain();
+
 	if (thirdperson) {
 		Vec3D l = (lookat-camera).normalize();
 		Vec3D nc = camera + Vec3D(0,300,0);
@@ -700,11 +1482,8 @@ void World::draw()
 	//}
 
 	hadSky = false;
-	for (int j=0; j<3; j++) {
-		for (int i=0; i<3; i++) {
-			if (oktile(i,j) && current[j][i] != 0) current[j][i]->drawSky();
-			if (hadSky) break;
-		}
+	for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+		(*it)->drawSky();
 		if (hadSky) break;
 	}
 	if (gnWMO && !hadSky) {
@@ -740,25 +1519,17 @@ void World::draw()
 	glFogi(GL_FOG_MODE, GL_LINEAR);
 	setupFog();
 
-	// Draw verylowres heightmap
-	if (drawfog && drawterrain) {
+	// Draw the far terrain: the whole map if we have it, else the verylowres heightmap in fog color
+	if (drawterrain && drawhorizon && horizon) {
+		drawHorizon();
+	} else if (drawfog && drawterrain) {
 		glEnable(GL_CULL_FACE);
 		glDisable(GL_DEPTH_TEST);
 		glDisable(GL_LIGHTING);
 		glColor3fv(this->skies->colorSet[FOG_COLOR]);
 		//glColor3f(0,1,0);
 		//glDisable(GL_FOG);
-		const int lrr = 2;
-		for (int i=cx-lrr; i<=cx+lrr; i++) {
-			for (int j=cz-lrr; j<=cz+lrr; j++) {
-				// TODO: some annoying visual artifacts when the verylowres terrain overlaps
-				// maptiles that are close (1-off) - figure out how to fix.
-				// still less annoying than hoels in the horizon when only 2-off verylowres tiles are drawn
-				if ( !(i==cx&&j==cz) && oktile(i,j) && lowrestiles[j][i]) {
-					glCallList(lowrestiles[j][i]);
-				}
-			}
-		}
+		drawLowresTerrain();
 		//glEnable(GL_FOG);
 	}
 
@@ -792,13 +1563,25 @@ void World::draw()
 	glClientActiveTextureARB(GL_TEXTURE0_ARB);
 
 	// height map w/ a zillion texture passes
+	terraincalls = terrainpasses = 0;
 	if (drawterrain) {
-		for (int j=0; j<3; j++) {
-			for (int i=0; i<3; i++) {
-				uselowlod = drawfog;// && i==1 && j==1;
-				if (oktile(i,j) && current[j][i] != 0) current[j][i]->draw();
-			}
+		// the chunks scale their quantized vertices, and the normals with them
+		glEnable(GL_NORMALIZE);
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, stripibo);
+		if (terrainshader) {
+			Vec3D shc = skies->colorSet[SHADOW_COLOR] * 0.3f;
+			terrainshader->use();
+			glUniform3fARB(terrainshadow, shc.x, shc.y, shc.z);
+			glUniform1fARB(terrainfog, glIsEnabled(GL_FOG) ? 1.0f : 0.0f);
+			Shader::unuse();
 		}
+		// the terrain passes go through the state cache, everything above set state directly
+		glstate.invalidate();
+		for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+			(*it)->draw();
+		}
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+		glDisable(GL_NORMALIZE);
 	}
 
 	glActiveTextureARB(GL_TEXTURE1_ARB);
@@ -812,9 +1595,9 @@ void World::draw()
 	glDisable(GL_ALPHA_TEST);
 
 	// gosh darn alpha blended evil
-	for (int j=0; j<3; j++) {
-		for (int i=0; i<3; i++) {
-			if (drawterrain && oktile(i,j) && current[j][i] != 0)	current[j][i]->drawWater();
+	if (drawterrain) {
+		for (vector<MapTile*>::iterator it = visibletiles.begin(); it != visibletiles.end(); ++it) {
+			(*it)->drawWater();
 		}
 	}
 	glColor4f(1,1,1,1);
@@ -838,6 +1621,8 @@ void World::draw()
 		glLightf(light, GL_QUADRATIC_ATTENUATION, l_quadratic);
 	}
 
+	wmogroups = wmogroupsdrawn = 0;
+	modelsdrawn = 0;
 	if (gnWMO) {
 		oob = false;
 		for (int i=0; i<gnWMO; i++) {
@@ -846,9 +1631,9 @@ void World::draw()
 	}
 	
 	// map objects
-	for (int j=0; j<3; j++) {
-		for (int i=0; i<3; i++) {
-			if (oktile(i,j) && drawwmo && current[j][i] != 0) current[j][i]->drawObjects();
+	if (drawwmo) {
+		for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+			(*it)->drawObjects();
 		}
 	}
 
@@ -857,11 +1642,13 @@ void World::draw()
 
 	glColor4f(1,1,1,1);
 	//models
-	for (int j=0; j<3; j++) {
-		for (int i=0; i<3; i++) {
-			if (oktile(i,j) && drawmodels && current[j][i] != 0) current[j][i]->drawModels();
+	if (drawmodels) {
+		for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+			(*it)->drawModels();
 		}
 	}
+	// the queued model passes, and the transparent water too
+	renderqueue->flush();
 
 	/*
 	// temp frustum code
@@ -885,9 +1672,9 @@ void World::draw()
 	glColor4f(1,1,1,1);
 	glDisable(GL_COLOR_MATERIAL);
 
-	if (current[1][1] != 0 || oob) {
-		if (oob || (camera.x<current[1][1]->xbase) || (camera.x>(current[1][1]->xbase+TILESIZE))
-			|| (camera.z<current[1][1]->zbase) || (camera.z>(current[1][1]->zbase+TILESIZE)) )
+	if (curtile != 0 || oob) {
+		if (oob || (camera.x<curtile->xbase) || (camera.x>(curtile->xbase+TILESIZE))
+			|| (camera.z<curtile->zbase) || (camera.z>(curtile->zbase+TILESIZE)) )
 		{
 			ex = (int)(camera.x / TILESIZE);
 			ez = (int)(camera.z / TILESIZE);
@@ -899,6 +1686,24 @@ void World::draw()
 }
 
 
+void World::updateVisibleTiles()
+{
+	// frustum cull the window and sort what's left front to back
+	unsigned int now = SDL_GetTicks();
+	vector< pair<float, MapTile*> > vis;
+	for (vector<MapTile*>::iterator it = current.begin(); it != current.end(); ++it) {
+		MapTile *tile = *it;
+		tile->lastused = now;
+		if (!tile->ok || !frustum.intersects(tile->topnode.vmin, tile->topnode.vmax)) continue;
+		Vec3D c = (tile->topnode.vmin + tile->topnode.vmax) * 0.5f;
+		vis.push_back(make_pair((c - camera).lengthSquared(), tile));
+	}
+	sort(vis.begin(), vis.end());
+	visibletiles.clear();
+	for (size_t i=0; i<vis.size(); i++) visibletiles.push_back(vis[i].second);
+}
+
+
 void World::tick(float dt)
 {
 	if (loading) {
@@ -908,6 +1713,8 @@ void World::tick(float dt)
 		ex = ez = -1;
 		loading = false;
 	}
+	if (loader) prefetchTiles();
+
 	while (dt > 0.1f) {
 		modelmanager.updateEmitters(0.1f);
 		dt -= 0.1f;
@@ -925,10 +1732,12 @@ unsigned int World::getAreaID()
 	mcx = (int) (fmod(camera.x, TILESIZE) / CHUNKSIZE);
 	mcz = (int) (fmod(camera.z, TILESIZE) / CHUNKSIZE);
 
-	if ((mtx<cx-1) || (mtx>cx+1) || (mtz<cz-1) || (mtz>cz+1)) return 0;
-	
-	curTile = current[mtz-cz+1][mtx-cx+1];
-	if(curTile == 0) return 0;
+	if (!oktile(mtx,mtz)) return 0;
+
+	map<int, MapTile*>::iterator it = maptilecache.find(mtz*64+mtx);
+	if (it == maptilecache.end()) return 0;
+	curTile = it->second;
+	if (!curTile->ok) return 0;
 
 	MapChunk *curChunk = curTile->getChunk(mcx, mcz);
 
@@ -6,25 +6,139 @@
 #include "wmo.h"
 #include "frustum.h"
 #include "sky.h"
+#include "tileloader.h"
+#include "horizon.h"
+#include "shader.h"
+#include "occlusion.h"
+#include "skyline.h"
+#include "renderqueue.h"
+#include "placementindex.h"
 
 #include <string>
-
-#define MAPTILECACHESIZE 16
+#include <map>
+#include <set>
 
 const float detail_size = 8.0f;
 
+// low-res WDL terrain: 17x17 outer and 16x16 inner heights per tile, 4 triangles per cell
+const int lowresbufsize = 17*17 + 16*16;
+const int lowresindices = 16*16*4*3;
+
+// default memory budget of the tile cache, in bytes
+const size_t TILECACHE_DEFAULTBUDGET = 128 * 1024 * 1024;
+// how many milliseconds without being drawn count as much as one tile of distance when evicting
+const float TILECACHE_AGEUNIT = 20000.0f;
+
+extern size_t gTileCacheBudget;
+// how many seconds ahead the camera path is extrapolated to prefetch tiles, 0 to disable
+extern float gPrefetchTime;
+// per frame budget for uploading prefetched tiles, in milliseconds and bytes
+extern unsigned int gUploadTimeBudget;
+extern size_t gUploadByteBudget;
+// size and shape of the high detail tile window
+extern int gTileRadius;
+extern bool gCircularWindow;
+// tiles of low-res terrain drawn in each direction around the camera
+extern int gLowresRadius;
+// draw the whole continent from the WDL instead of the low-res ring
+extern bool gDrawHorizon;
+// splat terrain textures in one GLSL pass if the driver can
+extern bool gUseShaders;
+// largest terrain height error allowed on screen, in pixels
+extern float gLODPixels;
+// software occlusion culling, and the worker threads it rasterizes with besides the main one
+extern bool gOcclusion;
+extern int gOcclusionThreads;
+// skip what is hidden behind the terrain's horizon
+extern bool gSkyline;
+// draw only the WMO groups that can be seen through their portals
+extern bool gPortalCulling;
+// cull map doodads by their boxes instead of their bounding spheres
+extern bool gModelBoxes;
+// draw the doodads' opaque passes sorted by state instead of one instance at a time
+extern bool gRenderQueue;
+// drop GL state changes that set what is already set, and check the shadow state against glGet
+extern bool gStateCache;
+extern bool gStateCheck;
+
 class World {
 
-	MapTile *maptilecache[MAPTILECACHESIZE];
-	MapTile *current[3][3];
+	// loaded tiles, keyed by z*64+x
+	std::map<int, MapTile*> maptilecache;
+	// tiles in the high detail window around the current tile
+	std::vector<MapTile*> current;
+	MapTile *curtile;
+	// the ones of those in view, nearest first
+	std::vector<MapTile*> visibletiles;
 	int ex,ez;
 
+	TileLoader *loader;
+	// decoded tiles being uploaded a bit at a time
+	std::vector<MapTile*> uploadqueue;
+
+	// models and WMOs placed in the tiles on the way, found in the placement index and loaded
+	// in what's left of the upload budget ahead of their tiles; each holds a reference for as
+	// long as one of those tiles is still coming (name, is a WMO)
+	std::vector<std::pair<int,int> > preloadtiles;
+	std::vector<std::pair<std::string, bool> > preloadqueue;
+	std::map<std::string, bool> preloaded;
+	void updatePreloads(const std::vector<TileRequest> &requests);
+	void releasePreload(const std::string &name, bool wmo);
+
+	void trimTileCache();
+	void addTile(MapTile *tile);
+	void prefetchTiles();
+	void uploadTiles();
+	bool tileLoaded(int x, int z);
+	void updateVisibleTiles();
+	void updateFarClip();
+
+	// low-res terrain: heights from the WDL until they're uploaded, then one shared vbo/ibo
+	std::vector<short> wdlheights;
+	int lowresindex[64][64];
+	int nLowres;
+	std::vector<Vec3D> lowresmin, lowresmax;
+	GLuint lowresvbo, lowresibo;
+
 public:
 
+	Horizon *horizon;
+	bool drawhorizon;
+
+	OcclusionBuffer *occlusion;
+	Skyline *skyline;
+	RenderQueue *renderqueue;
+
+	// WMO groups only drawn when seen through the portals, and how many were this frame
+	bool portalculling;
+	int wmogroups, wmogroupsdrawn;
+	// map doodads culled by box or by sphere, and how many got through this frame
+	bool modelboxes;
+	int modelsdrawn;
+	void cullTerrain();
+	void updateSkyline();
+	void updateOcclusion();
+	// camera under the terrain this frame (caves, dungeon entrances), then the ground hides nothing
+	bool underground;
+	bool cameraUnderground();
+
+	size_t tilecachebytes, tilecachebudget;
+
+	int tileradius;
+	bool circularwindow;
+	int lowresradius;
+
+	// camera velocity in units per second, set by the viewer each tick
+	Vec3D velocity;
+	float prefetchtime;
+	// tiles that had to be loaded synchronously vs. ones the prefetcher had ready
+	int tilestalls, stallsprevented, tilesprefetched;
+	unsigned int uploadtimebudget;
+	size_t uploadbytebudget;
+
 	std::string basename;
 
 	bool maps[64][64];
-	GLuint lowrestiles[64][64];
 	bool autoheight;
 
 	std::vector<std::string> gwmos;
@@ -50,6 +164,49 @@ public:
 
 	short *mapstrip,*mapstrip2;
 
+	// height step of every tile's quantized terrain vertices, the same for the whole map so
+	// the tiles agree on the heights of their shared edges
+	float terrainstep;
+
+	// terrain index buffer: the strips above once for every chunk slot of a tile vertex buffer
+	// (the high res ones from strip2ofs), followed by the strips of every hole mask and slot in use
+	GLuint stripibo;
+	int strip2ofs;
+	std::vector<unsigned short> stripindices;
+	size_t stripibosize;
+	std::map<int, std::pair<int,int> > holestrips;
+	int holeStrip(int holes, int slot, int &len);
+	// triangle lists of the coarse detail levels, made on first use for each stitch and slot
+	std::map<int, std::pair<int,int> > lodstrips;
+	int lodStrip(int lod, int stitch, int slot, int &len);
+	int addStrip(const unsigned short *s, int len);
+
+	// terrain detail: the coarsest level of each chunk whose height error shows as less than
+	// lodpixels on screen, neighbours at most one level apart
+	float lodpixels;
+	int lodframe;
+
+	// every model and WMO placement of the map, if the index has been built
+	PlacementIndex placements;
+
+	// counts the frames, and the frame each WMO instance id was last drawn in
+	int drawframe;
+	std::map<int, int> wmoframes;
+	int *wmoStamp(int id);
+	void selectTerrainLOD();
+	MapChunk *terrainNeighbour(MapChunk *c, int side);
+
+	// terrain draw calls issued this frame, and the chunk passes they covered
+	int terraincalls, terrainpasses;
+	// terrain triangles drawn this frame, and what the full detail strips would have taken
+	int terraintris, terrainfulltris;
+
+	// single pass terrain splatting; 0 without GLSL (or with -noshaders), then the chunks
+	// are drawn in one pass per texture layer plus one for the shadow
+	Shader *terrainshader;
+	GLint terrainlayers, terrainanim, terrainshadow, terrainfog;
+	void initTerrainShader();
+
 	TextureID water;
 	Vec3D camera, lookat;
 	Frustum frustum;
@@ -67,13 +224,25 @@ public:
 	World(const char* name);
 	~World();
 	void init();
-	void initMinimap();
+	void initWDL();
 	void initDisplay();
 	void initWMOs();
 	void initLowresTerrain();
+	void drawLowresTerrain();
+	void drawHorizon();
 
 	void enterTile(int x, int z);
 	MapTile *loadTile(int x, int z);
+	int tilesCached() { return (int)maptilecache.size(); }
+	int tilesInWindow() { return (int)current.size(); }
+	int tilesVisible() { return (int)visibletiles.size(); }
+	bool inWindow(int dx, int dz);
+	void setTileRadius(int r, bool circular);
+	void setLowresRadius(int r);
+	void benchmarkCulling();
+	int tilesPending() { return (loader ? loader->pending() : 0) + (int)uploadqueue.size(); }
+	int modelsPreloaded() { return (int)preloaded.size(); }
+	void resetTileStats();
 	void tick(float dt);
 	void draw();
 
@@ -89,6 +258,9 @@ public:
 extern World *gWorld;
 
 
+// minimap palette for a WDL height value
+void heightColor(short hval, unsigned char &r, unsigned char &g, unsigned char &b);
+
 void lightingDefaults();
 void myFakeLighting();
 
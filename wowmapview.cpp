@@ -20,6 +20,9 @@
 #include "test.h"
 #include "menu.h"
 #include "areadb.h"
+#include "adtcache.h"
+#include "placementindex.h"
+#include "world.h"
 
 int fullscreen = 0;
 
@@ -61,9 +64,15 @@ void deleteFonts()
 FILE *flog;
 bool glogfirst = true;
 
+// the tile loader thread logs too; the first message is logged before it is started
+SDL_mutex *gLogMutex = 0;
+
 
 void gLog(char *str, ...)
 {
+	if (!gLogMutex) gLogMutex = SDL_CreateMutex();
+	SDL_LockMutex(gLogMutex);
+
 	if (glogfirst) {
 		flog = fopen("log.txt","w");
 		fclose(flog);
@@ -79,6 +88,8 @@ void gLog(char *str, ...)
 	va_end (ap);
 
 	fclose(flog);
+
+	SDL_UnlockMutex(gLogMutex);
 }
 
 
@@ -108,6 +119,7 @@ int main(int argc, char *argv[])
 	int yres = 768;
 
 	bool usePatch = true;
+	const char *indexmap = 0;
 
 	for (int i=1; i<argc; i++) {
 		if (!strcmp(argv[i],"-f")) fullscreen = 1;
@@ -146,6 +158,53 @@ int main(int argc, char *argv[])
 		}
 		else if (!strcmp(argv[i],"-p")) usePatch = true;
 		else if (!strcmp(argv[i],"-np")) usePatch = false;
+		else if (!strcmp(argv[i],"-cache")) gADTCache.enabled = true;
+		else if (!strcmp(argv[i],"-index") && i+1<argc) {
+			// scan all tiles of a map into its placement index and quit, no window
+			indexmap = argv[++i];
+		}
+		else if (!strcmp(argv[i],"-tilecache") && i+1<argc) {
+			// tile cache budget in megabytes
+			gTileCacheBudget = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		}
+		else if (!strcmp(argv[i],"-prefetch") && i+1<argc) {
+			// seconds of camera movement to load tiles ahead for, 0 turns the loader thread off
+			gPrefetchTime = (float)atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-tileradius") && i+1<argc) {
+			// high detail tiles loaded in each direction around the camera
+			gTileRadius = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-circular")) gCircularWindow = true;
+		else if (!strcmp(argv[i],"-lowresradius") && i+1<argc) {
+			// tiles of low-res far terrain drawn in each direction
+			gLowresRadius = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-nohorizon")) gDrawHorizon = false;
+		else if (!strcmp(argv[i],"-noshaders")) gUseShaders = false;
+		else if (!strcmp(argv[i],"-noocclusion")) gOcclusion = false;
+		else if (!strcmp(argv[i],"-noskyline")) gSkyline = false;
+		else if (!strcmp(argv[i],"-noportals")) gPortalCulling = false;
+		else if (!strcmp(argv[i],"-modelspheres")) gModelBoxes = false;
+		else if (!strcmp(argv[i],"-norenderqueue")) gRenderQueue = false;
+		else if (!strcmp(argv[i],"-nostatecache")) gStateCache = false;
+		else if (!strcmp(argv[i],"-statecheck")) gStateCheck = true;
+		else if (!strcmp(argv[i],"-occlusionthreads") && i+1<argc) {
+			// worker threads rasterizing the occluders, on top of the main thread
+			gOcclusionThreads = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-lodpixels") && i+1<argc) {
+			// terrain height error allowed on screen, 0 for full detail everywhere
+			gLODPixels = (float)atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-uploadms") && i+1<argc) {
+			// per frame time budget for uploading prefetched tiles
+			gUploadTimeBudget = (unsigned int)atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-uploadkb") && i+1<argc) {
+			// per frame texture/buffer byte budget for uploading prefetched tiles
+			gUploadByteBudget = (size_t)atoi(argv[++i]) * 1024;
+		}
 	}
 
 
@@ -163,11 +222,24 @@ int main(int argc, char *argv[])
 		// patch goes first -> fake priority handling
 		sprintf(path, "%s%s", gamepath, "patch.MPQ");
 		archives.push_back(new MPQArchive(path));
+		gADTCache.addArchive(path);
 	}
 
 	for (size_t i=0; i<7; i++) {
 		sprintf(path, "%s%s", gamepath, archiveNames[i]);
 		archives.push_back(new MPQArchive(path));
+		gADTCache.addArchive(path);
+	}
+
+	if (indexmap) {
+		// no window, but the scan is timed
+		SDL_Init(SDL_INIT_TIMER);
+		PlacementIndex::build(indexmap);
+		SDL_Quit();
+		for (std::vector<MPQArchive*>::iterator it = archives.begin(); it != archives.end(); ++it) {
+			(*it)->close();
+		}
+		return 0;
 	}
 
 	gAreaDB.open();